@@ -0,0 +1,143 @@
+#include <ulib/cache.h>
+#include <ulib/rand.h>
+#include <ulib/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Count the key comparisons.  */
+static unsigned long long ncmp;
+
+#define ULIB_AVL_TREE_KEY_TYPE const char *
+#define ULIB_AVL_TREE_COMPARE(a, b) (ncmp++, strcmp((a), (b)))
+#define ULIB_AVL_TREE_TYPE str_tree
+
+#include <ulib/avl-tree.h>
+#include <ulib/avl-tree.c>
+
+#define NMAX 1000000U
+#define KEYLEN 24
+
+static ulib_cache *str_tree_cache;
+static char (*keys)[KEYLEN];
+static unsigned int perm[NMAX];
+static const char *lookup_keys[NMAX];
+static int found[NMAX];
+
+static double
+elapsed(const ulib_time *ts1, const ulib_time *ts2) {
+    return ts2->sec * 1e6 + ts2->usec - ts1->sec * 1e6 - ts1->usec;
+}
+
+static void
+shuffle(unsigned int n) {
+    unsigned int i, j, t;
+
+    for (i = n - 1; i > 0; i--) {
+        j = ulib_rand(0, i);
+        t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+}
+
+/* Insert, look up, one by one and in a batch, and delete N keys with
+   a long common prefix, in random order, and report the time and the
+   comparisons per operation.  */
+static void
+bench(unsigned int n) {
+    str_tree *root = 0, *elt;
+    ulib_time ts1, ts2;
+    unsigned int i;
+    double tm[4];
+    unsigned long long cmp[3];
+
+    for (i = 0; i < n; i++)
+        perm[i] = i;
+
+    shuffle(n);
+    ncmp = 0;
+    ulib_gettime(&ts1);
+    for (i = 0; i < n; i++) {
+        elt = ulib_cache_alloc(str_tree_cache);
+        elt->key = keys[perm[i]];
+        if (str_tree_insert(&root, elt) < 0)
+            abort();
+    }
+    ulib_gettime(&ts2);
+    tm[0] = elapsed(&ts1, &ts2);
+    cmp[0] = ncmp;
+
+    shuffle(n);
+    ncmp = 0;
+    ulib_gettime(&ts1);
+    for (i = 0; i < n; i++)
+        if (!str_tree_lookup(root, keys[perm[i]]))
+            abort();
+    ulib_gettime(&ts2);
+    tm[1] = elapsed(&ts1, &ts2);
+    cmp[1] = ncmp;
+
+    for (i = 0; i < n; i++)
+        lookup_keys[i] = keys[perm[i]];
+    ulib_gettime(&ts1);
+    str_tree_lookup_batch(root, n, lookup_keys, found);
+    ulib_gettime(&ts2);
+    tm[3] = elapsed(&ts1, &ts2);
+    for (i = 0; i < n; i++)
+        if (!found[i])
+            abort();
+
+    shuffle(n);
+    ncmp = 0;
+    ulib_gettime(&ts1);
+    for (i = 0; i < n; i++) {
+        if ((elt = str_tree_delete(&root, keys[perm[i]])) == 0)
+            abort();
+        ulib_cache_free(str_tree_cache, elt);
+    }
+    ulib_gettime(&ts2);
+    tm[2] = elapsed(&ts1, &ts2);
+    cmp[2] = ncmp;
+
+    if (root != 0)
+        abort();
+    ulib_cache_flush(str_tree_cache);
+
+    printf("%8u keys: insert %.3f us %.1f cmp, lookup %.3f us %.1f cmp, "
+           "batch %.3f us, delete %.3f us %.1f cmp\n",
+           n,
+           tm[0] / n,
+           (double)cmp[0] / n,
+           tm[1] / n,
+           (double)cmp[1] / n,
+           tm[3] / n,
+           tm[2] / n,
+           (double)cmp[2] / n);
+}
+
+int
+main() {
+    unsigned int i, n;
+
+    str_tree_cache = ulib_cache_create(
+        ULIB_CACHE_SIZE, sizeof(str_tree), ULIB_CACHE_ALIGN, sizeof(void *), 0);
+    if ((keys = malloc(NMAX * sizeof(*keys))) == 0)
+        abort();
+    for (i = 0; i < NMAX; i++)
+        snprintf(keys[i], KEYLEN, "avl-tree-key-%010u", i);
+
+    for (n = 1000; n <= NMAX; n *= 10)
+        bench(n);
+
+    free(keys);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ulib/cache.h>
+#include <ulib/epoch.h>
+#include <ulib/time.h>
+
+#define ULIB_AVL_TREE_KEY_TYPE unsigned int
+#define ULIB_AVL_TREE_DATA_TYPE unsigned int
+#define ULIB_AVL_TREE_TYPE uint_tree
+#define ULIB_AVL_TREE_AUGMENT_SIZE
+#define ULIB_AVL_TREE_CONCURRENT
+
+#include <ulib/avl-tree.h>
+#include <ulib/avl-tree.c>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NKEYS 100000U
+#define MAX_READERS 8
+#define NWRITES 100000U
+#define NTREES 2
+
+/* Trees, updated by a writer each, and read by all the readers.  */
+struct tree {
+    uint_tree *_Atomic root;
+    ulib_cache *cache;
+    ulib_epoch_domain epoch;
+};
+
+static struct tree trees[NTREES];
+static atomic_int stop;
+static unsigned long lookups[MAX_READERS];
+
+static int
+check_balance(const uint_tree *t) {
+    int hl, hr;
+
+    if (t == 0)
+        return 0;
+
+    hl = check_balance(t->left);
+    hr = check_balance(t->right);
+    if (t->balance != hr - hl || t->balance < -1 || t->balance > 1
+        || t->size != uint_tree_size(t->left) + uint_tree_size(t->right) + 1
+        || (t->left && t->left->key >= t->key) || (t->right && t->right->key <= t->key)
+        || t->data != ~t->key)
+        abort();
+    return (hl > hr ? hl : hr) + 1;
+}
+
+static uint_tree *
+make_node(struct tree *t, unsigned int key) {
+    uint_tree *elt = (uint_tree *)ulib_cache_alloc(t->cache);
+
+    if (elt == 0)
+        abort();
+    elt->left = elt->right = 0;
+    elt->key = key;
+    elt->data = ~key;
+    return elt;
+}
+
+/* Look up even keys, which are always present, and odd keys, which
+   come and go, in all the trees without locks.  */
+static void *
+reader(void *arg) {
+    unsigned int k, id = (unsigned int)(size_t)arg, seed = id + 1;
+    unsigned long n = 0;
+    const uint_tree *r;
+    unsigned int *d;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        seed = seed * 1103515245U + 12345U;
+        k = (seed >> 8) % (2 * NKEYS);
+
+        if (ulib_epoch_enter() != 0)
+            abort();
+        r = uint_tree_cow_root(&trees[n % NTREES].root);
+        d = uint_tree_lookup(r, k);
+        if ((d && *d != ~k) || (k % 2 == 0 && !d))
+            abort();
+        if (n % 4096 == 0 && (r->size < NKEYS || r->size > 2 * NKEYS))
+            abort();
+        ulib_epoch_exit();
+        n++;
+    }
+
+    lookups[id] = n;
+    return 0;
+}
+
+/* Toggle random odd keys of the tree ARG.  The writers of different
+   trees run concurrently, each releasing only the nodes of its own
+   tree to its cache.  */
+static void *
+writer(void *arg) {
+    struct tree *t = (struct tree *)arg;
+    unsigned int i, k, seed = (unsigned int)(t - trees) + 1;
+
+    for (i = 0; i < NWRITES; i++) {
+        seed = seed * 1103515245U + 12345U;
+        k = 2 * ((seed >> 8) % NKEYS) + 1;
+        if (uint_tree_cow_delete(&t->root, k, &t->epoch) != 0
+            && uint_tree_cow_insert(&t->root, make_node(t, k), &t->epoch) != 0)
+            abort();
+        if (i % 50000 == 0)
+            check_balance(atomic_load(&t->root));
+    }
+    return 0;
+}
+
+/* Update the trees with N concurrent readers and report the lookup
+   throughput.  */
+static void
+run(unsigned int n) {
+    pthread_t thr[MAX_READERS], wthr[NTREES];
+    unsigned long total = 0;
+    ulib_time ts1, ts2;
+    unsigned int i;
+    double tm;
+
+    atomic_store(&stop, 0);
+    for (i = 0; i < n; i++)
+        if (pthread_create(&thr[i], 0, reader, (void *)(size_t)i) != 0)
+            abort();
+
+    ulib_gettime(&ts1);
+    for (i = 0; i < NTREES; i++)
+        if (pthread_create(&wthr[i], 0, writer, &trees[i]) != 0)
+            abort();
+    for (i = 0; i < NTREES; i++)
+        pthread_join(wthr[i], 0);
+    ulib_gettime(&ts2);
+
+    atomic_store(&stop, 1);
+    for (i = 0; i < n; i++) {
+        pthread_join(thr[i], 0);
+        total += lookups[i];
+    }
+
+    tm = ts2.sec * 1e6 + ts2.usec - ts1.sec * 1e6 - ts1.usec;
+    printf("cow: %u readers, %u writers, %.1f lookups/us, %.3f us per write\n",
+           n,
+           NTREES,
+           total / tm,
+           tm / NWRITES);
+}
+
+int
+main() {
+    unsigned int i, j, n;
+    struct tree *t;
+    uint_tree *elt;
+
+    setvbuf(stdout, 0, _IONBF, 0);
+
+    for (j = 0; j < NTREES; j++) {
+        t = &trees[j];
+        t->cache = ulib_cache_create(
+            ULIB_CACHE_SIZE, sizeof(uint_tree), ULIB_CACHE_ALIGN, sizeof(void *), 0);
+        ulib_epoch_domain_init(&t->epoch, t->cache);
+        for (i = 0; i < NKEYS; i++)
+            if (uint_tree_cow_insert(&t->root, make_node(t, 2 * i), &t->epoch) != 0)
+                abort();
+    }
+
+    /* Duplicates and missing keys leave the tree alone.  */
+    t = &trees[0];
+    elt = make_node(t, 0);
+    if (uint_tree_cow_insert(&t->root, elt, &t->epoch) == 0
+        || uint_tree_cow_delete(&t->root, 1, &t->epoch) == 0)
+        abort();
+    ulib_cache_free(t->cache, elt);
+    check_balance(atomic_load(&t->root));
+
+    for (n = 1; n <= MAX_READERS; n *= 2)
+        run(n);
+
+    for (j = 0; j < NTREES; j++) {
+        t = &trees[j];
+        check_balance(atomic_load(&t->root));
+        for (i = 0; i < 2 * NKEYS; i++) {
+            n = uint_tree_lookup(atomic_load(&t->root), i) != 0;
+            if (n != (uint_tree_cow_delete(&t->root, i, &t->epoch) == 0)
+                || (i % 2 == 0 && !n))
+                abort();
+        }
+        ulib_epoch_domain_destroy(&t->epoch);
+        if (atomic_load(&t->root) != 0)
+            abort();
+    }
+
+    printf("cow: ok\n");
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
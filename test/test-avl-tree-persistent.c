@@ -0,0 +1,288 @@
+#include <ulib/cache.h>
+#include <ulib/rand.h>
+#include <ulib/time.h>
+
+#define ULIB_AVL_TREE_KEY_TYPE unsigned int
+#define ULIB_AVL_TREE_TYPE uint_tree
+#define ULIB_AVL_TREE_AUGMENT_SIZE
+#define ULIB_AVL_TREE_PERSISTENT
+
+#include <ulib/avl-tree.h>
+#include <ulib/avl-tree.c>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NKEYS 2000U
+#define NVERSIONS 64U
+#define NOPS 100000U
+#define POISON 0xdeadbeefU
+
+static ulib_cache *uint_tree_cache;
+static unsigned long nfree;
+
+/* The keys of the current version and of the snapshots.  */
+static unsigned char present[NKEYS];
+static unsigned char snap_keys[NVERSIONS][NKEYS];
+static uint_tree *snap[NVERSIONS];
+
+/* Links between the nodes of all the versions, the handles having no
+   parent.  */
+struct link {
+    uint_tree *parent, *child;
+};
+
+static struct link links[NVERSIONS * NKEYS * 2];
+static unsigned int nlinks;
+
+/* Poison released nodes, so that later accesses get caught.  */
+static void
+clear_node(void *obj, unsigned int size) {
+    uint_tree *t = (uint_tree *)obj;
+
+    (void)size;
+    t->key = POISON;
+    t->refs = 0;
+    nfree++;
+}
+
+static int
+check_balance(const uint_tree *t) {
+    int hl, hr;
+
+    if (t == 0)
+        return 0;
+
+    if (t->key == POISON || t->refs == 0)
+        abort();
+    hl = check_balance(t->left);
+    hr = check_balance(t->right);
+    if (t->balance != hr - hl || t->balance < -1 || t->balance > 1
+        || t->size != uint_tree_size(t->left) + uint_tree_size(t->right) + 1)
+        abort();
+    return (hl > hr ? hl : hr) + 1;
+}
+
+/* Check the version R holds exactly the keys KEYS.  */
+static void
+check_version(const uint_tree *r, const unsigned char *keys) {
+    unsigned int k, n = 0;
+
+    check_balance(r);
+    for (k = 0; k < NKEYS; k++) {
+        if (uint_tree_lookup(r, k) != keys[k])
+            abort();
+        n += keys[k];
+    }
+    if (uint_tree_size(r) != n)
+        abort();
+}
+
+static void
+add_links(uint_tree *t) {
+    if (t->left) {
+        links[nlinks].parent = t;
+        links[nlinks++].child = t->left;
+        add_links(t->left);
+    }
+    if (t->right) {
+        links[nlinks].parent = t;
+        links[nlinks++].child = t->right;
+        add_links(t->right);
+    }
+}
+
+static int
+link_cmp(const void *a, const void *b) {
+    const struct link *x = (const struct link *)a, *y = (const struct link *)b;
+
+    if (x->child != y->child)
+        return x->child < y->child ? -1 : 1;
+    if (x->parent != y->parent)
+        return x->parent < y->parent ? -1 : 1;
+    return 0;
+}
+
+/* Check the reference count of every node of the versions at R equals
+   the number of distinct parents plus the number of handles, and
+   return the number of distinct nodes.  */
+static unsigned int
+check_refs(uint_tree **r, unsigned int n) {
+    unsigned int i, j, refs, nodes = 0;
+
+    nlinks = 0;
+    for (i = 0; i < n; i++) {
+        if (r[i] == 0)
+            continue;
+        links[nlinks].parent = 0;
+        links[nlinks++].child = r[i];
+        add_links(r[i]);
+    }
+
+    qsort(links, nlinks, sizeof(links[0]), link_cmp);
+    for (i = 0; i < nlinks; i = j) {
+        refs = 0;
+        for (j = i; j < nlinks && links[j].child == links[i].child; j++)
+            if (links[j].parent == 0 || j == i || links[j].parent != links[j - 1].parent)
+                refs++;
+        if (links[i].child->refs != refs)
+            abort();
+        nodes++;
+    }
+    return nodes;
+}
+
+static uint_tree *
+make_node(unsigned int key) {
+    uint_tree *elt = (uint_tree *)ulib_cache_alloc(uint_tree_cache);
+
+    if (elt == 0)
+        abort();
+    elt->left = elt->right = 0;
+    elt->key = key;
+    return elt;
+}
+
+/* Update a tree at random, taking and dropping snapshots, and check
+   all the live versions stay intact and no node gets leaked.  */
+static void
+test(void) {
+    uint_tree *root = 0, *versions[NVERSIONS + 1], *elt;
+    unsigned int i, k, v, n;
+    unsigned long freed;
+
+    for (i = 0; i < NOPS; i++) {
+        k = ulib_rand(0, NKEYS - 1);
+        if (ulib_rand(0, 1)) {
+            elt = make_node(k);
+            if (uint_tree_persistent_insert(&root, elt, uint_tree_cache) == 0) {
+                if (present[k])
+                    abort();
+                present[k] = 1;
+            } else {
+                if (!present[k])
+                    abort();
+                ulib_cache_free(uint_tree_cache, elt);
+            }
+        } else {
+            if ((uint_tree_persistent_delete(&root, k, uint_tree_cache) == 0)
+                != present[k])
+                abort();
+            present[k] = 0;
+        }
+
+        if (i % (NOPS / NVERSIONS / 2) == 0) {
+            /* Replace a random snapshot, checking the one going away.  */
+            v = ulib_rand(0, NVERSIONS - 1);
+            if (snap[v])
+                check_version(snap[v], snap_keys[v]);
+            uint_tree_release(snap[v], uint_tree_cache);
+            snap[v] = uint_tree_snapshot(root);
+            memcpy(snap_keys[v], present, NKEYS);
+        }
+    }
+
+    check_version(root, present);
+    for (v = 0; v < NVERSIONS; v++) {
+        if (snap[v])
+            check_version(snap[v], snap_keys[v]);
+        versions[v] = snap[v];
+    }
+    versions[NVERSIONS] = root;
+    n = check_refs(versions, NVERSIONS + 1);
+
+    /* Dropping the current version and all the snapshots frees every
+       node exactly once.  */
+    freed = nfree;
+    uint_tree_release(root, uint_tree_cache);
+    for (v = 0; v < NVERSIONS; v++) {
+        uint_tree_release(snap[v], uint_tree_cache);
+        for (k = v + 1; k < NVERSIONS; k++)
+            if (snap[k])
+                check_version(snap[k], snap_keys[k]);
+        snap[v] = 0;
+    }
+    if (nfree - freed != n)
+        abort();
+
+    printf("persistent: ok, %u nodes in %u versions\n", n, NVERSIONS + 1);
+}
+
+static double
+elapsed(const ulib_time *ts1, const ulib_time *ts2) {
+    return ts2->sec * 1e6 + ts2->usec - ts1->sec * 1e6 - ts1->usec;
+}
+
+/* Compare taking a snapshot of a tree of N keys with copying it key
+   by key.  */
+static void
+bench(unsigned int n) {
+    uint_tree *root = 0, *copy, *s;
+    ulib_time ts1, ts2;
+    unsigned int i;
+    double tm[3];
+
+    for (i = 0; i < n; i++)
+        if (uint_tree_persistent_insert(&root, make_node(i), uint_tree_cache) != 0)
+            abort();
+
+    ulib_gettime(&ts1);
+    for (i = 0; i < n; i++)
+        if (uint_tree_persistent_delete(&root, i, uint_tree_cache) != 0
+            || uint_tree_persistent_insert(&root, make_node(i), uint_tree_cache) != 0)
+            abort();
+    ulib_gettime(&ts2);
+    tm[0] = elapsed(&ts1, &ts2) / (2 * n);
+
+    ulib_gettime(&ts1);
+    s = uint_tree_snapshot(root);
+    ulib_gettime(&ts2);
+    tm[1] = elapsed(&ts1, &ts2);
+
+    ulib_gettime(&ts1);
+    copy = 0;
+    for (i = 0; i < n; i++)
+        if (uint_tree_persistent_insert(&copy, make_node(i), uint_tree_cache) != 0)
+            abort();
+    ulib_gettime(&ts2);
+    tm[2] = elapsed(&ts1, &ts2);
+
+    uint_tree_release(s, uint_tree_cache);
+    uint_tree_release(copy, uint_tree_cache);
+    uint_tree_release(root, uint_tree_cache);
+    ulib_cache_flush(uint_tree_cache);
+
+    printf("%8u keys: update %.3f us, snapshot %.3f us, copy %.3f us\n",
+           n,
+           tm[0],
+           tm[1],
+           tm[2]);
+}
+
+int
+main() {
+    unsigned int n;
+
+    setvbuf(stdout, 0, _IONBF, 0);
+
+    uint_tree_cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                                        sizeof(uint_tree),
+                                        ULIB_CACHE_ALIGN,
+                                        sizeof(void *),
+                                        ULIB_CACHE_CLEAR,
+                                        clear_node,
+                                        0);
+
+    test();
+    for (n = 1000; n <= 1000000; n *= 10)
+        bench(n);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
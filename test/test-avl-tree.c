@@ -4,6 +4,8 @@
 
 #define ULIB_AVL_TREE_KEY_TYPE unsigned int
 #define ULIB_AVL_TREE_TYPE uint_tree
+#define ULIB_AVL_TREE_AUGMENT_SIZE
+#define ULIB_AVL_TREE_PARALLEL 12
 
 #include <ulib/avl-tree.h>
 #include <ulib/avl-tree.c>
@@ -121,6 +123,296 @@ test() {
     ulib_cache_flush(uint_tree_cache);
 }
 
+#define NITER 100000U
+
+static int
+check_balance(const uint_tree *t) {
+    int hl, hr;
+
+    if (t == 0)
+        return 0;
+
+    hl = check_balance(t->left);
+    hr = check_balance(t->right);
+    if (t->balance != hr - hl || t->balance < -1 || t->balance > 1
+        || t->size != uint_tree_size(t->left) + uint_tree_size(t->right) + 1)
+        abort();
+    return (hl > hr ? hl : hr) + 1;
+}
+
+#define NBATCH 1000U
+
+static unsigned int perm[NITER];
+static unsigned int batch_keys[NBATCH];
+static int batch_found[NBATCH];
+static unsigned int range_n, range_last;
+
+static int
+range_visit(uint_tree *node, void *arg) {
+    if (range_n > 0 && node->key <= range_last)
+        abort();
+
+    range_last = node->key;
+    return ++range_n == *(unsigned int *)arg;
+}
+
+/* Check the iterators and the range walks over a tree with the keys
+   0, 2, ..., 2 * (N - 1), inserted in ascending or random ORDER.  */
+static void
+test_iter(unsigned int n, int ordered) {
+    uint_tree *t = 0, *elt;
+    unsigned int i, j, lo, hi, limit;
+
+    for (i = 0; i < n; i++)
+        perm[i] = i;
+    for (i = n - 1; !ordered && i > 0; i--) {
+        j = ulib_rand(0, i);
+        lo = perm[i];
+        perm[i] = perm[j];
+        perm[j] = lo;
+    }
+    for (i = 0; i < n; i++) {
+        elt = ulib_cache_alloc(uint_tree_cache);
+        elt->left = elt->right = 0;
+        elt->key = 2 * perm[i];
+        if (uint_tree_insert(&t, elt) < 0)
+            abort();
+    }
+
+    for (i = 0, elt = uint_tree_first(t); elt; elt = uint_tree_next(t, elt), i++)
+        if (elt->key != 2 * i)
+            abort();
+    if (i != n)
+        abort();
+
+    for (i = n, elt = uint_tree_last(t); elt; elt = uint_tree_prev(t, elt))
+        if (elt->key != 2 * --i)
+            abort();
+    if (i != 0)
+        abort();
+
+    for (i = 0; i < n; i++) {
+        if (uint_tree_lower_bound(t, 2 * i)->key != 2 * i
+            || (i > 0 && uint_tree_upper_bound(t, 2 * i - 1)->key != 2 * i))
+            abort();
+        elt = uint_tree_upper_bound(t, 2 * i);
+        if (i < n - 1 ? elt == 0 || elt->key != 2 * i + 2 : elt != 0)
+            abort();
+    }
+    if (uint_tree_lower_bound(t, 2 * n - 1) != 0)
+        abort();
+
+    for (i = 0; i < n; i++) {
+        if (uint_tree_rank(t, 2 * i) != i || uint_tree_rank(t, 2 * i + 1) != i + 1
+            || uint_tree_select(t, i)->key != 2 * i)
+            abort();
+    }
+    if (uint_tree_size(t) != n || uint_tree_select(t, n) != 0)
+        abort();
+
+    for (i = 0; i < NBATCH; i++)
+        batch_keys[i] = ulib_rand(0, 2 * n);
+    uint_tree_lookup_batch(t, NBATCH, batch_keys, batch_found);
+    for (i = 0; i < NBATCH; i++)
+        if (batch_found[i] != (batch_keys[i] % 2 == 0 && batch_keys[i] < 2 * n))
+            abort();
+
+    for (i = 0; i < 1000; i++) {
+        lo = ulib_rand(0, 2 * n);
+        hi = ulib_rand(lo, 2 * n);
+        limit = 0;
+        range_n = 0;
+        if (uint_tree_range(t, lo, hi, range_visit, &limit) != 0
+            || range_n != (hi < 2 * n ? hi / 2 : n - 1) + 1 - (lo + 1) / 2)
+            abort();
+
+        limit = 10;
+        range_n = 0;
+        if (uint_tree_range(t, lo, hi, range_visit, &limit) != (range_n == limit)
+            || range_n > limit)
+            abort();
+    }
+
+    check_balance(t);
+    for (i = 0; i < n; i++) {
+        ulib_cache_free(uint_tree_cache, uint_tree_delete(&t, 2 * perm[i]));
+        if (i == n / 2) {
+            check_balance(t);
+            for (j = 0; j < n - i - 1; j++)
+                if (uint_tree_rank(t, uint_tree_select(t, j)->key) != j)
+                    abort();
+        }
+    }
+    if (t != 0)
+        abort();
+    printf("iter: %u keys, %s order\n", n, ordered ? "ascending" : "random");
+}
+
+static uint_tree *nodes[NITER];
+
+/* Build trees of sorted nodes of various sizes and check they are
+   balanced and fully functional.  */
+static void
+test_build() {
+    static const unsigned int sizes[] = {0, 1, 2, 3, 4, 5, 7, 8, 100, 1023, 1024, NITER};
+    uint_tree *t, *elt;
+    unsigned int i, j, n;
+    int h;
+
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+        n = sizes[j];
+        for (i = 0; i < n; i++) {
+            nodes[i] = ulib_cache_alloc(uint_tree_cache);
+            nodes[i]->key = 2 * i;
+        }
+
+        t = uint_tree_build_sorted(nodes, n);
+        h = check_balance(t);
+        if (t) {
+            check_tree(t);
+            if ((1U << (h - 1)) > n || (h < 32 && (1U << h) <= n))
+                abort();
+        }
+
+        for (i = 0, elt = uint_tree_first(t); elt; elt = uint_tree_next(t, elt), i++)
+            if (elt->key != 2 * i)
+                abort();
+        if (i != n)
+            abort();
+
+        /* The tree takes updates.  */
+        for (i = 0; i < n; i++) {
+            elt = ulib_cache_alloc(uint_tree_cache);
+            elt->key = 2 * i + 1;
+            if (uint_tree_insert(&t, elt) < 0)
+                abort();
+        }
+        check_balance(t);
+        for (i = 0; i < 2 * n; i++)
+            ulib_cache_free(uint_tree_cache, uint_tree_delete(&t, i));
+        if (t != 0)
+            abort();
+    }
+    printf("build: ok\n");
+}
+
+static unsigned char in_a[NITER], in_b[NITER];
+
+/* Make a tree of the keys in [0, N), for which IN is set, taking them
+   from a random permutation, and set the rest in IN.  */
+static uint_tree *
+make_set(unsigned char *in, unsigned int n, unsigned int density) {
+    uint_tree *t = 0, *elt;
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        in[i] = ulib_rand(0, 99) < density;
+    for (i = 0; i < n; i++) {
+        if (!in[perm[i]])
+            continue;
+        elt = ulib_cache_alloc(uint_tree_cache);
+        elt->key = perm[i];
+        if (uint_tree_insert(&t, elt) < 0)
+            abort();
+    }
+    return t;
+}
+
+/* Check the tree T has the keys in [0, N), for which the predicate
+   OP on IN_A and IN_B holds, release the nodes on the list REST and
+   the tree and return the number of the nodes.  */
+static unsigned int
+check_set(uint_tree *t, uint_tree *rest, unsigned int n, int op) {
+    unsigned int i, m = 0, k;
+    uint_tree *elt;
+
+    check_balance(t);
+    for (i = 0; i < n; i++) {
+        if (op == 0)
+            k = in_a[i] || in_b[i];
+        else if (op == 1)
+            k = in_a[i] && in_b[i];
+        else
+            k = in_a[i] && !in_b[i];
+        if (k != (uint_tree_lookup(t, i) != 0))
+            abort();
+        m += k;
+    }
+    if (uint_tree_size(t) != m)
+        abort();
+
+    for (; rest; rest = elt) {
+        elt = rest->right;
+        ulib_cache_free(uint_tree_cache, rest);
+        m++;
+    }
+    while ((elt = uint_tree_first(t)) != 0)
+        ulib_cache_free(uint_tree_cache, uint_tree_delete(&t, elt->key));
+    return m;
+}
+
+/* Check join, split and the set operations on random trees of keys in
+   [0, N) of various densities.  */
+static void
+test_setops(unsigned int n) {
+    static const unsigned int density[][2] = {
+        {50, 50}, {1, 90}, {90, 1}, {0, 50}, {30, 0}};
+    uint_tree *a, *b, *l, *g, *x, *rest;
+    unsigned int i, j, k, na, nb;
+    int op;
+
+    for (i = 0; i < n; i++)
+        perm[i] = i;
+    for (i = n - 1; i > 0; i--) {
+        j = ulib_rand(0, i);
+        k = perm[i];
+        perm[i] = perm[j];
+        perm[j] = k;
+    }
+
+    for (j = 0; j < sizeof(density) / sizeof(density[0]); j++) {
+        for (op = 0; op < 3; op++) {
+            a = make_set(in_a, n, density[j][0]);
+            b = make_set(in_b, n, density[j][1]);
+            na = uint_tree_size(a);
+            nb = uint_tree_size(b);
+            if (op == 0)
+                a = uint_tree_union(a, b, &rest);
+            else if (op == 1)
+                a = uint_tree_intersection(a, b, &rest);
+            else
+                a = uint_tree_difference(a, b, &rest);
+            if (check_set(a, rest, n, op) != na + nb)
+                abort();
+        }
+
+        /* Split at a random key and join back.  */
+        a = make_set(in_a, n, density[j][0]);
+        na = uint_tree_size(a);
+        k = ulib_rand(0, n - 1);
+        nb = uint_tree_rank(a, k);
+        x = uint_tree_split(a, k, &l, &g);
+        check_balance(l);
+        check_balance(g);
+        if ((x != 0) != in_a[k] || (x && x->key != k) || uint_tree_size(l) != nb
+            || (uint_tree_last(l) && uint_tree_last(l)->key >= k)
+            || (uint_tree_first(g) && uint_tree_first(g)->key <= k)
+            || uint_tree_size(l) + uint_tree_size(g) + (x != 0) != na)
+            abort();
+        if (x == 0) {
+            x = ulib_cache_alloc(uint_tree_cache);
+            x->key = k;
+            in_a[k] = 1;
+            na++;
+        }
+        a = uint_tree_join(l, x, g);
+        memset(in_b, 0, n);
+        if (check_set(a, 0, n, 0) != na)
+            abort();
+    }
+    printf("setops: %u keys\n", n);
+}
+
 int
 main() {
     ulib_time ts1, ts2;
@@ -137,6 +429,13 @@ main() {
     if (root)
         check_tree(root);
 
+    test_iter(NITER, 0);
+    test_iter(1000, 1);
+    test_build();
+    test_setops(16);
+    test_setops(1000);
+    test_setops(NITER);
+
     tm = ts2.sec * 1e6 + ts2.usec - ts1.sec * 1e6 - ts1.usec;
 
     printf("time = %f s\n", tm / 1e6);
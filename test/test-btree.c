@@ -0,0 +1,336 @@
+#include <ulib/cache.h>
+#include <ulib/rand.h>
+#include <ulib/time.h>
+
+/* A set of unsigned int keys with the default nodes.  */
+#define ULIB_BTREE_KEY_TYPE unsigned int
+#define ULIB_BTREE_TYPE uint_set
+
+#include <ulib/btree.h>
+#include <ulib/btree.c>
+
+/* A map with small nodes, searched with a binary search, to exercise
+   deep trees.  */
+#undef ULIB_BTREE_TYPE
+#define ULIB_BTREE_TYPE uint_map
+#define ULIB_BTREE_DATA_TYPE unsigned int
+#undef ULIB_BTREE_NODE_SIZE
+#define ULIB_BTREE_NODE_SIZE 64
+#define ULIB_BTREE_BINARY_SEARCH
+
+#include <ulib/btree.h>
+#include <ulib/btree.c>
+
+#define ULIB_AVL_TREE_TYPE uint_tree
+
+#include <ulib/avl-tree.h>
+#include <ulib/avl-tree.c>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NKEYS 20000U
+#define NLOOPS 1000000U
+#define NBENCH 1000000U
+#define NBATCH 1000U
+
+static ulib_cache *uint_set_cache, *uint_tree_cache;
+static unsigned char present[NKEYS];
+static unsigned int perm[NBENCH];
+static unsigned int batch_keys[NBATCH];
+static unsigned int *batch_data[NBATCH];
+static int found[NBENCH];
+
+/* Check the subtree R of height H of the map, with keys in [LO, HI),
+   where LO or HI may be absent, and return the number of its keys.
+   Collect its leaves in key order at *LEAVES.  */
+static unsigned int
+check_node(void *r,
+           unsigned int h,
+           const unsigned int *lo,
+           const unsigned int *hi,
+           int root,
+           struct uint_map_leaf ***leaves) {
+    struct uint_map_inner *p;
+    struct uint_map_leaf *l;
+    unsigned int i, n = 0;
+
+    if (h == 0) {
+        l = (struct uint_map_leaf *)r;
+        if (l->n > ULIB_BTREE_LEAF_KEYS || (!root && l->n < ULIB_BTREE_LEAF_KEYS / 2))
+            abort();
+        for (i = 0; i < l->n; i++) {
+            if ((i > 0 && l->key[i - 1] >= l->key[i]) || (lo && l->key[i] < *lo)
+                || (hi && l->key[i] >= *hi) || l->data[i] != ~l->key[i])
+                abort();
+        }
+        *(*leaves)++ = l;
+        return l->n;
+    }
+
+    p = (struct uint_map_inner *)r;
+    if (p->n > ULIB_BTREE_INNER_KEYS || p->n == 0
+        || (!root && p->n < ULIB_BTREE_INNER_KEYS / 2))
+        abort();
+    for (i = 0; i < p->n; i++) {
+        if ((i > 0 && p->key[i - 1] >= p->key[i]) || (lo && p->key[i] < *lo)
+            || (hi && p->key[i] >= *hi))
+            abort();
+    }
+    for (i = 0; i <= p->n; i++)
+        n += check_node(p->child[i],
+                        h - 1,
+                        i > 0 ? &p->key[i - 1] : lo,
+                        i < p->n ? &p->key[i] : hi,
+                        0,
+                        leaves);
+    return n;
+}
+
+/* Check the structure of the map and that it holds the keys in
+   ``present''.  */
+static void
+check_map(const uint_map *t) {
+    static struct uint_map_leaf *leaves[NKEYS + 1];
+    struct uint_map_leaf **l = leaves;
+    struct uint_map_iter it;
+    unsigned int i, n = 0, k;
+
+    for (i = 0; i < NKEYS; i++)
+        n += present[i];
+
+    if (t->root == 0) {
+        if (n != 0 || t->height != 0 || uint_map_first(t, &it))
+            abort();
+        return;
+    }
+
+    if (check_node(t->root, t->height, 0, 0, 1, &l) != n)
+        abort();
+    *l = 0;
+    for (l = leaves; *l; l++)
+        if ((*l)->next != l[1])
+            abort();
+
+    k = 0;
+    if (uint_map_first(t, &it)) {
+        do {
+            while (!present[k])
+                k++;
+            if (uint_map_key(&it) != k || *uint_map_data(&it) != ~k)
+                abort();
+            k++;
+        } while (uint_map_next(&it));
+    }
+    while (k < NKEYS && !present[k])
+        k++;
+    if (k != NKEYS)
+        abort();
+}
+
+static int
+count_key(unsigned int key, unsigned int *data, void *arg) {
+    unsigned int *n = (unsigned int *)arg;
+
+    if (*data != ~key || !present[key])
+        abort();
+    n[0]++;
+    return n[0] == n[1];
+}
+
+/* Insert and delete random keys, comparing the map with the
+   ``present'' array.  */
+static void
+test_map(void) {
+    ulib_cache *cache = uint_map_cache_create();
+    struct uint_map_iter it;
+    unsigned int i, k, lo, hi, n[2], data;
+    uint_map t;
+
+    uint_map_init(&t, cache);
+    memset(present, 0, sizeof(present));
+
+    for (i = 0; i < NLOOPS; i++) {
+        k = ulib_rand(0, NKEYS - 1);
+        if (ulib_rand(0, 1)) {
+            if (uint_map_insert(&t, k, ~k) == 0) {
+                if (present[k])
+                    abort();
+                present[k] = 1;
+            } else if (!present[k] || errno != EEXIST)
+                abort();
+        } else {
+            data = 0;
+            if (uint_map_delete(&t, k, &data) == 0) {
+                if (!present[k] || data != ~k)
+                    abort();
+                present[k] = 0;
+            } else if (present[k])
+                abort();
+        }
+
+        if ((uint_map_lookup(&t, k) != 0) != present[k])
+            abort();
+
+        if (i % 10000 == 0) {
+            check_map(&t);
+
+            lo = ulib_rand(0, NKEYS - 1);
+            hi = ulib_rand(lo, NKEYS);
+            n[0] = 0;
+            n[1] = ~0U;
+            uint_map_range(&t, lo, hi, count_key, n);
+            for (k = lo; k <= hi && k < NKEYS; k++)
+                n[0] -= present[k];
+            if (n[0] != 0)
+                abort();
+
+            for (k = 0; k < NBATCH; k++)
+                batch_keys[k] = ulib_rand(0, NKEYS - 1);
+            uint_map_lookup_batch(&t, NBATCH, batch_keys, batch_data);
+            for (k = 0; k < NBATCH; k++)
+                if ((batch_data[k] != 0) != present[batch_keys[k]]
+                    || (batch_data[k] && *batch_data[k] != ~batch_keys[k]))
+                    abort();
+
+            for (k = lo; k < NKEYS && !present[k]; k++)
+                ;
+            if (uint_map_lower_bound(&t, lo, &it) != (k < NKEYS)
+                || (k < NKEYS && uint_map_key(&it) != k))
+                abort();
+            for (k = lo + 1; k < NKEYS && !present[k]; k++)
+                ;
+            if (uint_map_upper_bound(&t, lo, &it) != (k < NKEYS)
+                || (k < NKEYS && uint_map_key(&it) != k))
+                abort();
+        }
+    }
+
+    /* Delete the rest in ascending order.  */
+    for (k = 0; k < NKEYS; k++) {
+        if ((uint_map_delete(&t, k, 0) == 0) != present[k])
+            abort();
+        present[k] = 0;
+    }
+    check_map(&t);
+
+    /* Fill in descending order and release all.  */
+    for (k = NKEYS; k-- > 0;) {
+        if (uint_map_insert(&t, k, ~k) != 0)
+            abort();
+        present[k] = 1;
+    }
+    check_map(&t);
+    uint_map_clear(&t);
+    if (t.root != 0 || uint_map_lookup(&t, 0))
+        abort();
+    ulib_cache_flush(cache);
+
+    printf("map: ok, %u keys per leaf, %u per inner node\n",
+           (unsigned int)ULIB_BTREE_LEAF_KEYS,
+           (unsigned int)ULIB_BTREE_INNER_KEYS);
+}
+
+static double
+elapsed(const ulib_time *ts1, const ulib_time *ts2) {
+    return ts2->sec * 1e6 + ts2->usec - ts1->sec * 1e6 - ts1->usec;
+}
+
+/* Compare the B-tree set with the AVL tree on N random keys.  */
+static void
+bench(unsigned int n) {
+    uint_tree *root = 0, *elt;
+    ulib_time ts1, ts2;
+    unsigned int i, j, k;
+    double tm[5];
+    uint_set t;
+
+    for (i = 0; i < n; i++)
+        perm[i] = i;
+    for (i = n - 1; i > 0; i--) {
+        j = ulib_rand(0, i);
+        k = perm[i];
+        perm[i] = perm[j];
+        perm[j] = k;
+    }
+
+    uint_set_init(&t, uint_set_cache);
+    ulib_gettime(&ts1);
+    for (i = 0; i < n; i++)
+        if (uint_set_insert(&t, perm[i]) != 0)
+            abort();
+    ulib_gettime(&ts2);
+    tm[0] = elapsed(&ts1, &ts2);
+    ulib_gettime(&ts1);
+    for (i = 0; i < n; i++)
+        if (!uint_set_lookup(&t, perm[n - 1 - i]))
+            abort();
+    ulib_gettime(&ts2);
+    tm[1] = elapsed(&ts1, &ts2);
+    ulib_gettime(&ts1);
+    uint_set_lookup_batch(&t, n, perm, found);
+    ulib_gettime(&ts2);
+    tm[4] = elapsed(&ts1, &ts2);
+    for (i = 0; i < n; i++)
+        if (!found[i])
+            abort();
+
+    for (i = 0; i < n; i++) {
+        elt = (uint_tree *)ulib_cache_alloc(uint_tree_cache);
+        elt->key = perm[i];
+        if (uint_tree_insert(&root, elt) != 0)
+            abort();
+    }
+    ulib_gettime(&ts1);
+    for (i = 0; i < n; i++)
+        if (!uint_tree_lookup(root, perm[n - 1 - i]))
+            abort();
+    ulib_gettime(&ts2);
+    tm[2] = elapsed(&ts1, &ts2);
+
+    ulib_gettime(&ts1);
+    for (i = 0; i < n; i++)
+        if (uint_set_delete(&t, perm[i]) != 0)
+            abort();
+    ulib_gettime(&ts2);
+    tm[3] = elapsed(&ts1, &ts2);
+    if (t.root != 0)
+        abort();
+
+    for (i = 0; i < n; i++)
+        ulib_cache_free(uint_tree_cache, uint_tree_delete(&root, perm[i]));
+
+    printf("%8u keys: btree insert %.3f us, lookup %.3f us, batch %.3f us, "
+           "delete %.3f us, avl lookup %.3f us\n",
+           n,
+           tm[0] / n,
+           tm[1] / n,
+           tm[4] / n,
+           tm[3] / n,
+           tm[2] / n);
+}
+
+int
+main() {
+    unsigned int n;
+
+    setvbuf(stdout, 0, _IONBF, 0);
+
+    test_map();
+
+    uint_set_cache = uint_set_cache_create();
+    uint_tree_cache = ulib_cache_create(
+        ULIB_CACHE_SIZE, sizeof(uint_tree), ULIB_CACHE_ALIGN, sizeof(void *), 0);
+    for (n = 1000; n <= NBENCH; n *= 10)
+        bench(n);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,173 @@
+#include <ulib/cache.h>
+#include <ulib/rand.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NOBJS 100000
+#define KEEP 10
+
+struct rec {
+    unsigned int id;
+    unsigned int sum;
+    char pad[40];
+};
+
+static void **hnd[NOBJS];
+
+static void
+rec_init(void **h, unsigned int id) {
+    struct rec *r = (struct rec *)*h;
+
+    memset(r, 0, sizeof(*r));
+    r->id = id;
+    r->sum = ~id;
+}
+
+static void
+rec_check(void **h, unsigned int id) {
+    struct rec *r = (struct rec *)*h;
+
+    if (r->id != id || r->sum != ~id)
+        abort();
+}
+
+static int
+scan_handles(void *_obj, void **objs, unsigned int n) {
+    void ***slot = (void ***)_obj;
+    unsigned int i, cnt;
+
+    for (i = cnt = 0; i < NOBJS; i++)
+        cnt += slot[i] != 0;
+
+    if (cnt > n)
+        return -cnt;
+
+    for (i = cnt = 0; i < NOBJS; i++)
+        if (slot[i])
+            objs[cnt++] = slot[i];
+    return cnt;
+}
+
+/* Free most of the objects of a cache in random order and check the
+   compaction releases the emptied slabs and keeps the survivors
+   intact.  */
+static void
+test_compact() {
+    ulib_cache *cache;
+    unsigned int i, j, k;
+    void **t;
+    int n;
+
+    cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                              sizeof(struct rec),
+                              ULIB_CACHE_ALIGN,
+                              8,
+                              ULIB_CACHE_HANDLES,
+                              0);
+    if (cache == 0)
+        abort();
+
+    for (i = 0; i < NOBJS; i++) {
+        if ((hnd[i] = ulib_cache_halloc(cache)) == 0)
+            abort();
+        rec_init(hnd[i], i);
+    }
+
+    for (i = NOBJS - 1; i > 0; i--) {
+        j = ulib_rand(0, i);
+        t = hnd[i];
+        hnd[i] = hnd[j];
+        hnd[j] = t;
+    }
+    for (i = NOBJS / KEEP; i < NOBJS; i++)
+        ulib_cache_hfree(cache, hnd[i]);
+
+    if ((n = ulib_cache_compact(cache)) <= 0)
+        abort();
+    printf("compact: released = %d\n", n);
+
+    for (i = 0; i < NOBJS / KEEP; i++) {
+        k = ((struct rec *)*hnd[i])->id;
+        rec_check(hnd[i], k);
+    }
+
+    /* Nothing left to move.  */
+    if (ulib_cache_compact(cache) != 0)
+        abort();
+
+    /* The cache keeps working after compaction.  */
+    for (i = NOBJS / KEEP; i < NOBJS; i++) {
+        if ((hnd[i] = ulib_cache_halloc(cache)) == 0)
+            abort();
+        rec_init(hnd[i], NOBJS + i);
+    }
+    for (i = 0; i < NOBJS; i++)
+        ulib_cache_hfree(cache, hnd[i]);
+    ulib_cache_flush(cache);
+}
+
+/* Let the collector free most of the objects of a garbage collected
+   cache, reachable through handles, then compact it.  */
+static void
+test_compact_gc() {
+    ulib_cache *cache;
+    unsigned int i;
+    int n;
+
+    cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                              sizeof(struct rec),
+                              ULIB_CACHE_ALIGN,
+                              8,
+                              ULIB_CACHE_GC,
+                              ULIB_CACHE_HANDLES,
+                              0);
+    if (cache == 0 || ulib_gcroot(hnd, scan_handles) < 0)
+        abort();
+
+    for (i = 0; i < NOBJS; i++) {
+        if ((hnd[i] = ulib_cache_halloc(cache)) == 0)
+            abort();
+        rec_init(hnd[i], i);
+    }
+
+    for (i = 0; i < NOBJS; i++)
+        if (ulib_rand(0, KEEP - 1) != 0)
+            hnd[i] = 0;
+    ulib_gcrun();
+
+    if ((n = ulib_cache_compact(cache)) <= 0)
+        abort();
+    printf("compact gc: released = %d\n", n);
+
+    for (i = 0; i < NOBJS; i++)
+        if (hnd[i])
+            rec_check(hnd[i], i);
+
+    /* The moved objects are still reachable through their handles.  */
+    ulib_gcrun();
+    for (i = 0; i < NOBJS; i++)
+        if (hnd[i])
+            rec_check(hnd[i], i);
+
+    memset(hnd, 0, sizeof(hnd));
+    ulib_gcrun();
+    if (ulib_cache_compact(cache) != 0)
+        abort();
+    ulib_gcunroot(hnd);
+}
+
+int
+main() {
+    test_compact();
+    test_compact_gc();
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ulib/cache.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NOBJS 100000U
+#define RATE 4096U
+
+static void *objs[NOBJS];
+
+static void *
+keep(ulib_cache *cache) {
+    void *obj;
+
+    if ((obj = ulib_cache_alloc(cache)) == 0)
+        abort();
+    return obj;
+}
+
+static void
+churn(ulib_cache *cache) {
+    void *obj;
+
+    if ((obj = ulib_cache_alloc(cache)) == 0)
+        abort();
+    ulib_cache_free(cache, obj);
+}
+
+/* Write the profile and read back the totals and the number of
+   stacks.  */
+static unsigned int
+dump(unsigned long long *live, unsigned long long *alloc) {
+    FILE *f;
+    char line[4096];
+    unsigned long long live_bytes, alloc_bytes;
+    size_t rate;
+    unsigned int nstacks = 0;
+
+    if ((f = tmpfile()) == 0 || ulib_cache_profile_dump(f) < 0)
+        abort();
+    rewind(f);
+
+    if (fgets(line, sizeof(line), f) == 0
+        || sscanf(line,
+                  "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu",
+                  live,
+                  &live_bytes,
+                  alloc,
+                  &alloc_bytes,
+                  &rate)
+               != 5
+        || rate != RATE)
+        abort();
+
+    while (fgets(line, sizeof(line), f) && strcmp(line, "\n") != 0)
+        if (strstr(line, "] @ 0x"))
+            nstacks++;
+
+    if (fgets(line, sizeof(line), f) == 0 || strcmp(line, "MAPPED_LIBRARIES:\n") != 0)
+        abort();
+    fclose(f);
+    return nstacks;
+}
+
+/* Compact a cache with handles, which was sampled, and check the
+   moved samples stay live until their objects are freed.  */
+static void
+test_compact(void) {
+    ulib_cache *cache;
+    unsigned long long live[3], alloc;
+    unsigned int i;
+
+    cache = ulib_cache_create(
+        ULIB_CACHE_SIZE, 64, ULIB_CACHE_ALIGN, 8, ULIB_CACHE_HANDLES, 0);
+    if (cache == 0)
+        abort();
+
+    dump(&live[0], &alloc);
+    ulib_cache_profile(RATE);
+    for (i = 0; i < NOBJS; i++)
+        if ((objs[i] = ulib_cache_halloc(cache)) == 0)
+            abort();
+    ulib_cache_profile(0);
+
+    for (i = 0; i < NOBJS; i++)
+        if (i % 8 != 0)
+            ulib_cache_hfree(cache, (void **)objs[i]);
+    dump(&live[1], &alloc);
+    if (ulib_cache_compact(cache) <= 0)
+        abort();
+    dump(&live[2], &alloc);
+    printf("profile: compact live = %llu, after = %llu\n", live[1], live[2]);
+    if (live[1] == live[0] || live[2] != live[1])
+        abort();
+
+    for (i = 0; i < NOBJS; i += 8)
+        ulib_cache_hfree(cache, (void **)objs[i]);
+    dump(&live[1], &alloc);
+    if (live[1] != live[0])
+        abort();
+}
+
+#define NTHREADS 16U
+
+static ulib_cache *thread_cache;
+static void *thread_objs[NTHREADS];
+
+static void *
+thread_alloc(void *arg) {
+    unsigned int i = (unsigned int)(size_t)arg;
+
+    thread_objs[i] = keep(thread_cache);
+    return 0;
+}
+
+/* The first allocation of a thread is sampled at the rate, like any
+   other one.  */
+static void
+test_threads(void) {
+    unsigned long long alloc[2], live;
+    pthread_t tid;
+    unsigned int i;
+
+    if ((thread_cache = ulib_cache_create(ULIB_CACHE_SIZE, 32, 0)) == 0)
+        abort();
+
+    dump(&live, &alloc[0]);
+    ulib_cache_profile(RATE * 1000000ULL);
+    for (i = 0; i < NTHREADS; i++)
+        if (pthread_create(&tid, 0, thread_alloc, (void *)(size_t)i) != 0
+            || pthread_join(tid, 0) != 0)
+            abort();
+    ulib_cache_profile(RATE);
+    ulib_cache_profile(0);
+
+    dump(&live, &alloc[1]);
+    printf("profile: first allocations of threads sampled = %llu\n", alloc[1] - alloc[0]);
+    if (alloc[1] - alloc[0] > 1)
+        abort();
+    for (i = 0; i < NTHREADS; i++)
+        ulib_cache_free(thread_cache, thread_objs[i]);
+}
+
+/* Keep many more samples live, than fit the ring, and check none of
+   them are lost.  */
+static void
+test_full(void) {
+    ulib_cache *cache;
+    unsigned long long live[2], alloc, expect;
+    unsigned int i;
+
+    if ((cache = ulib_cache_create(ULIB_CACHE_SIZE, 256, 0)) == 0)
+        abort();
+
+    dump(&live[0], &alloc);
+    ulib_cache_profile(RATE);
+    for (i = 0; i < NOBJS; i++)
+        objs[i] = keep(cache);
+    ulib_cache_profile(0);
+
+    dump(&live[1], &alloc);
+    expect = (unsigned long long)NOBJS * 256 / RATE;
+    printf("profile: kept live = %llu, expected %llu, dropped = %lu\n",
+           live[1] - live[0],
+           expect,
+           ulib_cache_profile_dropped());
+    if (live[1] - live[0] < expect * 3 / 4 || live[1] - live[0] > expect * 5 / 4
+        || ulib_cache_profile_dropped() != 0)
+        abort();
+
+    for (i = 0; i < NOBJS; i++)
+        ulib_cache_free(cache, objs[i]);
+    dump(&live[1], &alloc);
+    if (live[1] != live[0])
+        abort();
+}
+
+int
+main() {
+    ulib_cache *kept, *churned;
+    unsigned int i, nstacks;
+    unsigned long long live, alloc, expect;
+
+    kept = ulib_cache_create(ULIB_CACHE_SIZE, 32, ULIB_CACHE_ALIGN, 8, 0);
+    churned = ulib_cache_create(ULIB_CACHE_SIZE, 64, ULIB_CACHE_ALIGN, 8, 0);
+    if (kept == 0 || churned == 0)
+        abort();
+
+    ulib_cache_profile(RATE);
+    for (i = 0; i < NOBJS; i++) {
+        objs[i] = keep(kept);
+        churn(churned);
+    }
+    ulib_cache_profile(0);
+
+    /* Expect a sample per RATE bytes of each cache, within a generous
+       margin.  */
+    nstacks = dump(&live, &alloc);
+    expect = (unsigned long long)NOBJS * 32 / RATE;
+    printf("profile: stacks = %u, live = %llu, alloc = %llu, expected %llu and %llu\n",
+           nstacks,
+           live,
+           alloc,
+           expect,
+           3 * expect);
+    if (nstacks < 2 || live < expect * 3 / 4 || live > expect * 5 / 4
+        || alloc < 3 * expect * 3 / 4 || alloc > 3 * expect * 5 / 4)
+        abort();
+
+    /* Freed samples are no longer live.  */
+    for (i = 0; i < NOBJS; i++)
+        ulib_cache_free(kept, objs[i]);
+    dump(&live, &alloc);
+    printf("profile: after free live = %llu, alloc = %llu\n", live, alloc);
+    if (live != 0)
+        abort();
+
+    test_compact();
+    test_threads();
+    test_full();
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
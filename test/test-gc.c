@@ -0,0 +1,738 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ulib/cache.h>
+#include <ulib/rand.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct node {
+    struct node *next;
+    unsigned int magic;
+    unsigned int id;
+};
+
+#define MAGIC 0x600dU
+#define DEAD 0xdeadU
+
+#define NSLOTS 10000U
+#define NLOOPS 1000000U
+
+static ulib_cache *node_cache;
+static struct node *slots[NSLOTS];
+
+static void
+node_clear(void *_obj, unsigned int size __attribute__((unused))) {
+    struct node *obj = (struct node *)_obj;
+
+    obj->magic = DEAD;
+}
+
+static int
+node_scan(void *_obj, void **objs, unsigned int n) {
+    struct node *obj = (struct node *)_obj;
+
+    if (obj->next == 0)
+        return 0;
+
+    if (n == 0)
+        return -1;
+
+    objs[0] = obj->next;
+    return 1;
+}
+
+static int
+scan_slots(void *_obj, void **objs, unsigned int n) {
+    struct node **slot = (struct node **)_obj;
+    unsigned int i, cnt;
+
+    for (i = cnt = 0; i < NSLOTS; i++)
+        cnt += slot[i] != 0;
+
+    if (cnt > n)
+        return -cnt;
+
+    for (i = cnt = 0; i < NSLOTS; i++)
+        if (slot[i])
+            objs[cnt++] = slot[i];
+    return cnt;
+}
+
+static struct node *
+node_alloc(unsigned int id) {
+    struct node *obj;
+
+    if ((obj = ulib_cache_alloc(node_cache)) == 0)
+        abort();
+
+    obj->next = 0;
+    obj->magic = MAGIC;
+    obj->id = id;
+    return obj;
+}
+
+static void
+check_slots() {
+    unsigned int i;
+    struct node *obj;
+
+    for (i = 0; i < NSLOTS; i++)
+        for (obj = slots[i]; obj; obj = obj->next)
+            if (obj->magic != MAGIC || obj->id != i)
+                abort();
+}
+
+/* Churn through objects, relying on the automatic collection
+   triggering to keep the heap bounded.  */
+static void
+test_trigger() {
+    unsigned int i, idx;
+    struct node *obj;
+    ulib_gcstats st;
+
+    ulib_gcstats_reset();
+    if (ulib_gcconfig(ULIB_GC_TRIGGER_BYTES, (size_t)1 << 20, ULIB_GC_GROWTH, 150U, 0) < 0)
+        abort();
+
+    for (i = 0; i < NLOOPS; i++) {
+        idx = ulib_rand(0, NSLOTS - 1);
+        obj = node_alloc(idx);
+        if (ulib_rand(0, 1))
+            obj->next = slots[idx];
+        slots[idx] = obj;
+    }
+    check_slots();
+
+    ulib_gcstats_get(&st);
+    printf("trigger: collections = %llu, freed = %llu, live = %llu bytes\n",
+           st.collections,
+           st.total.objects_freed,
+           st.heap_live);
+    if (st.collections == 0 || st.total.objects_freed == 0)
+        abort();
+
+    if (ulib_gcconfig(ULIB_GC_TRIGGER_BYTES, (size_t)0, 0) < 0)
+        abort();
+}
+
+/* Keep a list alive only through a scoped root.  */
+static void
+test_shadow() {
+    unsigned int i;
+    struct node *head = 0, *obj;
+    ulib_gcstats st;
+
+    ULIB_GC_ROOT_SCOPE_BEGIN
+    ULIB_GC_ROOT(head);
+    for (i = 0; i < NSLOTS; i++) {
+        obj = node_alloc(i);
+        obj->next = head;
+        head = obj;
+    }
+
+    ulib_gcrun();
+    for (i = NSLOTS, obj = head; obj; obj = obj->next)
+        if (obj->magic != MAGIC || obj->id != --i)
+            abort();
+    if (i != 0)
+        abort();
+    ULIB_GC_ROOT_SCOPE_END
+
+    ulib_gcrun();
+    ulib_gcstats_get(&st);
+    printf("shadow: freed = %llu\n", st.last.objects_freed);
+    if (st.last.objects_freed < NSLOTS)
+        abort();
+}
+
+struct pair {
+    unsigned int magic;
+    struct pair *left;
+    unsigned int id;
+    struct pair *right;
+};
+
+static const unsigned int pair_ptrs[] = {offsetof(struct pair, left),
+                                         offsetof(struct pair, right)};
+
+static struct pair *
+make_pairs(ulib_cache *cache, unsigned int lo, unsigned int hi) {
+    struct pair *obj;
+    unsigned int mid;
+
+    if (lo >= hi)
+        return 0;
+
+    mid = lo + (hi - lo) / 2;
+    if ((obj = ulib_cache_alloc(cache)) == 0)
+        abort();
+    obj->magic = MAGIC;
+    obj->id = mid;
+    obj->left = obj->right = 0;
+
+    ULIB_GC_ROOT_SCOPE_BEGIN
+    ULIB_GC_ROOT(obj);
+    obj->left = make_pairs(cache, lo, mid);
+    obj->right = make_pairs(cache, mid + 1, hi);
+    ULIB_GC_ROOT_SCOPE_END
+
+    return obj;
+}
+
+static unsigned int
+check_pairs(const struct pair *obj, unsigned int lo, unsigned int hi) {
+    unsigned int mid;
+
+    if (lo >= hi) {
+        if (obj)
+            abort();
+        return 0;
+    }
+
+    mid = lo + (hi - lo) / 2;
+    if (obj->magic != MAGIC || obj->id != mid)
+        abort();
+    return 1 + check_pairs(obj->left, lo, mid) + check_pairs(obj->right, mid + 1, hi);
+}
+
+/* Collect objects, described by a layout descriptor.  */
+static void
+test_layout() {
+    ulib_cache *cache;
+    struct pair *root = 0;
+    ulib_gcstats st;
+
+    /* The layout is used either instead of a scan function, or not
+     at all.  */
+    if (ulib_cache_create(ULIB_CACHE_SIZE,
+                          sizeof(struct pair),
+                          ULIB_CACHE_GCSCAN,
+                          node_scan,
+                          ULIB_CACHE_GCLAYOUT,
+                          2U,
+                          pair_ptrs,
+                          0)
+            != 0
+        || errno != EINVAL)
+        abort();
+
+    /* The objects are aligned for the pointer fields by default.  */
+    cache = ulib_cache_create(
+        ULIB_CACHE_SIZE, sizeof(struct pair), ULIB_CACHE_GCLAYOUT, 2U, pair_ptrs, 0);
+    if (cache == 0)
+        abort();
+
+    ULIB_GC_ROOT_SCOPE_BEGIN
+    ULIB_GC_ROOT(root);
+    if (ulib_gcconfig(ULIB_GC_TRIGGER_SLABS, 16U, 0) < 0)
+        abort();
+    root = make_pairs(cache, 0, NSLOTS);
+    if (ulib_gcconfig(ULIB_GC_TRIGGER_SLABS, 0U, 0) < 0)
+        abort();
+
+    ulib_gcrun();
+    if (check_pairs(root, 0, NSLOTS) != NSLOTS)
+        abort();
+    ULIB_GC_ROOT_SCOPE_END
+
+    ulib_gcrun();
+    ulib_gcstats_get(&st);
+    printf("layout: freed = %llu\n", st.last.objects_freed);
+    if (st.last.objects_freed != NSLOTS)
+        abort();
+}
+
+static unsigned int npair_final;
+
+static void
+pair_final(void *_obj, unsigned int size __attribute__((unused))) {
+    struct pair *obj = (struct pair *)_obj;
+
+    if (obj->magic != MAGIC)
+        abort();
+    npair_final++;
+}
+
+#define NPAIRS 100U
+
+/* Save a tree to a heap image and load it back.  */
+static void
+test_image() {
+    ulib_cache *cache;
+    struct pair *root = 0, *copy = 0, *junk;
+    unsigned int i;
+    FILE *f;
+    ulib_gcstats st;
+
+    cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                              sizeof(struct pair),
+                              ULIB_CACHE_ALIGN,
+                              sizeof(void *),
+                              ULIB_CACHE_GCLAYOUT,
+                              2U,
+                              pair_ptrs,
+                              ULIB_CACHE_IMAGE,
+                              1U,
+                              0);
+    if (cache == 0 || (f = tmpfile()) == 0)
+        abort();
+
+    ULIB_GC_ROOT_SCOPE_BEGIN
+    ULIB_GC_ROOT(root);
+    ULIB_GC_ROOT(copy);
+    root = make_pairs(cache, 0, NSLOTS);
+
+    /* An unreachable object isn't loaded.  */
+    if ((junk = ulib_cache_alloc(cache)) == 0)
+        abort();
+    junk->left = junk->right = root;
+
+    if (ulib_heap_save(fileno(f), 1, (void *const *)&root) < 0)
+        abort();
+    if (lseek(fileno(f), 0, SEEK_SET) < 0)
+        abort();
+    if (ulib_heap_load(fileno(f), 1, (void **)&copy) < 0)
+        abort();
+    fclose(f);
+
+    if (copy == root || check_pairs(copy, 0, NSLOTS) != NSLOTS)
+        abort();
+    root = 0;
+    ulib_gcrun();
+    ulib_gcstats_get(&st);
+    if (st.last.objects_freed != NSLOTS + 1 || check_pairs(copy, 0, NSLOTS) != NSLOTS)
+        abort();
+    ULIB_GC_ROOT_SCOPE_END
+
+    ulib_gcrun();
+    ulib_gcstats_get(&st);
+    printf("image: loaded = %llu\n", st.last.objects_freed);
+    if (st.last.objects_freed != NSLOTS)
+        abort();
+
+    /* Objects, queued for finalization, are finalized by the save,
+     rather than loaded and released without finalization.  */
+    cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                              sizeof(struct pair),
+                              ULIB_CACHE_ALIGN,
+                              sizeof(void *),
+                              ULIB_CACHE_GCLAYOUT,
+                              2U,
+                              pair_ptrs,
+                              ULIB_CACHE_FINALIZE,
+                              pair_final,
+                              ULIB_CACHE_IMAGE,
+                              2U,
+                              0);
+    if (cache == 0 || (f = tmpfile()) == 0)
+        abort();
+
+    copy = 0;
+    ULIB_GC_ROOT_SCOPE_BEGIN
+    ULIB_GC_ROOT(root);
+    ULIB_GC_ROOT(copy);
+    root = make_pairs(cache, 0, NPAIRS);
+    for (i = 0; i < NPAIRS; i++) {
+        if ((junk = ulib_cache_alloc(cache)) == 0)
+            abort();
+        junk->magic = MAGIC;
+        junk->left = junk->right = 0;
+    }
+    ulib_gcrun();
+    if (ulib_gcfinalize_pending() != NPAIRS || npair_final != 0)
+        abort();
+
+    if (ulib_heap_save(fileno(f), 1, (void *const *)&root) < 0)
+        abort();
+    if (ulib_gcfinalize_pending() != 0 || npair_final != NPAIRS)
+        abort();
+    if (lseek(fileno(f), 0, SEEK_SET) < 0)
+        abort();
+    if (ulib_heap_load(fileno(f), 1, (void **)&copy) < 0)
+        abort();
+    fclose(f);
+    if (check_pairs(copy, 0, NPAIRS) != NPAIRS)
+        abort();
+    ULIB_GC_ROOT_SCOPE_END
+
+    /* Each of the original and the loaded trees is finalized once.  */
+    ulib_gcrun();
+    while (ulib_gcfinalize_pending())
+        ulib_gcfinalize(1000);
+    printf("image: finalized = %u\n", npair_final);
+    if (npair_final != 3 * NPAIRS)
+        abort();
+}
+
+static unsigned int nfinal;
+
+static void
+node_final(void *_obj, unsigned int size __attribute__((unused))) {
+    struct node *obj = (struct node *)_obj;
+
+    if (obj->magic != MAGIC)
+        abort();
+    nfinal++;
+}
+
+/* Finalize unreachable objects in batches after the collection.  */
+static void
+test_final() {
+    ulib_cache *cache;
+    unsigned int i, cnt;
+    struct node *obj;
+
+    cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                              sizeof(struct node),
+                              ULIB_CACHE_ALIGN,
+                              sizeof(void *),
+                              ULIB_CACHE_CLEAR,
+                              node_clear,
+                              ULIB_CACHE_GCSCAN,
+                              node_scan,
+                              ULIB_CACHE_FINALIZE,
+                              node_final,
+                              0);
+    if (cache == 0)
+        abort();
+
+    for (i = 0; i < NSLOTS; i++) {
+        if ((obj = ulib_cache_alloc(cache)) == 0)
+            abort();
+        obj->next = 0;
+        obj->magic = MAGIC;
+        obj->id = i;
+    }
+
+    ulib_gcrun();
+    if (nfinal != 0 || ulib_gcfinalize_pending() != NSLOTS)
+        abort();
+
+    /* Queued objects are neither freed, nor queued again.  */
+    ulib_gcrun();
+    if (ulib_gcfinalize_pending() != NSLOTS)
+        abort();
+
+    for (cnt = 0; ulib_gcfinalize_pending(); cnt++)
+        ulib_gcfinalize(1000);
+
+    printf("final: finalized = %u in %u batches\n", nfinal, cnt);
+    if (nfinal != NSLOTS)
+        abort();
+}
+
+#define NWEAK 1000U
+
+static void *weak[NWEAK];
+static unsigned int nnotify;
+
+static void
+weak_notify(void **slot, void *obj) {
+    if (slot < weak || slot >= weak + NWEAK || ((struct node *)obj)->magic != MAGIC)
+        abort();
+    nnotify++;
+}
+
+static void *self_weak[NWEAK];
+static unsigned int nself;
+
+/* Unregister the weak reference being notified.  */
+static void
+weak_notify_unweak(void **slot, void *obj) {
+    if (slot < self_weak || slot >= self_weak + NWEAK || *slot != 0
+        || ((struct node *)obj)->magic != MAGIC)
+        abort();
+    ulib_gcunweak(slot);
+    nself++;
+}
+
+/* Keep weak references to objects, half of which are also strongly
+   reachable.  */
+static void
+test_weak() {
+    unsigned int i;
+    struct node *obj, *strong = 0;
+
+    for (i = 0; i < NWEAK; i++) {
+        obj = node_alloc(i);
+        if (i % 2 == 0) {
+            obj->next = strong;
+            strong = obj;
+        }
+        weak[i] = obj;
+        if (ulib_gcweak(&weak[i], weak_notify) < 0)
+            abort();
+    }
+
+    ULIB_GC_ROOT_SCOPE_BEGIN
+    ULIB_GC_ROOT(strong);
+    ulib_gcrun();
+    ULIB_GC_ROOT_SCOPE_END
+
+    for (i = 0; i < NWEAK; i++) {
+        obj = weak[i];
+        if (i % 2 == 0 ? obj == 0 || obj->magic != MAGIC || obj->id != i : obj != 0)
+            abort();
+    }
+
+    printf("weak: cleared = %u\n", nnotify);
+    if (nnotify != NWEAK / 2)
+        abort();
+
+    for (i = 0; i < NWEAK; i++)
+        ulib_gcunweak(&weak[i]);
+
+    /* Notification functions may unregister their references.  */
+    for (i = 0; i < NWEAK; i++) {
+        self_weak[i] = node_alloc(i);
+        if (ulib_gcweak(&self_weak[i], weak_notify_unweak) < 0)
+            abort();
+    }
+    ulib_gcrun();
+    ulib_gcrun();
+    if (nself != NWEAK)
+        abort();
+}
+
+#define NTHREADS 4U
+#define NSHARED 100U
+
+static _Atomic(struct node *) shared;
+
+static void
+check_shared(const struct node *obj) {
+    unsigned int i;
+
+    for (i = NSHARED; obj; obj = obj->next)
+        if (obj->magic != MAGIC || obj->id != --i)
+            abort();
+    if (i != 0)
+        abort();
+}
+
+/* Churn through objects in a heap of the thread's own.  The first
+   thread shares a list with the others, which check it while the
+   owner keeps collecting.  */
+static void *
+heap_thread(void *arg) {
+    ulib_gcheap *heap;
+    ulib_cache *cache;
+    struct node **slots, *obj, *head = 0;
+    unsigned int i, idx, id = (unsigned int)(uintptr_t)arg;
+
+    if ((heap = ulib_gcheap_create()) == 0)
+        abort();
+    ulib_gcheap_set(heap);
+
+    cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                              sizeof(struct node),
+                              ULIB_CACHE_ALIGN,
+                              sizeof(void *),
+                              ULIB_CACHE_CLEAR,
+                              node_clear,
+                              ULIB_CACHE_GCSCAN,
+                              node_scan,
+                              0);
+    slots = calloc(NSLOTS, sizeof(struct node *));
+    if (cache == 0 || slots == 0 || ulib_gcroot(slots, scan_slots) < 0)
+        abort();
+    if (ulib_gcconfig(ULIB_GC_TRIGGER_BYTES, (size_t)1 << 18, 0) < 0)
+        abort();
+
+    if (id == 0) {
+        ULIB_GC_ROOT_SCOPE_BEGIN
+        ULIB_GC_ROOT(head);
+        for (i = 0; i < NSHARED; i++) {
+            if ((obj = ulib_cache_alloc(cache)) == 0)
+                abort();
+            obj->next = head;
+            obj->magic = MAGIC;
+            obj->id = i;
+            head = obj;
+        }
+        if (ulib_gcshare(head) < 0)
+            abort();
+        ULIB_GC_ROOT_SCOPE_END
+        atomic_store(&shared, head);
+    }
+
+    for (i = 0; i < NLOOPS / NTHREADS; i++) {
+        idx = ulib_rand(0, NSLOTS - 1);
+        if ((obj = ulib_cache_alloc(cache)) == 0)
+            abort();
+        obj->next = ulib_rand(0, 1) ? slots[idx] : 0;
+        obj->magic = MAGIC;
+        obj->id = idx;
+        slots[idx] = obj;
+
+        if (id != 0 && i % 1000 == 0 && (head = atomic_load(&shared)) != 0)
+            check_shared(head);
+    }
+
+    for (i = 0; i < NSLOTS; i++)
+        for (obj = slots[i]; obj; obj = obj->next)
+            if (obj->magic != MAGIC || obj->id != i)
+                abort();
+
+    return heap;
+}
+
+#define NREGIONS 100
+#define NREGION_OBJS 1000
+
+static struct node *
+make_list(unsigned int id, unsigned int n) {
+    struct node *head = 0, *obj;
+
+    while (n--) {
+        obj = node_alloc(id);
+        obj->next = head;
+        head = obj;
+    }
+    return head;
+}
+
+/* Use allocation frames as regions, released without marking, unless
+   their objects escape.  */
+static void
+test_escape() {
+    unsigned int i;
+    struct node *head = 0;
+    ulib_gcstats st;
+
+    if (ulib_gcconfig(ULIB_GC_ESCAPES, 1U, 0) < 0)
+        abort();
+
+    for (i = 0; i < NREGIONS; i++) {
+        ulib_gcpush();
+        make_list(i, NREGION_OBJS);
+        ulib_gcpop();
+
+        ulib_gcstats_get(&st);
+        if (st.last.objects_scanned != 0 || st.last.objects_freed != NREGION_OBJS)
+            abort();
+    }
+
+    /* An escape into a root forces marking and the escaped objects
+       survive.  */
+    ulib_gcpush();
+    ulib_gcstore(0, (void **)&slots[0], make_list(0, NREGION_OBJS));
+    ulib_gcpop();
+    ulib_gcstats_get(&st);
+    if (st.last.objects_scanned == 0 || st.last.objects_freed != 0)
+        abort();
+    check_slots();
+
+    /* So does a reference from the shadow stack.  */
+    ULIB_GC_ROOT_SCOPE_BEGIN
+    ULIB_GC_ROOT(head);
+    ulib_gcpush();
+    head = make_list(1, NREGION_OBJS);
+    ulib_gcpop();
+    ulib_gcstats_get(&st);
+    if (st.last.objects_scanned == 0 || st.last.objects_freed != 0)
+        abort();
+    ULIB_GC_ROOT_SCOPE_END
+    slots[1] = head;
+    check_slots();
+
+    /* Frames, pushed later, are clean again.  */
+    ulib_gcpush();
+    make_list(2, NREGION_OBJS);
+    ulib_gcpop();
+    ulib_gcstats_get(&st);
+    printf("escape: regions = %u, freed = %llu\n", NREGIONS + 1, st.last.objects_freed);
+    if (st.last.objects_scanned != 0 || st.last.objects_freed != NREGION_OBJS)
+        abort();
+
+    if (ulib_gcconfig(ULIB_GC_ESCAPES, 0U, 0) < 0)
+        abort();
+    slots[0] = slots[1] = 0;
+    ulib_gcrun();
+}
+
+/* Collect heaps in several threads independently.  */
+static void
+test_heaps() {
+    pthread_t thr[NTHREADS];
+    ulib_gcheap *heap[NTHREADS], *prev;
+    unsigned int i;
+    ulib_gcstats st, st0;
+
+    ulib_gcstats_get(&st0);
+    for (i = 0; i < NTHREADS; i++)
+        if (pthread_create(&thr[i], 0, heap_thread, (void *)(uintptr_t)i) != 0)
+            abort();
+    for (i = 0; i < NTHREADS; i++)
+        if (pthread_join(thr[i], (void **)&heap[i]) != 0)
+            abort();
+
+    for (i = 0; i < NTHREADS; i++) {
+        ulib_gcheap_stats_get(heap[i], &st);
+        printf("heap %u: collections = %llu, freed = %llu\n",
+               i,
+               st.collections,
+               st.total.objects_freed);
+        if (st.collections == 0 || st.total.objects_freed == 0)
+            abort();
+    }
+
+    /* The threads didn't touch the default heap.  */
+    ulib_gcstats_get(&st);
+    if (st.collections != st0.collections)
+        abort();
+
+    /* The shared list survived all the collections of its heap, until
+       it is unshared.  */
+    check_shared(atomic_load(&shared));
+    ulib_gcunshare(atomic_load(&shared));
+
+    prev = ulib_gcheap_set(heap[0]);
+    ulib_gcrun();
+    ulib_gcstats_get(&st);
+    ulib_gcheap_set(prev);
+    printf("heaps: unshared freed = %llu\n", st.last.objects_freed);
+    if (st.last.objects_freed < NSHARED)
+        abort();
+}
+
+int
+main() {
+    setvbuf(stdout, 0, _IONBF, 0);
+
+    node_cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                                   sizeof(struct node),
+                                   ULIB_CACHE_ALIGN,
+                                   sizeof(void *),
+                                   ULIB_CACHE_CLEAR,
+                                   node_clear,
+                                   ULIB_CACHE_GCSCAN,
+                                   node_scan,
+                                   0);
+    if (node_cache == 0 || ulib_gcroot(slots, scan_slots) < 0)
+        abort();
+
+    test_trigger();
+    test_shadow();
+    test_layout();
+    test_image();
+    test_final();
+    test_weak();
+    test_escape();
+    test_heaps();
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,199 @@
+#define _DEFAULT_SOURCE
+
+#include <ulib/shcache.h>
+#include <ulib/rand.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct record {
+    uint64_t link;
+    unsigned int magic;
+    unsigned int owner;
+    unsigned int seq;
+};
+
+#define MAGIC 0x600dU
+
+#define REGION_SIZE (1U << 20)
+#define NWORKERS 4U
+#define NSLOTS 64U
+#define NLOOPS 200000U
+
+/* Offsets of the records in flight between the workers.  */
+static _Atomic uint64_t *slots;
+
+static void *
+map_region(int fd) {
+    void *mem;
+
+    mem = mmap(0, REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+        abort();
+    return mem;
+}
+
+/* Allocate records until the region is exhausted and free them.
+   Return their number.  */
+static unsigned int
+drain(ulib_shcache *sc) {
+    unsigned int n = 0, i;
+    struct record **recs = 0, **r;
+
+    for (;;) {
+        if ((n & (n - 1)) == 0) {
+            if ((r = realloc(recs, (n ? 2 * n : 1) * sizeof(struct record *))) == 0)
+                abort();
+            recs = r;
+        }
+        if ((recs[n] = ulib_shcache_alloc(sc)) == 0)
+            break;
+        recs[n]->seq = n;
+        n++;
+    }
+
+    /* No record was handed out twice.  */
+    for (i = 0; i < n; i++)
+        if (recs[i]->seq != i)
+            abort();
+
+    for (i = 0; i < n; i++)
+        ulib_shcache_free(sc, recs[i]);
+    free(recs);
+    return n;
+}
+
+/* Exchange records with the other workers through the slots, each in
+   its own mapping of the region.  */
+static void
+worker(int fd, unsigned int id) {
+    ulib_shcache *sc;
+    struct record *rec;
+    uint64_t off;
+    unsigned int i;
+
+    srand(id + 1);
+    if ((sc = ulib_shcache_attach(map_region(fd), REGION_SIZE)) == 0)
+        abort();
+
+    for (i = 0; i < NLOOPS; i++) {
+        if ((rec = ulib_shcache_alloc(sc)) == 0)
+            abort();
+        rec->magic = MAGIC;
+        rec->owner = id;
+        rec->seq = i;
+
+        off = atomic_exchange(&slots[ulib_rand(0, NSLOTS - 1)], ulib_shcache_offset(sc, rec));
+        if (off == 0)
+            continue;
+
+        rec = ulib_shcache_ptr(sc, off);
+        if (rec->magic != MAGIC || rec->owner >= NWORKERS)
+            abort();
+        rec->magic = 0;
+        ulib_shcache_free(sc, rec);
+    }
+
+    ulib_shcache_detach(sc);
+}
+
+/* Check attaching to a region with a corrupt header fails.  */
+static void
+test_corrupt(void) {
+    static uint64_t mem[512];
+    uint32_t *align = (uint32_t *)mem + 4;
+    ulib_shcache *sc;
+    unsigned int i;
+    static const uint32_t bad[] = {0, 1, 3, 12, 1U << 31};
+
+    sc = ulib_shcache_create(
+        mem, sizeof(mem), ULIB_CACHE_SIZE, sizeof(struct record), 0);
+    if (sc == 0)
+        abort();
+    ulib_shcache_detach(sc);
+
+    /* The alignment follows the magic, the version and the size.  */
+    if (*align != sizeof(uint64_t))
+        abort();
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        *align = bad[i];
+        if (ulib_shcache_attach(mem, sizeof(mem)) != 0)
+            abort();
+    }
+
+    *align = sizeof(uint64_t);
+    if ((sc = ulib_shcache_attach(mem, sizeof(mem))) == 0)
+        abort();
+    ulib_shcache_detach(sc);
+}
+
+int
+main() {
+    FILE *f;
+    int fd, status;
+    unsigned int i, n, m;
+    pid_t pid[NWORKERS];
+    ulib_shcache *sc;
+
+    if ((f = tmpfile()) == 0)
+        abort();
+    fd = fileno(f);
+    if (ftruncate(fd, REGION_SIZE) < 0)
+        abort();
+
+    slots = mmap(0,
+                 NSLOTS * sizeof(*slots),
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS,
+                 -1,
+                 0);
+    if (slots == MAP_FAILED)
+        abort();
+
+    sc = ulib_shcache_create(
+        map_region(fd), REGION_SIZE, ULIB_CACHE_SIZE, sizeof(struct record), 0);
+    if (sc == 0)
+        abort();
+    n = drain(sc);
+
+    for (i = 0; i < NWORKERS; i++) {
+        if ((pid[i] = fork()) < 0)
+            abort();
+        if (pid[i] == 0) {
+            worker(fd, i);
+            _exit(0);
+        }
+    }
+
+    for (i = 0; i < NWORKERS; i++)
+        if (waitpid(pid[i], &status, 0) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+            abort();
+
+    for (i = 0; i < NSLOTS; i++)
+        if (slots[i])
+            ulib_shcache_free(sc, ulib_shcache_ptr(sc, slots[i]));
+
+    /* All the records are back on the free list.  */
+    m = drain(sc);
+    printf("shcache: records = %u, after workers = %u\n", n, m);
+    if (n == 0 || m != n)
+        abort();
+
+    ulib_shcache_detach(sc);
+
+    test_corrupt();
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -144,6 +144,7 @@ test() {
 int
 main() {
     ulib_time ts1, ts2;
+    ulib_gcstats st;
     double tm;
 
     setvbuf(stdout, 0, _IONBF, 0);
@@ -170,6 +171,17 @@ main() {
     printf("nins = %u, ndel = %u\n", nins, ndel);
     printf("nalloc = %u\n", NLOOPS);
     printf("avg alloc+ins+del+gc = %f us\n", tm / (NLOOPS + nins + ndel + ngc));
+
+    ulib_gcstats_get(&st);
+    if (st.collections != ngc + 1)
+        abort();
+    printf("gc: collections = %llu, scanned = %llu, freed = %llu\n",
+           st.collections,
+           st.total.objects_scanned,
+           st.total.objects_freed);
+    printf("gc: avg pause = %f us, max pause = %f us\n",
+           (st.total.mark_time + st.total.sweep_time) / 1e3 / st.collections,
+           st.pause_max / 1e3);
     return 0;
 }
 
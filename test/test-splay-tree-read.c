@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ulib/cache.h>
+#include <ulib/rand.h>
+
+#define ULIB_SPLAY_TREE_KEY_TYPE unsigned int
+#define ULIB_SPLAY_TREE_TYPE uint_tree
+#define ULIB_SPLAY_TREE_READ_MOSTLY 1
+#define ULIB_SPLAY_TREE_SPLAY_PERIOD 64
+
+#include <ulib/splay-tree.h>
+#include <ulib/splay-tree.c>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NKEYS 100000U
+#define NREADERS 4
+#define NLOOKUPS 1000000U
+#define NWRITES 10000U
+
+static ulib_cache *uint_tree_cache;
+static uint_tree *root;
+static unsigned int accesses;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int
+depth(const uint_tree *t, unsigned int key) {
+    unsigned int d = 0;
+
+    while (t->key != key) {
+        t = key < t->key ? t->left : t->right;
+        d++;
+    }
+    return d;
+}
+
+/* Look up even keys, which are always present, and odd keys, which
+   come and go, under the reader lock.  */
+static void *
+reader(void *arg) {
+    unsigned int i, k, seed = (unsigned int)(size_t)arg;
+    uint_tree *r;
+    int found;
+
+    for (i = 0; i < NLOOKUPS; i++) {
+        seed = seed * 1103515245U + 12345U;
+        k = (seed >> 8) % (2 * NKEYS);
+
+        pthread_rwlock_rdlock(&lock);
+        r = root;
+        found = uint_tree_lookup(&root, k);
+        if (root != r || (k % 2 == 0 && !found))
+            abort();
+        pthread_rwlock_unlock(&lock);
+    }
+    return 0;
+}
+
+int
+main() {
+    pthread_t thr[NREADERS];
+    unsigned int i, k, small_accesses = 0;
+    uint_tree *elt, *small, *nodes[3];
+
+    setvbuf(stdout, 0, _IONBF, 0);
+
+    uint_tree_cache = ulib_cache_create(
+        ULIB_CACHE_SIZE, sizeof(uint_tree), ULIB_CACHE_ALIGN, sizeof(void *), 0);
+
+    /* Inserting in order makes a degenerate tree, its first key is the
+       deepest one.  */
+    for (i = 0; i < NKEYS; i++) {
+        elt = ulib_cache_alloc(uint_tree_cache);
+        elt->left = elt->right = 0;
+        elt->key = 2 * i;
+        if (uint_tree_insert(&root, elt) < 0)
+            abort();
+    }
+
+    elt = root;
+    for (i = 0; i < 100; i++)
+        if (!uint_tree_lookup(&root, 2 * i) || uint_tree_lookup(&root, 2 * i + 1))
+            abort();
+    if (root != elt || depth(root, 0) != NKEYS - 1)
+        abort();
+
+    /* Accessing a deep key splays it, accessing a shallow one doesn't,
+       unless it's time to.  */
+    if (!uint_tree_access(&root, &accesses, 0) || root->key != 0)
+        abort();
+    elt = root;
+    if (!uint_tree_access(&root, &accesses, elt->right->key) || root != elt)
+        abort();
+
+    /* The period counts the accesses to each tree separately.  */
+    for (i = 0; i < 3; i++) {
+        nodes[i] = ulib_cache_alloc(uint_tree_cache);
+        nodes[i]->key = 2 * i + 1;
+    }
+    small = uint_tree_build_sorted(nodes, 3);
+    for (i = 0; i < ULIB_SPLAY_TREE_SPLAY_PERIOD - 1; i++)
+        if (!uint_tree_access(&root, &accesses, 0))
+            abort();
+    for (i = 0; i < ULIB_SPLAY_TREE_SPLAY_PERIOD - 1; i++)
+        if (!uint_tree_access(&small, &small_accesses, 1) || small->key != 3)
+            abort();
+    if (!uint_tree_access(&small, &small_accesses, 1) || small->key != 1)
+        abort();
+    for (i = 0; i < 3; i++)
+        ulib_cache_free(uint_tree_cache, nodes[i]);
+
+    /* Deep keys get splayed until the tree is reasonably balanced.  */
+    for (i = 0; i < 4 * NKEYS; i++)
+        if (!uint_tree_access(&root, &accesses, 2 * ulib_rand(0, NKEYS - 1)))
+            abort();
+    for (i = k = 0; i < NKEYS; i++)
+        if (depth(root, 2 * i) > k)
+            k = depth(root, 2 * i);
+    printf("read: max depth after accesses = %u\n", k);
+
+    for (i = 0; i < NREADERS; i++)
+        if (pthread_create(&thr[i], 0, reader, (void *)(size_t)(i + 1)) != 0)
+            abort();
+
+    /* Restructure the tree concurrently with the readers.  */
+    for (i = 0; i < NWRITES; i++) {
+        k = ulib_rand(0, NKEYS - 1);
+
+        pthread_rwlock_wrlock(&lock);
+        if (!uint_tree_access(&root, &accesses, 2 * k))
+            abort();
+        if ((elt = uint_tree_delete(&root, 2 * k + 1)) == 0) {
+            elt = ulib_cache_alloc(uint_tree_cache);
+            elt->left = elt->right = 0;
+            elt->key = 2 * k + 1;
+            if (uint_tree_insert(&root, elt) < 0)
+                abort();
+        } else
+            ulib_cache_free(uint_tree_cache, elt);
+        pthread_rwlock_unlock(&lock);
+    }
+
+    for (i = 0; i < NREADERS; i++)
+        pthread_join(thr[i], 0);
+
+    printf("read: %u readers x %u lookups, %u writes\n", NREADERS, NLOOKUPS, NWRITES);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
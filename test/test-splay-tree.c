@@ -108,6 +108,180 @@ test() {
     ulib_cache_flush(uint_tree_cache);
 }
 
+#define NITER 100000U
+
+static unsigned int perm[NITER];
+static unsigned int range_n, range_last;
+
+static int
+range_visit(uint_tree *node, void *arg) {
+    if (range_n > 0 && node->key <= range_last)
+        abort();
+
+    range_last = node->key;
+    return ++range_n == *(unsigned int *)arg;
+}
+
+/* Check the iterators and the range walks over a tree with the keys
+   0, 2, ..., 2 * (N - 1), inserted in ascending or random ORDER.  */
+static void
+test_iter(unsigned int n, int ordered) {
+    uint_tree *t = 0, *elt;
+    unsigned int i, j, lo, hi, limit;
+
+    for (i = 0; i < n; i++)
+        perm[i] = i;
+    for (i = n - 1; !ordered && i > 0; i--) {
+        j = ulib_rand(0, i);
+        lo = perm[i];
+        perm[i] = perm[j];
+        perm[j] = lo;
+    }
+    for (i = 0; i < n; i++) {
+        elt = ulib_cache_alloc(uint_tree_cache);
+        elt->left = elt->right = 0;
+        elt->key = 2 * perm[i];
+        if (uint_tree_insert(&t, elt) < 0)
+            abort();
+    }
+
+    for (i = 0; i < n; i++) {
+        if (uint_tree_lower_bound(t, 2 * i)->key != 2 * i
+            || (i > 0 && uint_tree_upper_bound(t, 2 * i - 1)->key != 2 * i))
+            abort();
+        elt = uint_tree_upper_bound(t, 2 * i);
+        if (i < n - 1 ? elt == 0 || elt->key != 2 * i + 2 : elt != 0)
+            abort();
+    }
+    if (uint_tree_lower_bound(t, 2 * n - 1) != 0)
+        abort();
+
+    for (i = 0; i < 1000; i++) {
+        lo = ulib_rand(0, 2 * n);
+        hi = ulib_rand(lo, 2 * n);
+        limit = 0;
+        range_n = 0;
+        if (uint_tree_range(t, lo, hi, range_visit, &limit) != 0
+            || range_n != (hi < 2 * n ? hi / 2 : n - 1) + 1 - (lo + 1) / 2)
+            abort();
+
+        limit = 10;
+        range_n = 0;
+        if (uint_tree_range(t, lo, hi, range_visit, &limit) != (range_n == limit)
+            || range_n > limit)
+            abort();
+    }
+
+    /* The walks splay the tree, so they go last.  */
+    for (i = 0, elt = uint_tree_first(t); elt; elt = uint_tree_next(&t, elt), i++)
+        if (elt->key != 2 * i)
+            abort();
+    if (i != n)
+        abort();
+
+    for (i = n, elt = uint_tree_last(t); elt; elt = uint_tree_prev(&t, elt))
+        if (elt->key != 2 * --i)
+            abort();
+    if (i != 0)
+        abort();
+
+    for (i = 0; i < n; i++)
+        ulib_cache_free(uint_tree_cache, uint_tree_delete(&t, 2 * i));
+    if (t != 0)
+        abort();
+    printf("iter: %u keys, %s order\n", n, ordered ? "ascending" : "random");
+}
+
+/* Walk a degenerate tree of N nodes, a spine of left links made by
+   ascending insertions, which must take linear time.  */
+static void
+test_spine(unsigned int n) {
+    uint_tree *t = 0, *elt;
+    unsigned int i, limit;
+
+    for (i = 0; i < n; i++) {
+        elt = ulib_cache_alloc(uint_tree_cache);
+        elt->left = elt->right = 0;
+        elt->key = i;
+        if (uint_tree_insert(&t, elt) < 0)
+            abort();
+    }
+
+    /* Interrupted and complete range walks leave the spine intact.  */
+    for (limit = 1; limit <= n; limit *= 10) {
+        range_n = 0;
+        if (uint_tree_range(t, 1, n, range_visit, &limit) != (limit < n)
+            || range_n != (limit < n ? limit : n - 1))
+            abort();
+        for (i = n, elt = t; elt; elt = elt->left)
+            if (elt->right || elt->key != --i)
+                abort();
+        if (i != 0)
+            abort();
+    }
+
+    for (i = 0, elt = uint_tree_first(t); elt; elt = uint_tree_next(&t, elt), i++)
+        if (elt->key != i)
+            abort();
+    if (i != n)
+        abort();
+
+    for (i = 0; i < n; i++)
+        ulib_cache_free(uint_tree_cache, uint_tree_delete(&t, i));
+    if (t != 0)
+        abort();
+    printf("spine: %u keys\n", n);
+}
+
+static uint_tree *nodes[NITER];
+
+static unsigned int
+height(const uint_tree *t) {
+    unsigned int hl, hr;
+
+    if (t == 0)
+        return 0;
+
+    hl = height(t->left);
+    hr = height(t->right);
+    return (hl > hr ? hl : hr) + 1;
+}
+
+/* Build trees of sorted nodes of various sizes and check they are
+   balanced and fully functional.  */
+static void
+test_build() {
+    static const unsigned int sizes[] = {0, 1, 2, 3, 4, 5, 7, 8, 100, 1023, 1024, NITER};
+    uint_tree *t;
+    unsigned int i, j, n, h;
+
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+        n = sizes[j];
+        for (i = 0; i < n; i++) {
+            nodes[i] = ulib_cache_alloc(uint_tree_cache);
+            nodes[i]->key = 2 * i;
+        }
+
+        t = uint_tree_build_sorted(nodes, n);
+        h = height(t);
+        if (t) {
+            check_tree(t);
+            if ((1U << (h - 1)) > n || (1U << h) <= n)
+                abort();
+        }
+
+        for (i = 0; i < n; i++)
+            if (!uint_tree_lookup(&t, 2 * i) || uint_tree_lookup(&t, 2 * i + 1))
+                abort();
+
+        for (i = 0; i < n; i++)
+            ulib_cache_free(uint_tree_cache, uint_tree_delete(&t, 2 * i));
+        if (t != 0)
+            abort();
+    }
+    printf("build: ok\n");
+}
+
 int
 main() {
     ulib_time ts1, ts2;
@@ -129,6 +303,11 @@ main() {
     if (root)
         check_tree(root);
 
+    test_iter(NITER, 0);
+    test_iter(1000, 1);
+    test_spine(NITER);
+    test_build();
+
     tm = ts2.sec * 1e6 + ts2.usec - ts1.sec * 1e6 - ts1.usec;
 
     printf("time = %f s\n", tm / 1e6);
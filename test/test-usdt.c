@@ -0,0 +1,127 @@
+#include <ulib/cache.h>
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const probes[] = {"slab_create",
+                                     "slab_release",
+                                     "pgroup_alloc",
+                                     "pgroup_release",
+                                     "gc_start",
+                                     "gc_mark",
+                                     "gc_sweep",
+                                     "gc_end"};
+
+#define NPROBES (sizeof(probes) / sizeof(probes[0]))
+
+static char *
+read_file(const char *name, size_t *len) {
+    FILE *f;
+    char *buf;
+    long n;
+
+    if ((f = fopen(name, "rb")) == 0 || fseek(f, 0, SEEK_END) < 0 || (n = ftell(f)) < 0
+        || fseek(f, 0, SEEK_SET) < 0)
+        abort();
+    if ((buf = malloc(n)) == 0 || fread(buf, 1, n, f) != (size_t)n)
+        abort();
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+/* Check the argument descriptions of a probe - a space separated list
+   of SIZE@OPERAND.  */
+static void
+check_args(const char *args) {
+    const char *p = args;
+    long size;
+    char *end;
+
+    while (*p) {
+        size = strtol(p, &end, 10);
+        if (end == p || *end != '@' || (labs(size) != 1 && labs(size) != 2 && labs(size) != 4
+                                        && labs(size) != 8))
+            abort();
+        for (p = end + 1; *p && *p != ' '; p++)
+            ;
+        if (p == end + 1)
+            abort();
+        while (*p == ' ')
+            p++;
+    }
+}
+
+int
+main() {
+    char *buf, *sec, *note, *end, *desc, *provider, *name;
+    size_t len;
+    const Elf64_Ehdr *eh;
+    const Elf64_Shdr *sh;
+    const Elf64_Nhdr *nh;
+    const char *strtab;
+    unsigned int i, j, found[NPROBES] = {0}, nnotes = 0;
+    ulib_cache *cache;
+
+    /* Make sure the allocator is linked in.  */
+    if ((cache = ulib_cache_create(ULIB_CACHE_SIZE, 16, ULIB_CACHE_GC, 0)) == 0)
+        abort();
+    ulib_cache_alloc(cache);
+    ulib_gcrun();
+
+    buf = read_file("/proc/self/exe", &len);
+    eh = (const Elf64_Ehdr *)buf;
+    if (len < sizeof(Elf64_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0
+        || eh->e_ident[EI_CLASS] != ELFCLASS64)
+        abort();
+
+    sh = (const Elf64_Shdr *)(buf + eh->e_shoff);
+    strtab = buf + sh[eh->e_shstrndx].sh_offset;
+    for (i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_NOTE || strcmp(strtab + sh[i].sh_name, ".note.stapsdt") != 0)
+            continue;
+
+        sec = buf + sh[i].sh_offset;
+        end = sec + sh[i].sh_size;
+        for (note = sec; note < end;
+             note += sizeof(Elf64_Nhdr) + ((nh->n_namesz + 3) & ~3U)
+                     + ((nh->n_descsz + 3) & ~3U)) {
+            nh = (const Elf64_Nhdr *)note;
+            if (nh->n_type != 3 || strcmp(note + sizeof(Elf64_Nhdr), "stapsdt") != 0)
+                continue;
+
+            /* Probe address, base address and semaphore address,
+               followed by the provider, the name and the arguments.  */
+            desc = note + sizeof(Elf64_Nhdr) + ((nh->n_namesz + 3) & ~3U);
+            provider = desc + 3 * 8;
+            if (strcmp(provider, "ulib") != 0)
+                continue;
+            name = provider + strlen(provider) + 1;
+            check_args(name + strlen(name) + 1);
+
+            nnotes++;
+            for (j = 0; j < NPROBES; j++)
+                if (strcmp(name, probes[j]) == 0)
+                    found[j]++;
+        }
+    }
+
+    printf("usdt: %u probe sites\n", nnotes);
+    for (j = 0; j < NPROBES; j++) {
+        printf("  ulib:%s %u\n", probes[j], found[j]);
+        if (found[j] == 0)
+            abort();
+    }
+
+    free(buf);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
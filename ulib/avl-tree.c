@@ -1,22 +1,49 @@
+/* Insert a node.  Record the path from the root on a stack, comparing
+   the key once per level, then retrace the path upwards, updating the
+   balance factors, until the height of a subtree stays the same.  */
 ULIB_STATIC int
 ULIB_AVL_TREE(insert)(ULIB_AVL_TREE_TYPE **pr, ULIB_AVL_TREE_TYPE *key) {
-    ULIB_AVL_TREE_TYPE *t, *r;
-    int h;
-
-    r = *pr;
-    if (r == 0) {
-        key->left = key->right = 0;
-        key->balance = 0;
-        *pr = key;
-        return 1;
+    ULIB_AVL_TREE_TYPE **path[ULIB_AVL_TREE_MAX_HEIGHT], **p, *t, *r;
+    unsigned char dir[ULIB_AVL_TREE_MAX_HEIGHT];
+    unsigned int n = 0;
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+    unsigned int k;
+#endif
+    int c;
+
+    for (p = pr; (r = *p) != 0;) {
+        path[n] = p;
+        if ((c = ULIB_AVL_TREE_COMPARE(key->key, r->key)) < 0) {
+            dir[n++] = 0;
+            p = &r->left;
+        } else if (c > 0) {
+            dir[n++] = 1;
+            p = &r->right;
+        } else
+            return -1;
     }
 
-    if (ULIB_AVL_TREE_COMPARE(r->key, key->key) > 0) {
-        if ((h = ULIB_AVL_TREE(insert)(&r->left, key)) <= 0)
-            return h;
+    key->left = key->right = 0;
+    key->balance = 0;
+    *p = key;
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+    key->size = 1;
+    for (k = 0; k < n; k++)
+        (*path[k])->size++;
+#endif
+
+    while (n--) {
+        p = path[n];
+        r = *p;
+        if (dir[n] == 0) {
+            if (r->balance == 1) {
+                r->balance = 0;
+                break;
+            } else if (r->balance == 0) {
+                r->balance = -1;
+                continue;
+            }
 
-        switch (r->balance) {
-        case -1:
             t = r->left;
             if (t->balance == -1) {
                 r->left = t->right;
@@ -39,26 +66,15 @@ ULIB_AVL_TREE(insert)(ULIB_AVL_TREE_TYPE **pr, ULIB_AVL_TREE_TYPE *key) {
                 else
                     t->left->balance = 0;
             }
-            t->balance = 0;
-            *pr = t;
-            return 0;
-
-        case 0:
-            r->balance = -1;
-            return 1;
-
-        case 1:
-            r->balance = 0;
-            return 0;
-        }
-    }
-
-    if (ULIB_AVL_TREE_COMPARE(r->key, key->key) < 0) {
-        if ((h = ULIB_AVL_TREE(insert)(&r->right, key)) <= 0)
-            return h;
+        } else {
+            if (r->balance == -1) {
+                r->balance = 0;
+                break;
+            } else if (r->balance == 0) {
+                r->balance = 1;
+                continue;
+            }
 
-        switch (r->balance) {
-        case 1:
             t = r->right;
             if (t->balance == 1) {
                 r->right = t->left;
@@ -81,28 +97,61 @@ ULIB_AVL_TREE(insert)(ULIB_AVL_TREE_TYPE **pr, ULIB_AVL_TREE_TYPE *key) {
                 else
                     t->right->balance = 0;
             }
-            t->balance = 0;
-            *pr = t;
-            return 0;
+        }
 
-        case 0:
-            r->balance = 1;
-            return 1;
+        /* A rotation after an insertion restores the height of the
+         subtree.  */
+        t->balance = 0;
+        *p = t;
+        ULIB_AVL_TREE(rotated)(t);
+        break;
+    }
 
-        case -1:
-            r->balance = 0;
-            return 0;
-        }
+    return 0;
+}
+
+/* Nodes, copied by a copy-on-write update.  The update modifies only
+   the copies, so it is abandoned by releasing them, or committed by
+   publishing the new root and retiring the originals.  */
+struct ULIB_AVL_TREE(cow) {
+    ulib_cache *cache;
+    unsigned int n;
+    int failed;
+    ULIB_AVL_TREE_TYPE *old[3 * ULIB_AVL_TREE_MAX_HEIGHT];
+    ULIB_AVL_TREE_TYPE *copy[3 * ULIB_AVL_TREE_MAX_HEIGHT];
+};
+
+/* In a copy-on-write update C, replace the node at the link P, which
+   is about to be modified, by a copy.  Return zero if out of memory.
+   Without an update, do nothing.  */
+static inline int
+ULIB_AVL_TREE(cow_touch)(struct ULIB_AVL_TREE(cow) *c, ULIB_AVL_TREE_TYPE **p) {
+    ULIB_AVL_TREE_TYPE *t;
+
+    if (c == 0)
+        return 1;
+
+    if (c->n == 3 * ULIB_AVL_TREE_MAX_HEIGHT
+        || (t = (ULIB_AVL_TREE_TYPE *)ulib_cache_alloc(c->cache)) == 0) {
+        c->failed = 1;
+        return 0;
     }
 
-    return -1;
+    memcpy(t, *p, sizeof(*t));
+#ifdef ULIB_AVL_TREE_PERSISTENT
+    t->refs = 1;
+#endif
+    c->old[c->n] = *p;
+    c->copy[c->n++] = t;
+    *p = t;
+    return 1;
 }
 
 /* Balance the right subtree after a deletion on the left subtree
    decreases the height.  Return whether the height of the tree
    changed. */
 static int
-ULIB_AVL_TREE(balance_right)(ULIB_AVL_TREE_TYPE **pr) {
+ULIB_AVL_TREE(balance_right)(ULIB_AVL_TREE_TYPE **pr, struct ULIB_AVL_TREE(cow) *c) {
     ULIB_AVL_TREE_TYPE *t, *r;
 
     r = *pr;
@@ -117,12 +166,15 @@ ULIB_AVL_TREE(balance_right)(ULIB_AVL_TREE_TYPE **pr) {
 
     default:
     case 1:
+        if (!ULIB_AVL_TREE(cow_touch)(c, &r->right))
+            return 0;
         t = r->right;
         if (t->balance >= 0) {
             r->right = t->left;
             t->left = r;
 
             *pr = t;
+            ULIB_AVL_TREE(rotated)(t);
             if (t->balance == 0) {
                 t->balance = -1;
                 t->left->balance = 1;
@@ -133,6 +185,8 @@ ULIB_AVL_TREE(balance_right)(ULIB_AVL_TREE_TYPE **pr) {
                 return 1;
             }
         } else {
+            if (!ULIB_AVL_TREE(cow_touch)(c, &t->left))
+                return 0;
             t = t->left;
             r->right->left = t->right;
             t->right = r->right;
@@ -153,6 +207,7 @@ ULIB_AVL_TREE(balance_right)(ULIB_AVL_TREE_TYPE **pr) {
             t->balance = 0;
         }
         *pr = t;
+        ULIB_AVL_TREE(rotated)(t);
         return 1;
     }
 }
@@ -161,7 +216,7 @@ ULIB_AVL_TREE(balance_right)(ULIB_AVL_TREE_TYPE **pr) {
    decreases the height.  Return whether the height of the tree
    changed.  */
 static int
-ULIB_AVL_TREE(balance_left)(ULIB_AVL_TREE_TYPE **pr) {
+ULIB_AVL_TREE(balance_left)(ULIB_AVL_TREE_TYPE **pr, struct ULIB_AVL_TREE(cow) *c) {
     ULIB_AVL_TREE_TYPE *t, *r;
 
     r = *pr;
@@ -176,12 +231,15 @@ ULIB_AVL_TREE(balance_left)(ULIB_AVL_TREE_TYPE **pr) {
 
     default:
     case -1:
+        if (!ULIB_AVL_TREE(cow_touch)(c, &r->left))
+            return 0;
         t = r->left;
         if (t->balance <= 0) {
             r->left = t->right;
             t->right = r;
 
             *pr = t;
+            ULIB_AVL_TREE(rotated)(t);
             if (t->balance == 0) {
                 t->balance = 1;
                 t->right->balance = -1;
@@ -192,6 +250,8 @@ ULIB_AVL_TREE(balance_left)(ULIB_AVL_TREE_TYPE **pr) {
                 return 1;
             }
         } else {
+            if (!ULIB_AVL_TREE(cow_touch)(c, &t->right))
+                return 0;
             t = t->right;
             r->left->right = t->left;
             t->left = r->left;
@@ -212,74 +272,655 @@ ULIB_AVL_TREE(balance_left)(ULIB_AVL_TREE_TYPE **pr) {
             t->balance = 0;
         }
         *pr = t;
+        ULIB_AVL_TREE(rotated)(t);
         return 1;
     }
 }
 
-/* Remove the node with the maximum key.  Return whether the height of
-   the tree changed.  */
+/* Remove a key from an AVL tree.  Return negative if the key was not
+   found or whether the height of the tree changed.  Like the
+   insertion, record the path to the node, replacing a node with two
+   children by the node with the maximum key of its left subtree, then
+   retrace the path, until the height of a subtree stays the same.  */
 static int
-ULIB_AVL_TREE(delete_max)(ULIB_AVL_TREE_TYPE **pr, ULIB_AVL_TREE_TYPE **rn) {
-    ULIB_AVL_TREE_TYPE *r;
+ULIB_AVL_TREE(del)(ULIB_AVL_TREE_TYPE **pr,
+                   ULIB_AVL_TREE_KEY_TYPE key,
+                   ULIB_AVL_TREE_TYPE **dn,
+                   struct ULIB_AVL_TREE(cow) *cow) {
+    ULIB_AVL_TREE_TYPE **path[ULIB_AVL_TREE_MAX_HEIGHT], **p, **q, *t, *r;
+    unsigned char dir[ULIB_AVL_TREE_MAX_HEIGHT];
+    unsigned int n = 0, k;
+    int c;
+
+    for (p = pr;;) {
+        if ((r = *p) == 0)
+            return -1;
+
+        path[n] = p;
+        if ((c = ULIB_AVL_TREE_COMPARE(key, r->key)) < 0) {
+            dir[n++] = 0;
+            p = &r->left;
+        } else if (c > 0) {
+            dir[n++] = 1;
+            p = &r->right;
+        } else
+            break;
+    }
 
-    r = *pr;
-    if (r->right) {
-        if (ULIB_AVL_TREE(delete_max)(&r->right, rn))
-            return ULIB_AVL_TREE(balance_left)(pr);
-        else
+    *dn = r;
+    if (r->left && r->right) {
+        k = n;
+        path[n] = p;
+        dir[n++] = 0;
+        for (q = &r->left; (*q)->right; q = &(*q)->right) {
+            path[n] = q;
+            dir[n++] = 1;
+        }
+
+        t = *q;
+        *q = t->left;
+        t->left = r->left;
+        t->right = r->right;
+        t->balance = r->balance;
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+        t->size = r->size;
+#endif
+        *p = t;
+
+        /* The path continues through the left link of the replacement
+         node now.  */
+        if (k + 1 < n)
+            path[k + 1] = &t->left;
+    } else
+        *p = (r->left == 0) ? r->right : r->left;
+
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+    for (k = 0; k < n; k++)
+        (*path[k])->size--;
+#endif
+
+    while (n--) {
+        if (dir[n] == 0 ? !ULIB_AVL_TREE(balance_right)(path[n], cow)
+                        : !ULIB_AVL_TREE(balance_left)(path[n], cow))
             return 0;
+    }
+
+    return 1;
+}
+
+/* Join the tree L of height HL, the node K and the tree R of height
+   HR.  Descend the spine of the higher tree to a subtree, no more
+   than one level higher than the other tree, join them under K and
+   rebalance on the way back.  Set *H to the height of the result and
+   return its root.  */
+static ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(join_h)(ULIB_AVL_TREE_TYPE *l,
+                      int hl,
+                      ULIB_AVL_TREE_TYPE *k,
+                      ULIB_AVL_TREE_TYPE *r,
+                      int hr,
+                      int *h) {
+    ULIB_AVL_TREE_TYPE *t;
+    int ht, hs;
+
+    if (hl > hr + 1) {
+        hs = hl - (l->balance > 0 ? 2 : 1);
+        t = ULIB_AVL_TREE(join_h)(l->right, hl - (l->balance < 0 ? 2 : 1), k, r, hr, &ht);
+        l->right = t;
+        ULIB_AVL_TREE(changed)(l);
+        if (ht - hs < 2) {
+            l->balance = ht - hs;
+            *h = (hs > ht ? hs : ht) + 1;
+        } else {
+            /* The right subtree is two levels higher, which is what
+             ``balance_right'' repairs after a deletion.  */
+            l->balance = 1;
+            *h = ht + 1 - ULIB_AVL_TREE(balance_right)(&l, 0);
+        }
+        return l;
+    }
+
+    if (hr > hl + 1) {
+        hs = hr - (r->balance < 0 ? 2 : 1);
+        t = ULIB_AVL_TREE(join_h)(l, hl, k, r->left, hr - (r->balance > 0 ? 2 : 1), &ht);
+        r->left = t;
+        ULIB_AVL_TREE(changed)(r);
+        if (ht - hs < 2) {
+            r->balance = hs - ht;
+            *h = (hs > ht ? hs : ht) + 1;
+        } else {
+            r->balance = -1;
+            *h = ht + 1 - ULIB_AVL_TREE(balance_left)(&r, 0);
+        }
+        return r;
+    }
+
+    k->left = l;
+    k->right = r;
+    k->balance = hr - hl;
+    ULIB_AVL_TREE(changed)(k);
+    *h = (hl > hr ? hl : hr) + 1;
+    return k;
+}
+
+ULIB_STATIC ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(join)(ULIB_AVL_TREE_TYPE *l, ULIB_AVL_TREE_TYPE *k, ULIB_AVL_TREE_TYPE *r) {
+    int h;
+
+    return ULIB_AVL_TREE(join_h)(
+        l, ULIB_AVL_TREE(height)(l), k, r, ULIB_AVL_TREE(height)(r), &h);
+}
+
+/* Split the tree T of height HT into the tree *L of height *HL and
+   the tree *R of height *HR, joining the subtrees off the search path
+   on the way back.  Return the node with the key KEY or null.  */
+static ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(split_h)(ULIB_AVL_TREE_TYPE *t,
+                       int ht,
+                       ULIB_AVL_TREE_KEY_TYPE key,
+                       ULIB_AVL_TREE_TYPE **l,
+                       int *hl,
+                       ULIB_AVL_TREE_TYPE **r,
+                       int *hr) {
+    ULIB_AVL_TREE_TYPE *x;
+    int c, hll, hrr;
+
+    if (t == 0) {
+        *l = *r = 0;
+        *hl = *hr = 0;
+        return 0;
+    }
+
+    hll = ht - (t->balance > 0 ? 2 : 1);
+    hrr = ht - (t->balance < 0 ? 2 : 1);
+    if ((c = ULIB_AVL_TREE_COMPARE(key, t->key)) < 0) {
+        x = ULIB_AVL_TREE(split_h)(t->left, hll, key, l, hl, r, hr);
+        *r = ULIB_AVL_TREE(join_h)(*r, *hr, t, t->right, hrr, hr);
+    } else if (c > 0) {
+        x = ULIB_AVL_TREE(split_h)(t->right, hrr, key, l, hl, r, hr);
+        *l = ULIB_AVL_TREE(join_h)(t->left, hll, t, *l, *hl, hl);
     } else {
-        *rn = r;
-        *pr = r->left;
-        return 1;
+        *l = t->left;
+        *hl = hll;
+        *r = t->right;
+        *hr = hrr;
+        x = t;
+        x->left = x->right = 0;
+        x->balance = 0;
+        ULIB_AVL_TREE(changed)(x);
     }
+    return x;
 }
 
-/* Remove a key from an AVL tree.  Return negative if the key was not
-   found or whether the height of the tree changed.  */
-static int
-ULIB_AVL_TREE(del)(ULIB_AVL_TREE_TYPE **pr,
-                   ULIB_AVL_TREE_KEY_TYPE key,
-                   ULIB_AVL_TREE_TYPE **dn) {
-    ULIB_AVL_TREE_TYPE *t, *r;
+ULIB_STATIC ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(split)(ULIB_AVL_TREE_TYPE *r,
+                     ULIB_AVL_TREE_KEY_TYPE key,
+                     ULIB_AVL_TREE_TYPE **l,
+                     ULIB_AVL_TREE_TYPE **g) {
+    int hl, hg;
+
+    return ULIB_AVL_TREE(split_h)(r, ULIB_AVL_TREE(height)(r), key, l, &hl, g, &hg);
+}
+
+/* Remove the node with the largest key from the non-empty tree T of
+   height HT, leaving the tree *R of height *HR, and return it.  */
+static ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(split_last)(ULIB_AVL_TREE_TYPE *t,
+                          int ht,
+                          ULIB_AVL_TREE_TYPE **r,
+                          int *hr) {
+    ULIB_AVL_TREE_TYPE *x;
+    int hll = ht - (t->balance > 0 ? 2 : 1);
+
+    if (t->right == 0) {
+        *r = t->left;
+        *hr = hll;
+        return t;
+    }
+
+    x = ULIB_AVL_TREE(split_last)(t->right, ht - (t->balance < 0 ? 2 : 1), r, hr);
+    *r = ULIB_AVL_TREE(join_h)(t->left, hll, t, *r, *hr, hr);
+    return x;
+}
+
+/* Join the tree L of height HL and the tree R of height HR, with keys
+   greater than those in L, without a middle node.  */
+static ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(join2)(ULIB_AVL_TREE_TYPE *l,
+                     int hl,
+                     ULIB_AVL_TREE_TYPE *r,
+                     int hr,
+                     int *h) {
+    ULIB_AVL_TREE_TYPE *k;
+
+    if (l == 0) {
+        *h = hr;
+        return r;
+    }
+
+    k = ULIB_AVL_TREE(split_last)(l, hl, &l, &hl);
+    return ULIB_AVL_TREE(join_h)(l, hl, k, r, hr, h);
+}
+
+/* A list of the nodes, left over by a set operation, linked through
+   their right pointers.  */
+struct ULIB_AVL_TREE(list) {
+    ULIB_AVL_TREE_TYPE *head;
+    ULIB_AVL_TREE_TYPE **tail;
+};
+
+/* Append the node N to the list L.  */
+static inline void
+ULIB_AVL_TREE(list_add)(struct ULIB_AVL_TREE(list) *l, ULIB_AVL_TREE_TYPE *n) {
+    n->left = n->right = 0;
+    *l->tail = n;
+    l->tail = &n->right;
+}
+
+/* Append all the nodes of the tree T to the list L.  */
+static void
+ULIB_AVL_TREE(list_add_tree)(struct ULIB_AVL_TREE(list) *l, ULIB_AVL_TREE_TYPE *t) {
+    ULIB_AVL_TREE_TYPE *r;
+
+    while (t) {
+        ULIB_AVL_TREE(list_add_tree)(l, t->left);
+        r = t->right;
+        ULIB_AVL_TREE(list_add)(l, t);
+        t = r;
+    }
+}
+
+#define ULIB_AVL_TREE_UNION 0
+#define ULIB_AVL_TREE_INTERSECTION 1
+#define ULIB_AVL_TREE_DIFFERENCE 2
+
+static ULIB_AVL_TREE_TYPE *ULIB_AVL_TREE(setop)(int op,
+                                                ULIB_AVL_TREE_TYPE *a,
+                                                int ha,
+                                                ULIB_AVL_TREE_TYPE *b,
+                                                int hb,
+                                                struct ULIB_AVL_TREE(list) *rest,
+                                                int *h,
+                                                unsigned int spawn);
+
+#ifdef ULIB_AVL_TREE_PARALLEL
+
+/* A set operation on a pair of subtrees, run in another thread.  */
+struct ULIB_AVL_TREE(task) {
+    int op;
+    ULIB_AVL_TREE_TYPE *a, *b, *r;
+    int ha, hb, h;
+    unsigned int spawn;
+    struct ULIB_AVL_TREE(list) rest;
+};
+
+static void *
+ULIB_AVL_TREE(task_run)(void *arg) {
+    struct ULIB_AVL_TREE(task) *t = (struct ULIB_AVL_TREE(task) *)arg;
+
+    t->r = ULIB_AVL_TREE(setop)(
+        t->op, t->a, t->ha, t->b, t->hb, &t->rest, &t->h, t->spawn);
+    return 0;
+}
+
+/* Return the number of levels of the recursion, which may run their
+   halves in new threads, so that there are about as many threads as
+   processors.  */
+static unsigned int
+ULIB_AVL_TREE(spawn_levels)(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int k = 0;
+
+    while (n > 1) {
+        n = (n + 1) / 2;
+        k++;
+    }
+    return k;
+}
+
+#endif /* ULIB_AVL_TREE_PARALLEL */
+
+/* Apply the set operation OP to the tree A of height HA and the tree
+   B of height HB.  Split B by the key of the root of A, apply the
+   operation to the pairs of the left and the right parts and join the
+   results, with or without the root of A.  Append the nodes, left
+   over, to REST, set *H to the height of the result and return its
+   root.  The top SPAWN levels of the recursion may run the left pair
+   in a new thread.  */
+static ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(setop)(int op,
+                     ULIB_AVL_TREE_TYPE *a,
+                     int ha,
+                     ULIB_AVL_TREE_TYPE *b,
+                     int hb,
+                     struct ULIB_AVL_TREE(list) *rest,
+                     int *h,
+                     unsigned int spawn) {
+    ULIB_AVL_TREE_TYPE *x, *al, *ar, *bl, *br, *l, *r;
+    int hal, har, hbl, hbr, hl, hr;
+#ifdef ULIB_AVL_TREE_PARALLEL
+    struct ULIB_AVL_TREE(task) task;
+    pthread_t tid;
+#endif
+
+    if (a == 0 || b == 0) {
+        if (op == ULIB_AVL_TREE_UNION || (op == ULIB_AVL_TREE_DIFFERENCE && b == 0)) {
+            *h = a ? ha : hb;
+            return a ? a : b;
+        }
+        ULIB_AVL_TREE(list_add_tree)(rest, a ? a : b);
+        *h = 0;
+        return 0;
+    }
+
+    al = a->left;
+    ar = a->right;
+    hal = ha - (a->balance > 0 ? 2 : 1);
+    har = ha - (a->balance < 0 ? 2 : 1);
+    x = ULIB_AVL_TREE(split_h)(b, hb, a->key, &bl, &hbl, &br, &hbr);
+
+#ifdef ULIB_AVL_TREE_PARALLEL
+    task.op = op;
+    task.a = al;
+    task.ha = hal;
+    task.b = bl;
+    task.hb = hbl;
+    task.spawn = spawn - 1;
+    task.rest.head = 0;
+    task.rest.tail = &task.rest.head;
+    if (spawn > 0 && hal >= ULIB_AVL_TREE_PARALLEL && hbl >= ULIB_AVL_TREE_PARALLEL
+        && pthread_create(&tid, 0, ULIB_AVL_TREE(task_run), &task) == 0) {
+        r = ULIB_AVL_TREE(setop)(op, ar, har, br, hbr, rest, &hr, spawn - 1);
+        pthread_join(tid, 0);
+        l = task.r;
+        hl = task.h;
+        if (task.rest.head) {
+            *rest->tail = task.rest.head;
+            rest->tail = task.rest.tail;
+        }
+    } else
+#endif
+    {
+        l = ULIB_AVL_TREE(setop)(op, al, hal, bl, hbl, rest, &hl, spawn);
+        r = ULIB_AVL_TREE(setop)(op, ar, har, br, hbr, rest, &hr, spawn);
+    }
+
+    if (x)
+        ULIB_AVL_TREE(list_add)(rest, x);
+
+    /* The union keeps the root of A, the intersection keeps it if it
+       is in B, the difference if it is not.  */
+    if (op == ULIB_AVL_TREE_UNION || (op == ULIB_AVL_TREE_INTERSECTION) == (x != 0))
+        return ULIB_AVL_TREE(join_h)(l, hl, a, r, hr, h);
+
+    ULIB_AVL_TREE(list_add)(rest, a);
+    return ULIB_AVL_TREE(join2)(l, hl, r, hr, h);
+}
+
+/* Apply the set operation OP to the trees A and B, storing the list
+   of the nodes, left over, at *REST.  */
+static ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(setop_list)(int op,
+                          ULIB_AVL_TREE_TYPE *a,
+                          ULIB_AVL_TREE_TYPE *b,
+                          ULIB_AVL_TREE_TYPE **rest) {
+    struct ULIB_AVL_TREE(list) l;
+    unsigned int spawn = 0;
     int h;
 
-    r = *pr;
-    if (r == 0)
-        return -1;
+#ifdef ULIB_AVL_TREE_PARALLEL
+    spawn = ULIB_AVL_TREE(spawn_levels)();
+#endif
+    l.head = 0;
+    l.tail = &l.head;
+    a = ULIB_AVL_TREE(setop)(
+        op, a, ULIB_AVL_TREE(height)(a), b, ULIB_AVL_TREE(height)(b), &l, &h, spawn);
+    *rest = l.head;
+    return a;
+}
+
+ULIB_STATIC ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(union)(ULIB_AVL_TREE_TYPE *a,
+                     ULIB_AVL_TREE_TYPE *b,
+                     ULIB_AVL_TREE_TYPE **rest) {
+    return ULIB_AVL_TREE(setop_list)(ULIB_AVL_TREE_UNION, a, b, rest);
+}
+
+ULIB_STATIC ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(intersection)(ULIB_AVL_TREE_TYPE *a,
+                            ULIB_AVL_TREE_TYPE *b,
+                            ULIB_AVL_TREE_TYPE **rest) {
+    return ULIB_AVL_TREE(setop_list)(ULIB_AVL_TREE_INTERSECTION, a, b, rest);
+}
+
+ULIB_STATIC ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(difference)(ULIB_AVL_TREE_TYPE *a,
+                          ULIB_AVL_TREE_TYPE *b,
+                          ULIB_AVL_TREE_TYPE **rest) {
+    return ULIB_AVL_TREE(setop_list)(ULIB_AVL_TREE_DIFFERENCE, a, b, rest);
+}
+
+#undef ULIB_AVL_TREE_UNION
+#undef ULIB_AVL_TREE_INTERSECTION
+#undef ULIB_AVL_TREE_DIFFERENCE
+
+#if defined(ULIB_AVL_TREE_CONCURRENT) || defined(ULIB_AVL_TREE_PERSISTENT)
 
-    if (ULIB_AVL_TREE_COMPARE(r->key, key) > 0) {
-        if ((h = ULIB_AVL_TREE(del)(&r->left, key, dn)) > 0)
-            return ULIB_AVL_TREE(balance_right)(pr);
+/* Start a copy-on-write update C, allocating the copies from CACHE.  */
+static inline void
+ULIB_AVL_TREE(cow_init)(struct ULIB_AVL_TREE(cow) *c, ulib_cache *cache) {
+    c->cache = cache;
+    c->n = 0;
+    c->failed = 0;
+}
+
+/* Abandon the copy-on-write update C, releasing the copies.  */
+static void
+ULIB_AVL_TREE(cow_abort)(struct ULIB_AVL_TREE(cow) *c) {
+    while (c->n > 0)
+        ulib_cache_free(c->cache, c->copy[--c->n]);
+}
+
+/* Insert the node KEY into the tree at PR in the update C.  Copy the
+   search path first - the insertion modifies only the nodes on it -
+   then insert into the copy in place.  */
+static int
+ULIB_AVL_TREE(cow_insert_path)(struct ULIB_AVL_TREE(cow) *c,
+                               ULIB_AVL_TREE_TYPE **pr,
+                               ULIB_AVL_TREE_TYPE *key) {
+    ULIB_AVL_TREE_TYPE **p, *r;
+    int cmp;
+
+    for (p = pr; *p;) {
+        if (!ULIB_AVL_TREE(cow_touch)(c, p))
+            return -1;
+
+        r = *p;
+        if ((cmp = ULIB_AVL_TREE_COMPARE(key->key, r->key)) < 0)
+            p = &r->left;
+        else if (cmp > 0)
+            p = &r->right;
         else
-            return h;
+            return -1;
     }
 
-    if (ULIB_AVL_TREE_COMPARE(r->key, key) < 0) {
-        if ((h = ULIB_AVL_TREE(del)(&r->right, key, dn)) > 0)
-            return ULIB_AVL_TREE(balance_left)(pr);
+    ULIB_AVL_TREE(insert)(pr, key);
+    return 0;
+}
+
+/* Remove the key KEY from the tree at PR in the update C and release
+   its node.  Copy the search path and, for a node with two children,
+   the path to its replacement, then delete from the copy in place,
+   copying the siblings, which the rotations modify, on demand.  */
+static int
+ULIB_AVL_TREE(cow_delete_path)(struct ULIB_AVL_TREE(cow) *c,
+                               ULIB_AVL_TREE_TYPE **pr,
+                               ULIB_AVL_TREE_KEY_TYPE key) {
+    ULIB_AVL_TREE_TYPE **p, *r, *dn;
+    int cmp;
+
+    for (p = pr;;) {
+        if (*p == 0 || !ULIB_AVL_TREE(cow_touch)(c, p))
+            return -1;
+
+        r = *p;
+        if ((cmp = ULIB_AVL_TREE_COMPARE(key, r->key)) < 0)
+            p = &r->left;
+        else if (cmp > 0)
+            p = &r->right;
         else
-            return h;
+            break;
     }
 
-    *dn = r;
     if (r->left && r->right) {
-        h = ULIB_AVL_TREE(delete_max)(&r->left, &t);
-        t->left = r->left;
-        t->right = r->right;
-        t->balance = r->balance;
+        for (p = &r->left;; p = &(*p)->right) {
+            if (!ULIB_AVL_TREE(cow_touch)(c, p))
+                return -1;
+            if ((*p)->right == 0)
+                break;
+        }
+    }
 
-        *pr = t;
-        if (h)
-            return ULIB_AVL_TREE(balance_right)(pr);
-        else
-            return 0;
+    ULIB_AVL_TREE(del)(pr, key, &dn, c);
+    if (c->failed)
+        return -1;
+
+    /* The removed node is a copy, its original is left to the
+       commit.  */
+    ulib_cache_free(c->cache, dn);
+    return 0;
+}
+
+#endif
+
+#ifdef ULIB_AVL_TREE_CONCURRENT
+
+/* Commit the copy-on-write update C, publishing the ROOT at PR, and
+   retire the replaced nodes into the epoch domain D.  */
+static void
+ULIB_AVL_TREE(cow_commit)(struct ULIB_AVL_TREE(cow) *c,
+                          ULIB_AVL_TREE_TYPE *_Atomic *pr,
+                          ULIB_AVL_TREE_TYPE *root,
+                          ulib_epoch_domain *d) {
+    unsigned int i;
+
+    atomic_store_explicit(pr, root, memory_order_release);
+    for (i = 0; i < c->n; i++)
+        ulib_epoch_retire(d, c->old[i]);
+}
+
+ULIB_STATIC int
+ULIB_AVL_TREE(cow_insert)(ULIB_AVL_TREE_TYPE *_Atomic *pr,
+                          ULIB_AVL_TREE_TYPE *key,
+                          ulib_epoch_domain *d) {
+    struct ULIB_AVL_TREE(cow) c;
+    ULIB_AVL_TREE_TYPE *root = atomic_load_explicit(pr, memory_order_relaxed);
+
+    ULIB_AVL_TREE(cow_init)(&c, d->cache);
+    if (ULIB_AVL_TREE(cow_insert_path)(&c, &root, key) != 0) {
+        ULIB_AVL_TREE(cow_abort)(&c);
+        return -1;
     }
+    ULIB_AVL_TREE(cow_commit)(&c, pr, root, d);
+    return 0;
+}
 
-    *pr = (r->left == 0) ? r->right : r->left;
-    return 1;
+ULIB_STATIC int
+ULIB_AVL_TREE(cow_delete)(ULIB_AVL_TREE_TYPE *_Atomic *pr,
+                          ULIB_AVL_TREE_KEY_TYPE key,
+                          ulib_epoch_domain *d) {
+    struct ULIB_AVL_TREE(cow) c;
+    ULIB_AVL_TREE_TYPE *root = atomic_load_explicit(pr, memory_order_relaxed);
+
+    ULIB_AVL_TREE(cow_init)(&c, d->cache);
+    if (ULIB_AVL_TREE(cow_delete_path)(&c, &root, key) != 0) {
+        ULIB_AVL_TREE(cow_abort)(&c);
+        return -1;
+    }
+    ULIB_AVL_TREE(cow_commit)(&c, pr, root, d);
+    return 0;
+}
+
+#endif /* ULIB_AVL_TREE_CONCURRENT */
+
+#ifdef ULIB_AVL_TREE_PERSISTENT
+
+ULIB_STATIC void
+ULIB_AVL_TREE(release)(ULIB_AVL_TREE_TYPE *r, ulib_cache *cache) {
+    ULIB_AVL_TREE_TYPE *t;
+
+    while (r && --r->refs == 0) {
+        ULIB_AVL_TREE(release)(r->left, cache);
+        t = r->right;
+        ulib_cache_free(cache, r);
+        r = t;
+    }
+}
+
+/* Commit the copy-on-write update C of a persistent tree.  A copy
+   holds references to the children of its original, while the link,
+   which pointed to the original - from the copy of its parent or from
+   the variable with the root - was moved to the copy.  The rotations
+   only move links between the nodes, so the counts stay right.  The
+   parents are copied before their children, so an original is
+   released only after the references to it from the copies of its
+   parent are counted.  An original, losing its last reference, is
+   released and its references to the children pass on to the copy.  */
+static void
+ULIB_AVL_TREE(persistent_commit)(struct ULIB_AVL_TREE(cow) *c) {
+    ULIB_AVL_TREE_TYPE *t;
+    unsigned int i;
+
+    for (i = 0; i < c->n; i++) {
+        t = c->old[i];
+        if (--t->refs == 0)
+            ulib_cache_free(c->cache, t);
+        else {
+            if (t->left)
+                t->left->refs++;
+            if (t->right)
+                t->right->refs++;
+        }
+    }
+}
+
+ULIB_STATIC int
+ULIB_AVL_TREE(persistent_insert)(ULIB_AVL_TREE_TYPE **pr,
+                                 ULIB_AVL_TREE_TYPE *key,
+                                 ulib_cache *cache) {
+    struct ULIB_AVL_TREE(cow) c;
+    ULIB_AVL_TREE_TYPE *root = *pr;
+
+    ULIB_AVL_TREE(cow_init)(&c, cache);
+    key->refs = 1;
+    if (ULIB_AVL_TREE(cow_insert_path)(&c, &root, key) != 0) {
+        ULIB_AVL_TREE(cow_abort)(&c);
+        return -1;
+    }
+    ULIB_AVL_TREE(persistent_commit)(&c);
+    *pr = root;
+    return 0;
 }
 
+ULIB_STATIC int
+ULIB_AVL_TREE(persistent_delete)(ULIB_AVL_TREE_TYPE **pr,
+                                 ULIB_AVL_TREE_KEY_TYPE key,
+                                 ulib_cache *cache) {
+    struct ULIB_AVL_TREE(cow) c;
+    ULIB_AVL_TREE_TYPE *root = *pr;
+
+    ULIB_AVL_TREE(cow_init)(&c, cache);
+    if (ULIB_AVL_TREE(cow_delete_path)(&c, &root, key) != 0) {
+        ULIB_AVL_TREE(cow_abort)(&c);
+        return -1;
+    }
+    ULIB_AVL_TREE(persistent_commit)(&c);
+    *pr = root;
+    return 0;
+}
+
+#endif /* ULIB_AVL_TREE_PERSISTENT */
+
 /* Lookup a key in the tree.  */
 #ifdef ULIB_AVL_TREE_DATA_TYPE
 ULIB_STATIC ULIB_AVL_TREE_DATA_TYPE *
@@ -287,14 +928,16 @@ ULIB_STATIC ULIB_AVL_TREE_DATA_TYPE *
 ULIB_STATIC int
 #endif
 ULIB_AVL_TREE(lookup)(const ULIB_AVL_TREE_TYPE *r, ULIB_AVL_TREE_KEY_TYPE key) {
+    int c;
+
     while (r) {
-        if (ULIB_AVL_TREE_COMPARE(key, r->key) < 0)
+        if ((c = ULIB_AVL_TREE_COMPARE(key, r->key)) < 0)
             r = r->left;
-        else if (ULIB_AVL_TREE_COMPARE(key, r->key) > 0)
+        else if (c > 0)
             r = r->right;
         else {
 #ifdef ULIB_AVL_TREE_DATA_TYPE
-            return &r->data;
+            return (ULIB_AVL_TREE_DATA_TYPE *)&r->data;
 #else
             return 1;
 #endif
@@ -304,6 +947,59 @@ ULIB_AVL_TREE(lookup)(const ULIB_AVL_TREE_TYPE *r, ULIB_AVL_TREE_KEY_TYPE key) {
     return 0;
 }
 
+/* Each slot of the batch holds the current node of a search and the
+   number of its key.  A finished search stores its result and its
+   slot takes the next key, or the last search in flight.  */
+ULIB_STATIC void
+ULIB_AVL_TREE(lookup_batch)(const ULIB_AVL_TREE_TYPE *r,
+                            unsigned int n,
+                            const ULIB_AVL_TREE_KEY_TYPE *keys,
+#ifdef ULIB_AVL_TREE_DATA_TYPE
+                            ULIB_AVL_TREE_DATA_TYPE **results) {
+#else
+                            int *results) {
+#endif
+    const ULIB_AVL_TREE_TYPE *node[ULIB_AVL_TREE_BATCH], *t;
+    unsigned int key[ULIB_AVL_TREE_BATCH], i, m = 0, next = 0;
+    int c;
+
+    if (r == 0) {
+        for (i = 0; i < n; i++)
+            results[i] = 0;
+        return;
+    }
+
+    while (m < ULIB_AVL_TREE_BATCH && next < n) {
+        node[m] = r;
+        key[m++] = next++;
+    }
+
+    while (m > 0) {
+        for (i = 0; i < m;) {
+            t = node[i];
+            if (t && (c = ULIB_AVL_TREE_COMPARE(keys[key[i]], t->key)) != 0) {
+                node[i] = c < 0 ? t->left : t->right;
+                ulib_prefetch(node[i], 0);
+                i++;
+                continue;
+            }
+
+#ifdef ULIB_AVL_TREE_DATA_TYPE
+            results[key[i]] = t ? (ULIB_AVL_TREE_DATA_TYPE *)&t->data : 0;
+#else
+            results[key[i]] = t != 0;
+#endif
+            if (next < n) {
+                node[i] = r;
+                key[i++] = next++;
+            } else {
+                node[i] = node[--m];
+                key[i] = key[m];
+            }
+        }
+    }
+}
+
 /*
  * Local variables:
  * mode: C
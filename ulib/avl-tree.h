@@ -1,4 +1,16 @@
 #include "defs.h"
+#include "cache.h"
+#include <string.h>
+
+#ifdef ULIB_AVL_TREE_PARALLEL
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef ULIB_AVL_TREE_CONCURRENT
+#include "epoch.h"
+#include <stdatomic.h>
+#endif
 
 BEGIN_DECLS
 
@@ -18,6 +30,17 @@ BEGIN_DECLS
 #define ULIB_STATIC extern
 #endif
 
+/* Maximum height of a tree.  An AVL tree of height 92 would have more
+   than 2^64 nodes.  */
+#ifndef ULIB_AVL_TREE_MAX_HEIGHT
+#define ULIB_AVL_TREE_MAX_HEIGHT 96
+#endif
+
+/* Number of searches ``lookup_batch'' keeps in flight.  */
+#ifndef ULIB_AVL_TREE_BATCH
+#define ULIB_AVL_TREE_BATCH 16
+#endif
+
 #define ULIB___AVL_TREE(a, b) a##_##b
 #define ULIB__AVL_TREE(a, b) ULIB___AVL_TREE(a, b)
 #define ULIB_AVL_TREE(x) ULIB__AVL_TREE(ULIB_AVL_TREE_TYPE, x)
@@ -27,19 +50,121 @@ struct ULIB_AVL_TREE_TYPE {
     struct ULIB_AVL_TREE_TYPE *right;
     ULIB_AVL_TREE_KEY_TYPE key;
     int balance;
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+    unsigned int size;
+#endif
+#ifdef ULIB_AVL_TREE_PERSISTENT
+    unsigned int refs;
+#endif
 #ifdef ULIB_AVL_TREE_DATA_TYPE
     ULIB_AVL_TREE_DATA_TYPE data;
 #endif
 };
 typedef struct ULIB_AVL_TREE_TYPE ULIB_AVL_TREE_TYPE;
 
+/* With ULIB_AVL_TREE_AUGMENT_SIZE defined, each node records the
+   number of nodes in its subtree, maintained by the insertion, the
+   deletion and the rotations, and ``rank'' and ``select'' answer order
+   statistic queries in logarithmic time.  */
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+
+/* Return the number of nodes in the tree R.  */
+static inline unsigned int
+ULIB_AVL_TREE(size)(const ULIB_AVL_TREE_TYPE *r) {
+    return r ? r->size : 0;
+}
+
+/* Recompute the size of the node R from its children.  */
+static inline void
+ULIB_AVL_TREE(update)(ULIB_AVL_TREE_TYPE *r) {
+    r->size = ULIB_AVL_TREE(size)(r->left) + ULIB_AVL_TREE(size)(r->right) + 1;
+}
+
+/* Return the number of keys in the tree R, less than K.  */
+static inline unsigned int
+ULIB_AVL_TREE(rank)(const ULIB_AVL_TREE_TYPE *r, ULIB_AVL_TREE_KEY_TYPE k) {
+    unsigned int n = 0;
+
+    while (r) {
+        if (ULIB_AVL_TREE_COMPARE(r->key, k) < 0) {
+            n += ULIB_AVL_TREE(size)(r->left) + 1;
+            r = r->right;
+        } else
+            r = r->left;
+    }
+    return n;
+}
+
+/* Return the node with the K-th smallest key in the tree R, counting
+   from zero, or null if the tree has no more than K nodes.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(select)(ULIB_AVL_TREE_TYPE *r, unsigned int k) {
+    unsigned int n;
+
+    while (r) {
+        n = ULIB_AVL_TREE(size)(r->left);
+        if (k < n)
+            r = r->left;
+        else if (k > n) {
+            k -= n + 1;
+            r = r->right;
+        } else
+            break;
+    }
+    return r;
+}
+
+#endif /* ULIB_AVL_TREE_AUGMENT_SIZE */
+
+/* Update the augmented data, if any, of the node T, which a rotation
+   made the root of a subtree, and of its children.  */
+static inline void
+ULIB_AVL_TREE(rotated)(ULIB_AVL_TREE_TYPE *t) {
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+    if (t->left)
+        ULIB_AVL_TREE(update)(t->left);
+    if (t->right)
+        ULIB_AVL_TREE(update)(t->right);
+    ULIB_AVL_TREE(update)(t);
+#else
+    (void)t;
+#endif
+}
+
+/* Update the augmented data, if any, of the node T after its
+   children changed.  */
+static inline void
+ULIB_AVL_TREE(changed)(ULIB_AVL_TREE_TYPE *t) {
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+    ULIB_AVL_TREE(update)(t);
+#else
+    (void)t;
+#endif
+}
+
+/* Return the height of the tree R, following the taller subtree of
+   each node.  */
+static inline int
+ULIB_AVL_TREE(height)(const ULIB_AVL_TREE_TYPE *r) {
+    int h;
+
+    for (h = 0; r; h++)
+        r = r->balance < 0 ? r->left : r->right;
+    return h;
+}
+
 /* Insert a node into the tree pointed to by PR. Returns negative if
-   the key is already present.  */
+   the key is already present.  The insertion and the deletion compare
+   the key once per level, storing the result of ULIB_AVL_TREE_COMPARE
+   in an int.  */
 ULIB_STATIC int ULIB_AVL_TREE(insert)(ULIB_AVL_TREE_TYPE **pr, ULIB_AVL_TREE_TYPE *key);
 
+struct ULIB_AVL_TREE(cow);
+
 static int ULIB_AVL_TREE(del)(ULIB_AVL_TREE_TYPE **pr,
                               ULIB_AVL_TREE_KEY_TYPE key,
-                              ULIB_AVL_TREE_TYPE **dn);
+                              ULIB_AVL_TREE_TYPE **dn,
+                              struct ULIB_AVL_TREE(cow) *cow);
 
 /* Remove a key from an AVL tree. Return the removed node or null if
    the key is not found.  */
@@ -47,9 +172,134 @@ static inline ULIB_AVL_TREE_TYPE *
 ULIB_AVL_TREE(delete)(ULIB_AVL_TREE_TYPE **pr, ULIB_AVL_TREE_KEY_TYPE key) {
     ULIB_AVL_TREE_TYPE *dn;
 
-    return ULIB_AVL_TREE(del)(pr, key, &dn) < 0 ? 0 : dn;
+    return ULIB_AVL_TREE(del)(pr, key, &dn, 0) < 0 ? 0 : dn;
+}
+
+/* Join the tree L, the node K and the tree R into one tree and
+   return its root.  The keys in L must be less than the key of K and
+   the keys in R greater than it.  Takes time proportional to the
+   difference of the heights of L and R.  */
+ULIB_STATIC ULIB_AVL_TREE_TYPE *ULIB_AVL_TREE(join)(ULIB_AVL_TREE_TYPE *l,
+                                                    ULIB_AVL_TREE_TYPE *k,
+                                                    ULIB_AVL_TREE_TYPE *r);
+
+/* Split the tree R into the tree *L of the keys less than KEY and the
+   tree *G of the keys greater than KEY.  Return the node with the key
+   KEY, removed from the tree, or null if there is none.  */
+ULIB_STATIC ULIB_AVL_TREE_TYPE *ULIB_AVL_TREE(split)(ULIB_AVL_TREE_TYPE *r,
+                                                     ULIB_AVL_TREE_KEY_TYPE key,
+                                                     ULIB_AVL_TREE_TYPE **l,
+                                                     ULIB_AVL_TREE_TYPE **g);
+
+/* Set operations on the trees A and B, which consume both trees and
+   return the root of the resulting tree.  The union takes the nodes
+   of A and the nodes of B with keys, not in A, the intersection takes
+   the nodes of A with keys in B, the difference takes the nodes of A
+   with keys not in B.  All the other nodes are linked through their
+   right pointers into a list at *REST, so they may be released.  For
+   trees of M and N nodes, M < N, each takes O(M log(N / M + 1)) time.
+
+   With ULIB_AVL_TREE_PARALLEL defined to a height, the two halves of
+   the problem are processed in parallel, in a new thread and the
+   calling one, as long as both trees are at least that high.  Only the
+   top levels of the recursion start threads, about as many as there
+   are processors.  Such code needs to be linked with the pthread
+   library.  */
+ULIB_STATIC ULIB_AVL_TREE_TYPE *ULIB_AVL_TREE(union)(ULIB_AVL_TREE_TYPE *a,
+                                                     ULIB_AVL_TREE_TYPE *b,
+                                                     ULIB_AVL_TREE_TYPE **rest);
+ULIB_STATIC ULIB_AVL_TREE_TYPE *ULIB_AVL_TREE(intersection)(ULIB_AVL_TREE_TYPE *a,
+                                                            ULIB_AVL_TREE_TYPE *b,
+                                                            ULIB_AVL_TREE_TYPE **rest);
+ULIB_STATIC ULIB_AVL_TREE_TYPE *ULIB_AVL_TREE(difference)(ULIB_AVL_TREE_TYPE *a,
+                                                          ULIB_AVL_TREE_TYPE *b,
+                                                          ULIB_AVL_TREE_TYPE **rest);
+
+#ifdef ULIB_AVL_TREE_CONCURRENT
+
+/* Trees with concurrent readers.  With ULIB_AVL_TREE_CONCURRENT
+   defined, a tree, whose root is kept in an atomic pointer, may be
+   read by any number of threads without locks, while a writer updates
+   it.  The updates copy the nodes, which they would modify, and
+   publish the modified copy of the path with an atomic store of the
+   root, so a reader sees either the old or the new tree.  The replaced
+   nodes are retired into an epoch domain of the tree, initialized for
+   the cache of its nodes.  A reader loads the root with ``cow_root''
+   and uses the usual read-only functions inside a critical section of
+   ``ulib_epoch_enter'' and ``ulib_epoch_exit'', and must not keep
+   pointers to the nodes after leaving it.  The
+   writers must be serialized by the caller, e.g. with a mutex, which
+   also protects the cache of the nodes and the epoch domain.  */
+
+/* Load the root of the tree at PR for reading.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(cow_root)(ULIB_AVL_TREE_TYPE *_Atomic *pr) {
+    return atomic_load_explicit(pr, memory_order_acquire);
+}
+
+/* Insert the node KEY, allocated from the cache of the epoch domain
+   D, into the tree at PR, copying the nodes on the path from the root.
+   Returns negative if the key is already present.  Throws
+   NO_MEMORY.  */
+ULIB_STATIC int ULIB_AVL_TREE(cow_insert)(ULIB_AVL_TREE_TYPE *_Atomic *pr,
+                                          ULIB_AVL_TREE_TYPE *key,
+                                          ulib_epoch_domain *d);
+
+/* Remove the key KEY from the tree at PR, whose nodes are allocated
+   from the cache of the epoch domain D, and retire its node into D.
+   Returns negative if the key is not found.  Throws NO_MEMORY.  */
+ULIB_STATIC int ULIB_AVL_TREE(cow_delete)(ULIB_AVL_TREE_TYPE *_Atomic *pr,
+                                          ULIB_AVL_TREE_KEY_TYPE key,
+                                          ulib_epoch_domain *d);
+
+#endif /* ULIB_AVL_TREE_CONCURRENT */
+
+#ifdef ULIB_AVL_TREE_PERSISTENT
+
+/* Persistent trees.  With ULIB_AVL_TREE_PERSISTENT defined, trees may
+   be updated with ``persistent_insert'' and ``persistent_delete'',
+   which never modify a node, but copy the nodes on the path from the
+   root and make a new version of the tree, sharing the unchanged
+   subtrees with the old one.  Each node counts the references to it
+   from its parents and from the variables, holding the root of a
+   version.  A snapshot of a version is an additional reference to its
+   root, taken in constant time with ``snapshot'' and dropped with
+   ``release'', which frees the nodes no other version shares.  The
+   versions may be read with the read-only functions concurrently, but
+   the updates, the snapshots and the releases must be serialized by
+   the caller.  The functions, which relink nodes in place, like
+   ``insert'', ``delete'' or ``join'', must not be used on persistent
+   trees, and neither must ULIB_AVL_TREE_CONCURRENT be defined.  */
+
+/* Take a reference to the version R of a tree and return it.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(snapshot)(ULIB_AVL_TREE_TYPE *r) {
+    if (r)
+        r->refs++;
+    return r;
 }
 
+/* Drop a reference to the version R of a tree, whose nodes are
+   allocated from CACHE.  */
+ULIB_STATIC void ULIB_AVL_TREE(release)(ULIB_AVL_TREE_TYPE *r, ulib_cache *cache);
+
+/* Replace the version of the tree at PR, whose reference is dropped,
+   by a version with the node KEY, allocated from CACHE, inserted.
+   Returns negative if the key is already present.  Throws
+   NO_MEMORY.  */
+ULIB_STATIC int ULIB_AVL_TREE(persistent_insert)(ULIB_AVL_TREE_TYPE **pr,
+                                                 ULIB_AVL_TREE_TYPE *key,
+                                                 ulib_cache *cache);
+
+/* Replace the version of the tree at PR, whose reference is dropped,
+   by a version with the key KEY removed.  Returns negative if the key
+   is not found.  Throws NO_MEMORY.  */
+ULIB_STATIC int ULIB_AVL_TREE(persistent_delete)(ULIB_AVL_TREE_TYPE **pr,
+                                                 ULIB_AVL_TREE_KEY_TYPE key,
+                                                 ulib_cache *cache);
+
+#endif /* ULIB_AVL_TREE_PERSISTENT */
+
 /* Lookup a key in the tree.  */
 #ifdef ULIB_AVL_TREE_DATA_TYPE
 ULIB_STATIC ULIB_AVL_TREE_DATA_TYPE *
@@ -58,6 +308,206 @@ ULIB_STATIC int
 #endif
     ULIB_AVL_TREE(lookup)(const ULIB_AVL_TREE_TYPE *r, ULIB_AVL_TREE_KEY_TYPE key);
 
+/* Lookup the N keys at KEYS in the tree, storing the results at
+   RESULTS.  The searches are interleaved and the next node of each is
+   prefetched, so that the cache misses of the searches overlap.  */
+#ifdef ULIB_AVL_TREE_DATA_TYPE
+ULIB_STATIC void ULIB_AVL_TREE(lookup_batch)(const ULIB_AVL_TREE_TYPE *r,
+                                             unsigned int n,
+                                             const ULIB_AVL_TREE_KEY_TYPE *keys,
+                                             ULIB_AVL_TREE_DATA_TYPE **results);
+#else
+ULIB_STATIC void ULIB_AVL_TREE(lookup_batch)(const ULIB_AVL_TREE_TYPE *r,
+                                             unsigned int n,
+                                             const ULIB_AVL_TREE_KEY_TYPE *keys,
+                                             int *results);
+#endif
+
+/* Build a perfectly balanced tree of the N nodes at NODES.  Set *H to
+   the height of the tree and return its root.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(build)(ULIB_AVL_TREE_TYPE **nodes, unsigned int n, int *h) {
+    ULIB_AVL_TREE_TYPE *r;
+    int hl, hr;
+
+    if (n == 0) {
+        *h = 0;
+        return 0;
+    }
+
+    r = nodes[n / 2];
+    r->left = ULIB_AVL_TREE(build)(nodes, n / 2, &hl);
+    r->right = ULIB_AVL_TREE(build)(nodes + n / 2 + 1, n - n / 2 - 1, &hr);
+    r->balance = hr - hl;
+#ifdef ULIB_AVL_TREE_AUGMENT_SIZE
+    r->size = n;
+#endif
+
+    *h = (hl > hr ? hl : hr) + 1;
+    return r;
+}
+
+/* Build a tree of the N nodes at NODES, which must be sorted by key
+   in ascending order, without duplicates, in linear time.  Return the
+   root of the tree.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(build_sorted)(ULIB_AVL_TREE_TYPE **nodes, unsigned int n) {
+    int h;
+
+    return ULIB_AVL_TREE(build)(nodes, n, &h);
+}
+
+/* Size of the node stack of ``range''.  A deeper tree is still walked
+   correctly, only slower.  */
+#ifndef ULIB_AVL_TREE_STACK_SIZE
+#define ULIB_AVL_TREE_STACK_SIZE 64
+#endif
+
+/* Return the node with the smallest key or null if the tree is
+   empty.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(first)(ULIB_AVL_TREE_TYPE *r) {
+    if (r)
+        while (r->left)
+            r = r->left;
+    return r;
+}
+
+/* Return the node with the largest key or null if the tree is
+   empty.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(last)(ULIB_AVL_TREE_TYPE *r) {
+    if (r)
+        while (r->right)
+            r = r->right;
+    return r;
+}
+
+/* Return the node with the smallest key, not less than K, or null if
+   there is no such node.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(lower_bound)(ULIB_AVL_TREE_TYPE *r, ULIB_AVL_TREE_KEY_TYPE k) {
+    ULIB_AVL_TREE_TYPE *n = 0;
+
+    while (r) {
+        if (ULIB_AVL_TREE_COMPARE(r->key, k) < 0)
+            r = r->right;
+        else {
+            n = r;
+            r = r->left;
+        }
+    }
+    return n;
+}
+
+/* Return the node with the smallest key, greater than K, or null if
+   there is no such node.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(upper_bound)(ULIB_AVL_TREE_TYPE *r, ULIB_AVL_TREE_KEY_TYPE k) {
+    ULIB_AVL_TREE_TYPE *n = 0;
+
+    while (r) {
+        if (ULIB_AVL_TREE_COMPARE(r->key, k) <= 0)
+            r = r->right;
+        else {
+            n = r;
+            r = r->left;
+        }
+    }
+    return n;
+}
+
+/* Return the node, following the node N in the tree R, or null if N
+   is the last one.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(next)(ULIB_AVL_TREE_TYPE *r, const ULIB_AVL_TREE_TYPE *n) {
+    return ULIB_AVL_TREE(upper_bound)(r, n->key);
+}
+
+/* Return the node, preceding the node N in the tree R, or null if N
+   is the first one.  */
+static inline ULIB_AVL_TREE_TYPE *
+ULIB_AVL_TREE(prev)(ULIB_AVL_TREE_TYPE *r, const ULIB_AVL_TREE_TYPE *n) {
+    ULIB_AVL_TREE_TYPE *p = 0;
+
+    while (r) {
+        if (ULIB_AVL_TREE_COMPARE(r->key, n->key) < 0) {
+            p = r;
+            r = r->right;
+        } else
+            r = r->left;
+    }
+    return p;
+}
+
+/* Push the node N on the stack of ``range''.  When the stack is full,
+   drop its bottom half, i.e. the nodes with the largest keys, and
+   return non-zero, so they are found again later.  */
+static inline int
+ULIB_AVL_TREE(range_push)(ULIB_AVL_TREE_TYPE **stk,
+                          unsigned int *n,
+                          ULIB_AVL_TREE_TYPE *t) {
+    unsigned int i;
+    int overflow = 0;
+
+    if (*n == ULIB_AVL_TREE_STACK_SIZE) {
+        for (i = 0; i < ULIB_AVL_TREE_STACK_SIZE / 2; i++)
+            stk[i] = stk[i + ULIB_AVL_TREE_STACK_SIZE / 2];
+        *n -= ULIB_AVL_TREE_STACK_SIZE / 2;
+        overflow = 1;
+    }
+    stk[(*n)++] = t;
+    return overflow;
+}
+
+/* Invoke FN with each node with a key in the range [LO, HI] in
+   ascending key order and ARG.  Stop if FN returns non-zero and return
+   that value, return zero after the last node in the range.  FN must
+   not modify the tree.  */
+static inline int
+ULIB_AVL_TREE(range)(ULIB_AVL_TREE_TYPE *r,
+                     ULIB_AVL_TREE_KEY_TYPE lo,
+                     ULIB_AVL_TREE_KEY_TYPE hi,
+                     int (*fn)(ULIB_AVL_TREE_TYPE *, void *),
+                     void *arg) {
+    ULIB_AVL_TREE_TYPE *stk[ULIB_AVL_TREE_STACK_SIZE], *t;
+    unsigned int n;
+    int ret, strict = 0, overflow;
+
+    do {
+        /* Find the path to the first node in the range - with a key,
+         not less than LO, or, when resuming after dropping nodes from
+         the stack, greater than the key of the last visited node.  */
+        n = 0;
+        overflow = 0;
+        for (t = r; t;) {
+            if (ULIB_AVL_TREE_COMPARE(t->key, lo) < 0
+                || (strict && ULIB_AVL_TREE_COMPARE(t->key, lo) == 0))
+                t = t->right;
+            else {
+                overflow |= ULIB_AVL_TREE(range_push)(stk, &n, t);
+                t = t->left;
+            }
+        }
+
+        while (n > 0) {
+            t = stk[--n];
+            if (ULIB_AVL_TREE_COMPARE(t->key, hi) > 0)
+                return 0;
+
+            if ((ret = fn(t, arg)) != 0)
+                return ret;
+
+            lo = t->key;
+            strict = 1;
+            for (t = t->right; t; t = t->left)
+                overflow |= ULIB_AVL_TREE(range_push)(stk, &n, t);
+        }
+    } while (overflow);
+
+    return 0;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -0,0 +1,432 @@
+/* Minimum number of keys in a leaf and in an inner node, other than
+   the root.  */
+#define ULIB_BTREE_LEAF_MIN (ULIB_BTREE_LEAF_KEYS / 2)
+#define ULIB_BTREE_INNER_MIN (ULIB_BTREE_INNER_KEYS / 2)
+
+/* Open a gap at position I of the leaf L.  */
+static inline void
+ULIB_BTREE(leaf_open)(struct ULIB_BTREE(leaf) *l, unsigned int i) {
+    memmove(l->key + i + 1, l->key + i, (l->n - i) * sizeof(l->key[0]));
+#ifdef ULIB_BTREE_DATA_TYPE
+    memmove(l->data + i + 1, l->data + i, (l->n - i) * sizeof(l->data[0]));
+#endif
+    l->n++;
+}
+
+/* Remove the key at position I of the leaf L.  */
+static inline void
+ULIB_BTREE(leaf_close)(struct ULIB_BTREE(leaf) *l, unsigned int i) {
+    l->n--;
+    memmove(l->key + i, l->key + i + 1, (l->n - i) * sizeof(l->key[0]));
+#ifdef ULIB_BTREE_DATA_TYPE
+    memmove(l->data + i, l->data + i + 1, (l->n - i) * sizeof(l->data[0]));
+#endif
+}
+
+/* Move the N keys from position I of the leaf L to the end of the
+   leaf M.  */
+static inline void
+ULIB_BTREE(leaf_move)(struct ULIB_BTREE(leaf) *m,
+                      struct ULIB_BTREE(leaf) *l,
+                      unsigned int i,
+                      unsigned int n) {
+    memcpy(m->key + m->n, l->key + i, n * sizeof(l->key[0]));
+#ifdef ULIB_BTREE_DATA_TYPE
+    memcpy(m->data + m->n, l->data + i, n * sizeof(l->data[0]));
+#endif
+    m->n += n;
+}
+
+/* Insert the key K and the child C, following it, at position I of
+   the inner node P.  */
+static inline void
+ULIB_BTREE(inner_open)(struct ULIB_BTREE(inner) *p,
+                       unsigned int i,
+                       ULIB_BTREE_KEY_TYPE k,
+                       void *c) {
+    memmove(p->key + i + 1, p->key + i, (p->n - i) * sizeof(p->key[0]));
+    memmove(p->child + i + 2, p->child + i + 1, (p->n - i) * sizeof(p->child[0]));
+    p->key[i] = k;
+    p->child[i + 1] = c;
+    p->n++;
+}
+
+/* Remove the key at position I of the inner node P and the child,
+   following it.  */
+static inline void
+ULIB_BTREE(inner_close)(struct ULIB_BTREE(inner) *p, unsigned int i) {
+    p->n--;
+    memmove(p->key + i, p->key + i + 1, (p->n - i) * sizeof(p->key[0]));
+    memmove(p->child + i + 1, p->child + i + 2, (p->n - i) * sizeof(p->child[0]));
+}
+
+/* Append the key K and the keys and the children of the inner node Q
+   to the inner node P.  */
+static inline void
+ULIB_BTREE(inner_merge)(struct ULIB_BTREE(inner) *p,
+                        ULIB_BTREE_KEY_TYPE k,
+                        struct ULIB_BTREE(inner) *q) {
+    p->key[p->n] = k;
+    memcpy(p->key + p->n + 1, q->key, q->n * sizeof(q->key[0]));
+    memcpy(p->child + p->n + 1, q->child, (q->n + 1) * sizeof(q->child[0]));
+    p->n += q->n + 1;
+}
+
+/* Release the nodes of the subtree R of height H.  */
+static void
+ULIB_BTREE(free_nodes)(ulib_cache *cache, void *r, unsigned int h) {
+    struct ULIB_BTREE(inner) *p = (struct ULIB_BTREE(inner) *)r;
+    unsigned int i;
+
+    if (h > 0)
+        for (i = 0; i <= p->n; i++)
+            ULIB_BTREE(free_nodes)(cache, p->child[i], h - 1);
+    ulib_cache_free(cache, r);
+}
+
+ULIB_STATIC void
+ULIB_BTREE(clear)(ULIB_BTREE_TYPE *t) {
+    if (t->root)
+        ULIB_BTREE(free_nodes)(t->cache, t->root, t->height);
+    t->root = 0;
+    t->height = 0;
+}
+
+/* Insert a key.  Record the path from the root, put the key into its
+   leaf and, if the leaf is full, split it and insert the separator
+   into the parent, splitting full inner nodes up the path.  The nodes
+   for the splits are allocated before modifying the tree, so a failed
+   insertion leaves it unchanged.  */
+ULIB_STATIC int
+#ifdef ULIB_BTREE_DATA_TYPE
+ULIB_BTREE(insert)(ULIB_BTREE_TYPE *t,
+                   ULIB_BTREE_KEY_TYPE key,
+                   ULIB_BTREE_DATA_TYPE data) {
+#else
+ULIB_BTREE(insert)(ULIB_BTREE_TYPE *t, ULIB_BTREE_KEY_TYPE key) {
+#endif
+    struct ULIB_BTREE(inner) *path[ULIB_BTREE_MAX_HEIGHT], *p, *q;
+    unsigned int idx[ULIB_BTREE_MAX_HEIGHT];
+    void *spare[ULIB_BTREE_MAX_HEIGHT + 2], *r;
+    struct ULIB_BTREE(leaf) *l, *m = 0;
+    unsigned int h, i, n, need;
+    ULIB_BTREE_KEY_TYPE sep, up;
+
+    if (t->root == 0) {
+        if ((l = (struct ULIB_BTREE(leaf) *)ulib_cache_alloc(t->cache)) == 0)
+            return -1;
+        l->next = 0;
+        l->n = 0;
+        t->root = l;
+    }
+
+    r = t->root;
+    for (h = 0; h < t->height; h++) {
+        path[h] = p = (struct ULIB_BTREE(inner) *)r;
+        idx[h] = ULIB_BTREE(upper)(p->key, p->n, key);
+        r = p->child[idx[h]];
+    }
+
+    l = (struct ULIB_BTREE(leaf) *)r;
+    i = ULIB_BTREE(lower)(l->key, l->n, key);
+    if (i < l->n && ULIB_BTREE_COMPARE(l->key[i], key) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    need = 0;
+    if (l->n == ULIB_BTREE_LEAF_KEYS) {
+        need = 1;
+        for (h = t->height; h > 0 && path[h - 1]->n == ULIB_BTREE_INNER_KEYS; h--)
+            need++;
+        if (h == 0)
+            need++;
+
+        for (n = 0; n < need; n++) {
+            if ((spare[n] = ulib_cache_alloc(t->cache)) == 0) {
+                while (n > 0)
+                    ulib_cache_free(t->cache, spare[--n]);
+                return -1;
+            }
+        }
+
+        /* Split the leaf, so that the key goes into the left half if
+           its position is in it.  */
+        m = (struct ULIB_BTREE(leaf) *)spare[--need];
+        n = (ULIB_BTREE_LEAF_KEYS + 1) / 2;
+        h = i < n ? n - 1 : n;
+        m->n = 0;
+        ULIB_BTREE(leaf_move)(m, l, h, ULIB_BTREE_LEAF_KEYS - h);
+        l->n = h;
+        m->next = l->next;
+        l->next = m;
+        if (i >= n) {
+            l = m;
+            i -= n;
+        }
+    }
+
+    ULIB_BTREE(leaf_open)(l, i);
+    l->key[i] = key;
+#ifdef ULIB_BTREE_DATA_TYPE
+    l->data[i] = data;
+#endif
+
+    if (m == 0)
+        return 0;
+
+    /* Insert the separator and the new node into the parents,
+       splitting the full ones, of which the middle key goes up.  */
+    sep = m->key[0];
+    r = m;
+    for (h = t->height; h > 0; h--) {
+        p = path[h - 1];
+        i = idx[h - 1];
+        if (p->n < ULIB_BTREE_INNER_KEYS) {
+            ULIB_BTREE(inner_open)(p, i, sep, r);
+            return 0;
+        }
+
+        q = (struct ULIB_BTREE(inner) *)spare[--need];
+        n = (ULIB_BTREE_INNER_KEYS + 1) / 2;
+        if (i < n) {
+            q->n = ULIB_BTREE_INNER_KEYS - n;
+            memcpy(q->key, p->key + n, q->n * sizeof(q->key[0]));
+            memcpy(q->child, p->child + n, (q->n + 1) * sizeof(q->child[0]));
+            up = p->key[n - 1];
+            p->n = n - 1;
+            ULIB_BTREE(inner_open)(p, i, sep, r);
+            sep = up;
+        } else if (i == n) {
+            q->n = ULIB_BTREE_INNER_KEYS - n;
+            memcpy(q->key, p->key + n, q->n * sizeof(q->key[0]));
+            memcpy(q->child + 1, p->child + n + 1, q->n * sizeof(q->child[0]));
+            q->child[0] = r;
+            p->n = n;
+        } else {
+            q->n = ULIB_BTREE_INNER_KEYS - n - 1;
+            memcpy(q->key, p->key + n + 1, q->n * sizeof(q->key[0]));
+            memcpy(q->child, p->child + n + 1, (q->n + 1) * sizeof(q->child[0]));
+            p->n = n;
+            ULIB_BTREE(inner_open)(q, i - n - 1, sep, r);
+            sep = p->key[n];
+        }
+        r = q;
+    }
+
+    /* Grow a new root.  */
+    p = (struct ULIB_BTREE(inner) *)spare[--need];
+    p->n = 1;
+    p->key[0] = sep;
+    p->child[0] = t->root;
+    p->child[1] = r;
+    t->root = p;
+    t->height++;
+    return 0;
+}
+
+/* Delete a key.  Record the path from the root, remove the key from
+   its leaf and, if the leaf underflows, borrow a key from a sibling or
+   merge with it, removing a separator from the parent, and so on up
+   the path.  */
+ULIB_STATIC int
+#ifdef ULIB_BTREE_DATA_TYPE
+ULIB_BTREE(delete)(ULIB_BTREE_TYPE *t,
+                   ULIB_BTREE_KEY_TYPE key,
+                   ULIB_BTREE_DATA_TYPE *data) {
+#else
+ULIB_BTREE(delete)(ULIB_BTREE_TYPE *t, ULIB_BTREE_KEY_TYPE key) {
+#endif
+    struct ULIB_BTREE(inner) *path[ULIB_BTREE_MAX_HEIGHT], *p, *g, *s;
+    unsigned int idx[ULIB_BTREE_MAX_HEIGHT];
+    struct ULIB_BTREE(leaf) *l, *sl;
+    unsigned int h, i;
+    void *r;
+
+    if ((r = t->root) == 0)
+        return -1;
+
+    for (h = 0; h < t->height; h++) {
+        path[h] = p = (struct ULIB_BTREE(inner) *)r;
+        idx[h] = ULIB_BTREE(upper)(p->key, p->n, key);
+        r = p->child[idx[h]];
+    }
+
+    l = (struct ULIB_BTREE(leaf) *)r;
+    i = ULIB_BTREE(lower)(l->key, l->n, key);
+    if (i == l->n || ULIB_BTREE_COMPARE(l->key[i], key) != 0)
+        return -1;
+#ifdef ULIB_BTREE_DATA_TYPE
+    if (data)
+        *data = l->data[i];
+#endif
+    ULIB_BTREE(leaf_close)(l, i);
+
+    if (t->height == 0) {
+        if (l->n == 0) {
+            ulib_cache_free(t->cache, l);
+            t->root = 0;
+        }
+        return 0;
+    }
+
+    if (l->n >= ULIB_BTREE_LEAF_MIN)
+        return 0;
+
+    p = path[t->height - 1];
+    i = idx[t->height - 1];
+    if (i > 0
+        && (sl = (struct ULIB_BTREE(leaf) *)p->child[i - 1])->n > ULIB_BTREE_LEAF_MIN) {
+        ULIB_BTREE(leaf_open)(l, 0);
+        sl->n--;
+        l->key[0] = sl->key[sl->n];
+#ifdef ULIB_BTREE_DATA_TYPE
+        l->data[0] = sl->data[sl->n];
+#endif
+        p->key[i - 1] = l->key[0];
+        return 0;
+    }
+    if (i < p->n
+        && (sl = (struct ULIB_BTREE(leaf) *)p->child[i + 1])->n > ULIB_BTREE_LEAF_MIN) {
+        ULIB_BTREE(leaf_move)(l, sl, 0, 1);
+        ULIB_BTREE(leaf_close)(sl, 0);
+        p->key[i] = sl->key[0];
+        return 0;
+    }
+
+    if (i > 0) {
+        sl = (struct ULIB_BTREE(leaf) *)p->child[--i];
+        ULIB_BTREE(leaf_move)(sl, l, 0, l->n);
+        sl->next = l->next;
+        ulib_cache_free(t->cache, l);
+    } else {
+        sl = (struct ULIB_BTREE(leaf) *)p->child[i + 1];
+        ULIB_BTREE(leaf_move)(l, sl, 0, sl->n);
+        l->next = sl->next;
+        ulib_cache_free(t->cache, sl);
+    }
+    ULIB_BTREE(inner_close)(p, i);
+
+    for (h = t->height - 1; h > 0; h--) {
+        p = path[h];
+        if (p->n >= ULIB_BTREE_INNER_MIN)
+            return 0;
+
+        g = path[h - 1];
+        i = idx[h - 1];
+        if (i > 0
+            && (s = (struct ULIB_BTREE(inner) *)g->child[i - 1])->n
+                   > ULIB_BTREE_INNER_MIN) {
+            /* Rotate a key from the left sibling through the parent.  */
+            memmove(p->key + 1, p->key, p->n * sizeof(p->key[0]));
+            memmove(p->child + 1, p->child, (p->n + 1) * sizeof(p->child[0]));
+            p->key[0] = g->key[i - 1];
+            p->child[0] = s->child[s->n];
+            p->n++;
+            g->key[i - 1] = s->key[--s->n];
+            return 0;
+        }
+        if (i < g->n
+            && (s = (struct ULIB_BTREE(inner) *)g->child[i + 1])->n
+                   > ULIB_BTREE_INNER_MIN) {
+            /* Rotate a key from the right sibling through the
+               parent.  */
+            p->key[p->n] = g->key[i];
+            p->child[p->n + 1] = s->child[0];
+            p->n++;
+            g->key[i] = s->key[0];
+            s->n--;
+            memmove(s->key, s->key + 1, s->n * sizeof(s->key[0]));
+            memmove(s->child, s->child + 1, (s->n + 1) * sizeof(s->child[0]));
+            return 0;
+        }
+
+        if (i > 0) {
+            s = (struct ULIB_BTREE(inner) *)g->child[--i];
+            ULIB_BTREE(inner_merge)(s, g->key[i], p);
+            ulib_cache_free(t->cache, p);
+        } else {
+            s = (struct ULIB_BTREE(inner) *)g->child[i + 1];
+            ULIB_BTREE(inner_merge)(p, g->key[i], s);
+            ulib_cache_free(t->cache, s);
+        }
+        ULIB_BTREE(inner_close)(g, i);
+    }
+
+    /* Shrink the tree, if the root has a single child left.  */
+    p = path[0];
+    if (p->n == 0) {
+        t->root = p->child[0];
+        t->height--;
+        ulib_cache_free(t->cache, p);
+    }
+    return 0;
+}
+
+/* Prefetch the SIZE bytes of the node at P.  */
+static inline void
+ULIB_BTREE(prefetch)(const void *p, size_t size) {
+    size_t i;
+
+    for (i = 0; i < size; i += ULIB_BTREE_NODE_ALIGN)
+        ulib_prefetch((const char *)p + i, 0);
+}
+
+ULIB_STATIC void
+ULIB_BTREE(lookup_batch)(const ULIB_BTREE_TYPE *t,
+                         unsigned int n,
+                         const ULIB_BTREE_KEY_TYPE *keys,
+#ifdef ULIB_BTREE_DATA_TYPE
+                         ULIB_BTREE_DATA_TYPE **results) {
+#else
+                         int *results) {
+#endif
+    void *node[ULIB_BTREE_BATCH];
+    struct ULIB_BTREE(inner) *p;
+    struct ULIB_BTREE(leaf) *l;
+    unsigned int i, j, m, h;
+
+    for (j = 0; j < n; j += m, keys += m, results += m) {
+        m = n - j < ULIB_BTREE_BATCH ? n - j : ULIB_BTREE_BATCH;
+        if (t->root == 0) {
+            for (i = 0; i < m; i++)
+                results[i] = 0;
+            continue;
+        }
+
+        for (i = 0; i < m; i++)
+            node[i] = t->root;
+        for (h = t->height; h > 0; h--) {
+            for (i = 0; i < m; i++) {
+                p = (struct ULIB_BTREE(inner) *)node[i];
+                node[i] = p->child[ULIB_BTREE(upper)(p->key, p->n, keys[i])];
+                ULIB_BTREE(prefetch)(node[i],
+                                     h > 1 ? sizeof(struct ULIB_BTREE(inner))
+                                           : sizeof(struct ULIB_BTREE(leaf)));
+            }
+        }
+
+        for (i = 0; i < m; i++) {
+            l = (struct ULIB_BTREE(leaf) *)node[i];
+            h = ULIB_BTREE(lower)(l->key, l->n, keys[i]);
+            if (h == l->n || ULIB_BTREE_COMPARE(l->key[h], keys[i]) != 0)
+                results[i] = 0;
+            else
+#ifdef ULIB_BTREE_DATA_TYPE
+                results[i] = &l->data[h];
+#else
+                results[i] = 1;
+#endif
+        }
+    }
+}
+
+#undef ULIB_BTREE_LEAF_MIN
+#undef ULIB_BTREE_INNER_MIN
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,386 @@
+#include "defs.h"
+#include "cache.h"
+
+#include <errno.h>
+#include <string.h>
+
+BEGIN_DECLS
+
+#ifndef ULIB_BTREE_KEY_TYPE
+#define ULIB_BTREE_KEY_TYPE unsigned int
+#endif
+
+#ifndef ULIB_BTREE_COMPARE
+#define ULIB_BTREE_COMPARE(a, b) (((a) > (b)) - ((a) < (b)))
+#endif
+
+#ifndef ULIB_BTREE_TYPE
+#define ULIB_BTREE_TYPE ulib_btree
+#endif
+
+#ifndef ULIB_STATIC
+#define ULIB_STATIC extern
+#endif
+
+/* Approximate size of a node in bytes.  The default of four cache
+   lines holds 60 unsigned int keys in a leaf and 20 keys in an inner
+   node.  The size of a node must not exceed
+   ULIB_CACHE_OBJECT_SIZE_MAX and a node must hold at least three
+   keys.  */
+#ifndef ULIB_BTREE_NODE_SIZE
+#define ULIB_BTREE_NODE_SIZE 256
+#endif
+
+/* Alignment of the nodes.  */
+#ifndef ULIB_BTREE_NODE_ALIGN
+#define ULIB_BTREE_NODE_ALIGN 64
+#endif
+
+/* Maximum height of a tree.  Each inner node, but the root, has at
+   least two children.  */
+#ifndef ULIB_BTREE_MAX_HEIGHT
+#define ULIB_BTREE_MAX_HEIGHT 64
+#endif
+
+/* Number of searches ``lookup_batch'' runs in lockstep.  */
+#ifndef ULIB_BTREE_BATCH
+#define ULIB_BTREE_BATCH 8
+#endif
+
+/* Nodes are searched linearly, counting the smaller keys without
+   branches, which compilers vectorize for integer keys.  Define
+   ULIB_BTREE_BINARY_SEARCH to search them with a binary search
+   instead, which does fewer comparisons, when they are expensive.  */
+
+#define ULIB___BTREE(a, b) a##_##b
+#define ULIB__BTREE(a, b) ULIB___BTREE(a, b)
+#define ULIB_BTREE(x) ULIB__BTREE(ULIB_BTREE_TYPE, x)
+
+/* Number of keys in a leaf and in an inner node.  Redefined for each
+   instance of the template.  */
+#undef ULIB_BTREE_LEAF_KEYS
+#undef ULIB_BTREE_INNER_KEYS
+#ifdef ULIB_BTREE_DATA_TYPE
+#define ULIB_BTREE_LEAF_KEYS                                                    \
+    ((ULIB_BTREE_NODE_SIZE - 2 * sizeof(void *))                                \
+     / (sizeof(ULIB_BTREE_KEY_TYPE) + sizeof(ULIB_BTREE_DATA_TYPE)))
+#else
+#define ULIB_BTREE_LEAF_KEYS                                                    \
+    ((ULIB_BTREE_NODE_SIZE - 2 * sizeof(void *)) / sizeof(ULIB_BTREE_KEY_TYPE))
+#endif
+
+#define ULIB_BTREE_INNER_KEYS                                                   \
+    ((ULIB_BTREE_NODE_SIZE - 2 * sizeof(void *))                                \
+     / (sizeof(ULIB_BTREE_KEY_TYPE) + sizeof(void *)))
+
+/* A leaf holds the keys and the data, the leaves are linked in key
+   order.  */
+struct ULIB_BTREE(leaf) {
+    struct ULIB_BTREE(leaf) *next;
+    unsigned int n;
+    ULIB_BTREE_KEY_TYPE key[ULIB_BTREE_LEAF_KEYS];
+#ifdef ULIB_BTREE_DATA_TYPE
+    ULIB_BTREE_DATA_TYPE data[ULIB_BTREE_LEAF_KEYS];
+#endif
+};
+
+/* An inner node with N keys has N + 1 children.  The keys in the
+   subtree CHILD[I] are less than KEY[I] and the keys in CHILD[I + 1]
+   are not less than it.  */
+struct ULIB_BTREE(inner) {
+    unsigned int n;
+    ULIB_BTREE_KEY_TYPE key[ULIB_BTREE_INNER_KEYS];
+    void *child[ULIB_BTREE_INNER_KEYS + 1];
+};
+
+/* A B+ tree, mapping keys to data.  HEIGHT is the number of inner
+   node levels.  */
+struct ULIB_BTREE_TYPE {
+    ulib_cache *cache;
+    void *root;
+    unsigned int height;
+};
+typedef struct ULIB_BTREE_TYPE ULIB_BTREE_TYPE;
+
+/* A position in a tree.  Any modification of the tree invalidates
+   it.  */
+struct ULIB_BTREE(iter) {
+    struct ULIB_BTREE(leaf) *leaf;
+    unsigned int pos;
+};
+
+/* Create a cache for the nodes of trees.  Trees of the same type may
+   share a cache.  Throws NO_MEMORY.  */
+static inline ulib_cache *
+ULIB_BTREE(cache_create)(void) {
+    return ulib_cache_create(ULIB_CACHE_SIZE,
+                             sizeof(struct ULIB_BTREE(leaf))
+                                     > sizeof(struct ULIB_BTREE(inner))
+                                 ? sizeof(struct ULIB_BTREE(leaf))
+                                 : sizeof(struct ULIB_BTREE(inner)),
+                             ULIB_CACHE_ALIGN,
+                             ULIB_BTREE_NODE_ALIGN,
+                             0);
+}
+
+/* Initialize an empty tree, allocating its nodes from CACHE.  */
+static inline void
+ULIB_BTREE(init)(ULIB_BTREE_TYPE *t, ulib_cache *cache) {
+    t->cache = cache;
+    t->root = 0;
+    t->height = 0;
+}
+
+/* Release all the nodes of a tree, leaving it empty.  */
+ULIB_STATIC void ULIB_BTREE(clear)(ULIB_BTREE_TYPE *t);
+
+/* Insert a key into the tree.  Returns negative with errno set to
+   EEXIST if the key is already present.  Throws NO_MEMORY.  */
+#ifdef ULIB_BTREE_DATA_TYPE
+ULIB_STATIC int ULIB_BTREE(insert)(ULIB_BTREE_TYPE *t,
+                                   ULIB_BTREE_KEY_TYPE key,
+                                   ULIB_BTREE_DATA_TYPE data);
+#else
+ULIB_STATIC int ULIB_BTREE(insert)(ULIB_BTREE_TYPE *t, ULIB_BTREE_KEY_TYPE key);
+#endif
+
+/* Remove a key from the tree, storing its data at DATA, unless it is
+   null.  Returns negative if the key is not found.  */
+#ifdef ULIB_BTREE_DATA_TYPE
+ULIB_STATIC int ULIB_BTREE(delete)(ULIB_BTREE_TYPE *t,
+                                   ULIB_BTREE_KEY_TYPE key,
+                                   ULIB_BTREE_DATA_TYPE *data);
+#else
+ULIB_STATIC int ULIB_BTREE(delete)(ULIB_BTREE_TYPE *t, ULIB_BTREE_KEY_TYPE key);
+#endif
+
+/* Lookup the N keys at KEYS in the tree, storing the results at
+   RESULTS.  The searches descend the tree together a level at a time,
+   prefetching the next node of each, so that the cache misses of the
+   searches overlap.  */
+#ifdef ULIB_BTREE_DATA_TYPE
+ULIB_STATIC void ULIB_BTREE(lookup_batch)(const ULIB_BTREE_TYPE *t,
+                                          unsigned int n,
+                                          const ULIB_BTREE_KEY_TYPE *keys,
+                                          ULIB_BTREE_DATA_TYPE **results);
+#else
+ULIB_STATIC void ULIB_BTREE(lookup_batch)(const ULIB_BTREE_TYPE *t,
+                                          unsigned int n,
+                                          const ULIB_BTREE_KEY_TYPE *keys,
+                                          int *results);
+#endif
+
+/* Return the number of the first N keys at KEYS, less than K.  */
+static inline unsigned int
+ULIB_BTREE(lower)(const ULIB_BTREE_KEY_TYPE *keys,
+                 unsigned int n,
+                 ULIB_BTREE_KEY_TYPE k) {
+#ifdef ULIB_BTREE_BINARY_SEARCH
+    unsigned int lo = 0, mid;
+
+    while (n > 0) {
+        mid = n / 2;
+        if (ULIB_BTREE_COMPARE(keys[lo + mid], k) < 0) {
+            lo += mid + 1;
+            n -= mid + 1;
+        } else
+            n = mid;
+    }
+    return lo;
+#else
+    unsigned int i, c = 0;
+
+    for (i = 0; i < n; i++)
+        c += ULIB_BTREE_COMPARE(keys[i], k) < 0;
+    return c;
+#endif
+}
+
+/* Return the number of the first N keys at KEYS, not greater than
+   K.  */
+static inline unsigned int
+ULIB_BTREE(upper)(const ULIB_BTREE_KEY_TYPE *keys,
+                 unsigned int n,
+                 ULIB_BTREE_KEY_TYPE k) {
+#ifdef ULIB_BTREE_BINARY_SEARCH
+    unsigned int lo = 0, mid;
+
+    while (n > 0) {
+        mid = n / 2;
+        if (ULIB_BTREE_COMPARE(keys[lo + mid], k) <= 0) {
+            lo += mid + 1;
+            n -= mid + 1;
+        } else
+            n = mid;
+    }
+    return lo;
+#else
+    unsigned int i, c = 0;
+
+    for (i = 0; i < n; i++)
+        c += ULIB_BTREE_COMPARE(keys[i], k) <= 0;
+    return c;
+#endif
+}
+
+/* Return the leaf, which would hold the key K.  */
+static inline struct ULIB_BTREE(leaf) *
+ULIB_BTREE(find_leaf)(const ULIB_BTREE_TYPE *t, ULIB_BTREE_KEY_TYPE k) {
+    struct ULIB_BTREE(inner) *p;
+    void *r = t->root;
+    unsigned int h;
+
+    for (h = t->height; h > 0; h--) {
+        p = (struct ULIB_BTREE(inner) *)r;
+        r = p->child[ULIB_BTREE(upper)(p->key, p->n, k)];
+    }
+    return (struct ULIB_BTREE(leaf) *)r;
+}
+
+/* Lookup a key in the tree.  */
+#ifdef ULIB_BTREE_DATA_TYPE
+static inline ULIB_BTREE_DATA_TYPE *
+#else
+static inline int
+#endif
+ULIB_BTREE(lookup)(const ULIB_BTREE_TYPE *t, ULIB_BTREE_KEY_TYPE key) {
+    struct ULIB_BTREE(leaf) *l;
+    unsigned int i;
+
+    if (t->root == 0)
+        return 0;
+
+    l = ULIB_BTREE(find_leaf)(t, key);
+    i = ULIB_BTREE(lower)(l->key, l->n, key);
+    if (i == l->n || ULIB_BTREE_COMPARE(l->key[i], key) != 0)
+        return 0;
+#ifdef ULIB_BTREE_DATA_TYPE
+    return &l->data[i];
+#else
+    return 1;
+#endif
+}
+
+/* Move the iterator past the end of a leaf to the next leaf.  Return
+   non-zero, unless the iterator is at the end of the tree.  */
+static inline int
+ULIB_BTREE(iter_fix)(struct ULIB_BTREE(iter) *it) {
+    if (it->leaf && it->pos == it->leaf->n) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    return it->leaf != 0;
+}
+
+/* Position the iterator IT at the smallest key of the tree.  Return
+   zero if the tree is empty.  */
+static inline int
+ULIB_BTREE(first)(const ULIB_BTREE_TYPE *t, struct ULIB_BTREE(iter) *it) {
+    void *r = t->root;
+    unsigned int h;
+
+    for (h = t->height; h > 0; h--)
+        r = ((struct ULIB_BTREE(inner) *)r)->child[0];
+    it->leaf = (struct ULIB_BTREE(leaf) *)r;
+    it->pos = 0;
+    return it->leaf != 0;
+}
+
+/* Position the iterator IT at the smallest key, not less than K.
+   Return zero if there is no such key.  */
+static inline int
+ULIB_BTREE(lower_bound)(const ULIB_BTREE_TYPE *t,
+                        ULIB_BTREE_KEY_TYPE k,
+                        struct ULIB_BTREE(iter) *it) {
+    if (t->root == 0) {
+        it->leaf = 0;
+        return 0;
+    }
+    it->leaf = ULIB_BTREE(find_leaf)(t, k);
+    it->pos = ULIB_BTREE(lower)(it->leaf->key, it->leaf->n, k);
+    return ULIB_BTREE(iter_fix)(it);
+}
+
+/* Position the iterator IT at the smallest key, greater than K.
+   Return zero if there is no such key.  */
+static inline int
+ULIB_BTREE(upper_bound)(const ULIB_BTREE_TYPE *t,
+                        ULIB_BTREE_KEY_TYPE k,
+                        struct ULIB_BTREE(iter) *it) {
+    if (t->root == 0) {
+        it->leaf = 0;
+        return 0;
+    }
+    it->leaf = ULIB_BTREE(find_leaf)(t, k);
+    it->pos = ULIB_BTREE(upper)(it->leaf->key, it->leaf->n, k);
+    return ULIB_BTREE(iter_fix)(it);
+}
+
+/* Advance the iterator IT to the next key.  Return zero if it was at
+   the largest one.  */
+static inline int
+ULIB_BTREE(next)(struct ULIB_BTREE(iter) *it) {
+    it->pos++;
+    return ULIB_BTREE(iter_fix)(it);
+}
+
+/* Return the key at the iterator IT.  */
+static inline ULIB_BTREE_KEY_TYPE
+ULIB_BTREE(key)(const struct ULIB_BTREE(iter) *it) {
+    return it->leaf->key[it->pos];
+}
+
+#ifdef ULIB_BTREE_DATA_TYPE
+/* Return the data at the iterator IT.  */
+static inline ULIB_BTREE_DATA_TYPE *
+ULIB_BTREE(data)(const struct ULIB_BTREE(iter) *it) {
+    return &it->leaf->data[it->pos];
+}
+#endif
+
+/* Invoke FN with each key in the range [LO, HI] in ascending order,
+   its data, if any, and ARG.  Stop if FN returns non-zero and return
+   that value, return zero after the last key in the range.  FN must
+   not modify the tree.  */
+static inline int
+ULIB_BTREE(range)(const ULIB_BTREE_TYPE *t,
+                  ULIB_BTREE_KEY_TYPE lo,
+                  ULIB_BTREE_KEY_TYPE hi,
+#ifdef ULIB_BTREE_DATA_TYPE
+                  int (*fn)(ULIB_BTREE_KEY_TYPE, ULIB_BTREE_DATA_TYPE *, void *),
+#else
+                  int (*fn)(ULIB_BTREE_KEY_TYPE, void *),
+#endif
+                  void *arg) {
+    struct ULIB_BTREE(iter) it;
+    struct ULIB_BTREE(leaf) *l;
+    unsigned int i;
+    int ret;
+
+    if (!ULIB_BTREE(lower_bound)(t, lo, &it))
+        return 0;
+
+    for (l = it.leaf, i = it.pos; l; l = l->next, i = 0) {
+        for (; i < l->n; i++) {
+            if (ULIB_BTREE_COMPARE(l->key[i], hi) > 0)
+                return 0;
+#ifdef ULIB_BTREE_DATA_TYPE
+            ret = fn(l->key[i], &l->data[i], arg);
+#else
+            ret = fn(l->key[i], arg);
+#endif
+            if (ret != 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+END_DECLS
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,11 +1,22 @@
 #include "cache.h"
 #include "pgalloc.h"
+#include "time.h"
+#include "spinlock.h"
+#include "trace.h"
 #include "assert.h"
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define ULIB_HAVE_BACKTRACE 1
+#endif
 
 struct slab {
     /* Doubly-linked lists of all the slabs in a cache.  */
@@ -20,35 +31,78 @@ struct slab {
     /* Beginning of unallocated space.  */
     void *offset;
 
+    /* Object control words: frame number when allocated, free list
+     when available.  */
+    unsigned short *ctl;
+
+    /* Reciprocal of the object size, used to compute object indices
+     without a division.  */
+    uint32_t recip;
+
     /* Free objects list head.  */
     unsigned short free;
 
-    /* Slab control bits: bit 15 - sweep flag, bits 0-14 - available
-     objects count.  */
+    /* Slab control bits: bit 15 - sweep flag, bit 14 - sampled flag,
+     bit 13 - evacuation flag, bits 0-12 - available objects count.  */
     unsigned short info;
 
-    /* Object control bits: bit 15 - allocated, bit 14 - reachability,
-     bits 0-13 - frame number when allocated, free list when
-     available.  */
-    unsigned short ctl[];
+    /* Number of objects in the slab, sampled by the allocation profiler
+     and not freed yet.  */
+    unsigned short samples;
+
+    /* Object state bitmaps.  Even words contain allocation bits, odd
+     words contain reachability bits, so the two bits of an object
+     are always on the same cache line.  */
+    uintptr_t map[];
 };
 
-/* Object state constants.  */
+/* Slab sweep flag.  */
 #define GCFLAG 0x8000U
-#define ALLOCATED 0x4000U
-#define FRAME_MASK 0x1fffU
+
+/* Slab flag, set while the slab holds objects, sampled by the
+   allocation profiler.  */
+#define SAMPLED 0x4000U
+
+/* Slab flag, set while the objects of the slab are being moved out by
+   ``ulib_cache_compact''.  */
+#define MOVING 0x2000U
 
 /* End of list tag.  */
-#define SLAB_EOL (0xffffU & ~ALLOCATED)
+#define SLAB_EOL 0xffffU
+
+/* Frame number of the objects, queued for finalization.  */
+#define FINAL_FRAME 0xffffU
+
+/* Number of bits in a bitmap word.  */
+#define MAP_BITS (sizeof(uintptr_t) * CHAR_BIT)
+
+/* Number of bitmap words for N objects.  */
+#define MAP_WORDS(n) (((n) + MAP_BITS - 1) / MAP_BITS)
+
+/* Bitmap words and bit mask for an object INDEX.  */
+#define ALLOC_WORD(slab, index) ((slab)->map[2 * ((index) / MAP_BITS)])
+#define MARK_WORD(slab, index) ((slab)->map[2 * ((index) / MAP_BITS) + 1])
+#define MAP_BIT(index) ((uintptr_t)1 << ((index) % MAP_BITS))
+
+/* Number of words in the bitmap of pointer fields of an object.  */
+#define PTRMAP_WORDS                                                             \
+    MAP_WORDS((ULIB_CACHE_OBJECT_SIZE_MAX + sizeof(void *) - 1) / sizeof(void *))
 
 /* Available objects count.  */
-#define SLAB_COUNT(slab) (slab->info & ~GCFLAG)
+#define SLAB_COUNT(slab) (slab->info & ~(GCFLAG | SAMPLED | MOVING))
 
 /* The object cache structure.  */
 struct ulib_cache {
     /* Garbage collected caches list.  */
     ulib_list gclist;
 
+    /* The heap, to which the cache belongs.  */
+    struct ulib_gcheap *heap;
+
+    /* Cache of the handles of the objects, if the objects are reached
+     through handles, null otherwise.  */
+    struct ulib_cache *handles;
+
     /* Head of list of all the slabs in the cache.  */
     ulib_list slabs;
 
@@ -64,9 +118,24 @@ struct ulib_cache {
     /* Destructor function.  */
     ulib_dtor_func dtor;
 
+    /* Finalizer function.  */
+    ulib_final_func final;
+
     /* GC scan function.  */
     ulib_gcscan_func scan;
 
+    /* Number of pointer fields in an object, if the cache has a layout
+     descriptor, zero otherwise.  */
+    unsigned int nptrs;
+
+    /* Heap image identifier, zero if the cache isn't saved in heap
+     images.  */
+    unsigned int image;
+
+    /* Layout descriptor - bitmap of the pointer sized words of an
+     object, which contain pointers to cached objects.  */
+    uintptr_t ptrmap[PTRMAP_WORDS];
+
     /* Next cache color.  */
     unsigned short color;
 
@@ -84,6 +153,12 @@ struct ulib_cache {
 
     /* Number of cache colors.  */
     unsigned short color_count;
+
+    /* Number of words in each of the slab object state bitmaps.  */
+    unsigned short map_words;
+
+    /* Reciprocal of the buffer size.  */
+    uint32_t recip;
 };
 
 /* Root objects tree.  */
@@ -92,13 +167,21 @@ struct root_data {
     ulib_list list;
 
     /* Root object scan function.  Having a separate scan function for
-     root objects allows for non-cached roots.  */
+     root objects allows for non-cached roots.  Cached roots are
+     scanned like the other objects of their cache.  */
     ulib_gcscan_func scan;
 
+    /* Weak reference notification function.  */
+    ulib_gcweak_func notify;
+
     /* Cached flag - if the root object is cached and thus
      garbage-collected, it is marked as reachable during the mark
      phase.  */
     unsigned int cached : 1;
+
+    /* Number of outstanding ``ulib_gcshare'' calls for a shared
+     object.  */
+    unsigned int shares;
 };
 
 #define ULIB_SPLAY_TREE_KEY_TYPE void *
@@ -110,6 +193,9 @@ struct root_data {
 #include "splay-tree.h"
 #include "splay-tree.c"
 
+/* Per thread shadow stack of scoped roots.  */
+ULIB_THREAD struct ulib_gcshadow ulib_gcshadow;
+
 /* Root object constructor.  */
 static int
 root_tree_ctor(void *_obj, unsigned int size __attribute__((unused))) {
@@ -120,29 +206,105 @@ root_tree_ctor(void *_obj, unsigned int size __attribute__((unused))) {
     return 0;
 }
 
-/* "Globals".  */
-static struct {
+/* Garbage collected heap.  */
+/* A cleared weak reference, pending notification.  */
+struct weak_note {
+    void **slot;
+    void *obj;
+    ulib_gcweak_func notify;
+};
+
+struct ulib_gcheap {
     /* Garbage collected caches list.  */
     ulib_list gchead;
 
-    /* Cache cache - allocator for cache objects.  */
-    ulib_cache cache_cache;
-
     /* Roots cache - allocator for root registration objects.  */
     ulib_cache root_cache;
 
     /* The root of the tree of registered root objects.  */
     root_tree *roots;
 
-    /* Reachability flag value.  The value alternates between 0 and
-     GCFLAG before each mark phase, in order to avoid memory writes
-     for clearing marks in live objects.  */
+    /* The root of the tree of registered weak references.  */
+    root_tree *weaks;
+
+    /* The root of the tree of shared objects.  */
+    root_tree *shared;
+
+    /* Lock, which protects the trees above and the roots cache, so
+     objects can be shared and unshared from any thread.  */
+    ulib_spinlock lock;
+
+    /* Sweep flag value.  The value alternates between 0 and GCFLAG
+     before each mark phase, so the sweep phase can recognize slabs,
+     which it has already visited.  */
     unsigned short gcflag;
 
     /* Allocation frame number.  */
     unsigned short gcframe;
+
+    /* The newest frame, whose objects may be reachable from outside
+     of it, i.e. may have escaped into an older frame.  Frames above it
+     can be released without marking.  Protected by the heap lock.  */
+    unsigned short dirty;
+
+    /* Escape tracking flag - see ``ulib_gcconfig''.  */
+    int escapes;
+
+    /* Automatic collection limits - see ``ulib_gcconfig''.  */
+    size_t trigger_bytes;
+    unsigned int trigger_slabs;
+    unsigned int growth;
+
+    /* Current byte limit, derived from the TRIGGER_BYTES and the size
+     of the heap surviving the last collection.  */
+    size_t threshold;
+
+    /* Bytes and slabs allocated by garbage collected caches since the
+     last collection.  */
+    size_t alloc_bytes;
+    unsigned int alloc_slabs;
+
+    /* Bytes in live objects, counted during a sweep.  */
+    size_t heap_live;
+
+    /* Finalization queue.  Objects at indices from FINAL_HEAD up to
+     FINAL_N are pending finalization.  */
+    void **final;
+    unsigned int final_head;
+    unsigned int final_n;
+    unsigned int final_sz;
+
+    /* Weak references cleared by the collection in progress, whose
+     notification functions are yet to be invoked.  */
+    struct weak_note *notes;
+    unsigned int notes_sz;
+
+    /* Counters of the collection in progress.  */
+    ulib_gccycle cycle;
+
+    /* Collector statistics and the sequence counter, which protects
+     them from concurrent readers.  The counter is odd while the
+     statistics are being updated.  */
+    ulib_gcstats stats;
+    atomic_uint stats_seq;
+};
+
+/* "Globals".  */
+static struct {
+    /* Lock, which serializes the initialization and the creation of
+     caches.  */
+    ulib_spinlock lock;
+
+    /* Cache cache - allocator for cache objects.  */
+    ulib_cache cache_cache;
+
+    /* The default heap, used by the threads, which haven't set one.  */
+    ulib_gcheap heap;
 } G;
 
+/* The garbage collected heap of the current thread.  */
+static ULIB_THREAD ulib_gcheap *gc_current;
+
 /* Align N to A boundary.  */
 static inline unsigned int
 align_uint(unsigned int n, unsigned int a) {
@@ -155,16 +317,24 @@ align_ptr(const void *ptr, uintptr_t a) {
     return (void *)(((uintptr_t)ptr + a - 1) & -a);
 }
 
+/* Calculate the size of the slab control data for NOBJS objects,
+   i.e. the offset of the objects array for the first color.  */
+static inline unsigned int
+calc_ctlsize(unsigned int nobjs, unsigned int align) {
+    return align_uint(sizeof(struct slab) + 2 * MAP_WORDS(nobjs) * sizeof(uintptr_t)
+                          + nobjs * sizeof(short),
+                      align);
+}
+
 /* Calculate the number of objects in a slab.  */
 static inline unsigned int
 calc_nobjs(unsigned int size, unsigned int align) {
-    unsigned int nobjs, ctl;
+    unsigned int nobjs;
 
     nobjs = (ulib_pgsize() - sizeof(struct slab)) / size + 1;
     do {
         nobjs--;
-        ctl = align_uint(sizeof(struct slab) + nobjs * sizeof(short), align);
-    } while (ctl + nobjs * size > ulib_pgsize());
+    } while (calc_ctlsize(nobjs, align) + nobjs * size > ulib_pgsize());
 
     return nobjs;
 }
@@ -172,10 +342,7 @@ calc_nobjs(unsigned int size, unsigned int align) {
 /* Calculate the color count for a slab.  */
 static inline unsigned int
 calc_ncolors(unsigned int count, unsigned int size, unsigned int align) {
-    return 1 + ((ulib_pgsize()
-                 - align_uint(sizeof(struct slab) + count * sizeof(short), align)
-                 - count * size)
-                / align);
+    return 1 + ((ulib_pgsize() - calc_ctlsize(count, align) - count * size) / align);
 }
 
 /* Calculate slab object count and color count for the given object
@@ -201,56 +368,156 @@ calc_slab_params(unsigned int size,
 /* Initialize a cache.  */
 static void
 cache_init(ulib_cache *cache,
+           ulib_gcheap *heap,
            unsigned int size,
            unsigned int align,
            ulib_ctor_func ctor,
            ulib_clear_func clear,
            ulib_dtor_func dtor,
+           ulib_final_func final,
            int gc,
-           ulib_gcscan_func scan) {
+           ulib_gcscan_func scan,
+           unsigned int nptrs,
+           const uintptr_t *ptrmap,
+           unsigned int image) {
     ulib_list_init(&cache->gclist);
     if (gc)
-        ulib_list_insert(&G.gchead, &cache->gclist);
+        ulib_list_insert(&heap->gchead, &cache->gclist);
+    cache->heap = heap;
+    cache->handles = 0;
     ulib_list_init(&cache->slabs);
     cache->free = (struct slab *)&cache->slabs.next;
     cache->ctor = ctor;
     cache->clear = clear;
     cache->dtor = dtor;
+    cache->final = final;
     cache->scan = scan;
+    cache->nptrs = nptrs;
+    cache->image = image;
+    if (nptrs)
+        memcpy(cache->ptrmap, ptrmap, sizeof(cache->ptrmap));
     cache->color = 0;
     cache->size = align_uint(size, align);
     cache->usize = size;
     cache->align = align;
     calc_slab_params(cache->size, align, &cache->object_count, &cache->color_count);
+    cache->map_words = MAP_WORDS(cache->object_count);
+    cache->recip = 0xffffffffU / cache->size + 1;
+}
+
+/* Initialize a garbage collected HEAP.  */
+static void
+gcheap_init(ulib_gcheap *heap) {
+    ulib_list_init(&heap->gchead);
+    cache_init(&heap->root_cache,
+               heap,
+               sizeof(root_tree),
+               sizeof(void *),
+               root_tree_ctor,
+               0,
+               0,
+               0,
+               0,
+               0,
+               0,
+               0,
+               0);
+    heap->roots = heap->weaks = heap->shared = 0;
+    atomic_init(&heap->lock, 0);
+    heap->gcflag = 0;
+    heap->gcframe = 0;
+    heap->dirty = 0;
+    heap->escapes = 0;
+    heap->growth = 100;
+    atomic_init(&heap->stats_seq, 0);
 }
 
 /* PRIVATE: Initialize the cacheing allocator.  */
-static int cache_initialized;
+static atomic_int cache_initialized;
 
 static void
 init_cache() {
-    cache_initialized = 1;
-    ulib_list_init(&G.gchead);
-    cache_init(&G.cache_cache, sizeof(ulib_cache), sizeof(void *), 0, 0, 0, 0, 0);
-    cache_init(
-        &G.root_cache, sizeof(root_tree), sizeof(void *), root_tree_ctor, 0, 0, 0, 0);
-    G.gcframe = 0;
+    ulib_spin_lock(&G.lock);
+    if (!atomic_load_explicit(&cache_initialized, memory_order_relaxed)) {
+        cache_init(&G.cache_cache,
+                   &G.heap,
+                   sizeof(ulib_cache),
+                   sizeof(void *),
+                   0,
+                   0,
+                   0,
+                   0,
+                   0,
+                   0,
+                   0,
+                   0,
+                   0);
+        gcheap_init(&G.heap);
+        atomic_store_explicit(&cache_initialized, 1, memory_order_release);
+    }
+    ulib_spin_unlock(&G.lock);
+}
+
+/* Return the heap of the current thread.  */
+static inline ulib_gcheap *
+gc_heap() {
+    if (gc_current == 0) {
+        if (!cache_initialized)
+            init_cache();
+        gc_current = &G.heap;
+    }
+    return gc_current;
+}
+
+/* Create a garbage collected heap.  */
+ulib_gcheap *
+ulib_gcheap_create() {
+    ulib_gcheap *heap;
+
+    if (!cache_initialized)
+        init_cache();
+
+    if ((heap = calloc(1, sizeof(ulib_gcheap))) == 0)
+        return 0;
+
+    gcheap_init(heap);
+    return heap;
+}
+
+/* Set the heap of the current thread.  */
+ulib_gcheap *
+ulib_gcheap_set(ulib_gcheap *heap) {
+    ulib_gcheap *prev;
+
+    prev = gc_heap();
+    gc_current = heap ? heap : &G.heap;
+    return prev;
+}
+
+/* Return the heap of the current thread.  */
+ulib_gcheap *
+ulib_gcheap_get() {
+    return gc_heap();
 }
 
 /* Create a cache.  */
 ulib_cache *
 ulib_cache_create(int attr, ...) {
     va_list ap;
-    ulib_cache *cache;
-    int gc = 0;
+    ulib_cache *cache, *handles = 0;
+    int gc = 0, hnd = 0;
     unsigned int size = 0, align = 0;
     ulib_ctor_func ctor = 0;
     ulib_clear_func clear = 0;
     ulib_dtor_func dtor = 0;
+    ulib_final_func final = 0;
     ulib_gcscan_func scan = 0;
+    unsigned int i, off, nptrs = 0, image = 0;
+    const unsigned int *offs = 0;
+    uintptr_t ptrmap[PTRMAP_WORDS];
+    ulib_gcheap *heap;
 
-    if (!cache_initialized)
-        init_cache();
+    heap = gc_heap();
 
     va_start(ap, attr);
     do {
@@ -287,6 +554,23 @@ ulib_cache_create(int attr, ...) {
             scan = va_arg(ap, ulib_gcscan_func);
             break;
 
+        case ULIB_CACHE_GCLAYOUT:
+            nptrs = va_arg(ap, unsigned int);
+            offs = va_arg(ap, const unsigned int *);
+            break;
+
+        case ULIB_CACHE_FINALIZE:
+            final = va_arg(ap, ulib_final_func);
+            break;
+
+        case ULIB_CACHE_IMAGE:
+            image = va_arg(ap, unsigned int);
+            break;
+
+        case ULIB_CACHE_HANDLES:
+            hnd = 1;
+            break;
+
         case 0:
             break;
 
@@ -297,19 +581,101 @@ ulib_cache_create(int attr, ...) {
     } while (attr);
     va_end(ap);
 
-    if (scan)
+    if (scan || nptrs || final || image)
         gc = 1;
 
+    /* Objects are scanned either by a function or by the layout
+     descriptor, not both.  */
+    if (scan && nptrs)
+        goto einval;
+
+    /* Objects in heap images are relocated by the layout descriptor and
+     must not depend on the constructor state.  */
+    if (image && (scan || ctor || dtor))
+        goto einval;
+
+    /* Objects, reached through handles, are moved by copying, which
+     would duplicate the constructor state.  */
+    if (hnd && (ctor || dtor || image))
+        goto einval;
+
+    /* Image identifiers are unique within a heap.  */
+    if (image) {
+        for (cache = (ulib_cache *)heap->gchead.next;
+             cache != (ulib_cache *)&heap->gchead;
+             cache = (ulib_cache *)cache->gclist.next)
+            if (cache->image == image)
+                goto einval;
+    }
+
     if (size < ULIB_CACHE_OBJECT_SIZE_MIN)
         size = ULIB_CACHE_OBJECT_SIZE_MIN;
 
     if (align < ULIB_CACHE_OBJECT_ALIGN_MIN)
-        size = ULIB_CACHE_OBJECT_ALIGN_MIN;
+        align = ULIB_CACHE_OBJECT_ALIGN_MIN;
+
+    /* Convert the pointer field offsets to a bitmap.  The pointer
+     fields are aligned, so the objects are too.  */
+    if (nptrs) {
+        if (align < sizeof(void *))
+            align = sizeof(void *);
+
+        memset(ptrmap, 0, sizeof(ptrmap));
+        for (i = 0; i < nptrs; i++) {
+            off = offs[i];
+            if (off % sizeof(void *) != 0 || off + sizeof(void *) > size)
+                goto einval;
+
+            off /= sizeof(void *);
+            ptrmap[off / MAP_BITS] |= MAP_BIT(off);
+        }
+    }
 
-    if ((cache = ulib_cache_alloc(&G.cache_cache)) == 0)
+    ulib_spin_lock(&G.lock);
+    cache = ulib_cache_alloc(&G.cache_cache);
+    if (cache && hnd && (handles = ulib_cache_alloc(&G.cache_cache)) == 0) {
+        ulib_cache_free(&G.cache_cache, cache);
+        cache = 0;
+    }
+    ulib_spin_unlock(&G.lock);
+    if (cache == 0)
         return 0;
 
-    cache_init(cache, size, align, ctor, clear, dtor, gc, scan);
+    /* A handle is a single pointer to the object, so the handles of
+     garbage collected objects are collected too and keep their
+     objects alive.  */
+    if (hnd) {
+        memset(ptrmap, 0, sizeof(ptrmap));
+        ptrmap[0] = 1;
+        cache_init(handles,
+                   heap,
+                   sizeof(void *),
+                   sizeof(void *),
+                   0,
+                   0,
+                   0,
+                   0,
+                   gc,
+                   0,
+                   gc,
+                   ptrmap,
+                   0);
+    }
+
+    cache_init(cache,
+               heap,
+               size,
+               align,
+               ctor,
+               clear,
+               dtor,
+               final,
+               gc,
+               scan,
+               nptrs,
+               ptrmap,
+               image);
+    cache->handles = handles;
     return cache;
 
 einval:
@@ -328,11 +694,17 @@ slab_init(ulib_cache *cache, char *ptr) {
 
     ulib_list_init(&slab->list);
     slab->cache = cache;
+    slab->recip = cache->recip;
     slab->free = SLAB_EOL;
-    slab->info = G.gcflag | cache->object_count;
+    slab->info = cache->heap->gcflag | cache->object_count;
+    slab->samples = 0;
 
     /* Clear object status bits.  */
-    memset(ptr, 0, cache->object_count * sizeof(short));
+    memset(ptr, 0, 2 * cache->map_words * sizeof(uintptr_t));
+    ptr += 2 * cache->map_words * sizeof(uintptr_t);
+
+    /* Object control words follow the bitmaps.  */
+    slab->ctl = (unsigned short *)ptr;
     ptr += cache->object_count * sizeof(short);
 
     /* Set the beginning of the object array depending on the next cache
@@ -348,34 +720,96 @@ slab_init(ulib_cache *cache, char *ptr) {
     if (cache->free == (struct slab *)&cache->slabs.next)
         cache->free = slab;
 
+    ULIB_TRACE3(slab_create, (uintptr_t)cache, (uintptr_t)slab, cache->object_count);
     return slab;
 }
 
+/* Check whether the allocation volume since the last collection
+   warrants a new collection.  */
+static inline int
+gc_trigger_p(const ulib_gcheap *heap) {
+    return (heap->trigger_slabs && heap->alloc_slabs >= heap->trigger_slabs)
+           || (heap->threshold && heap->alloc_bytes >= heap->threshold);
+}
+
 /* Find the slab, to which the object PTR belongs.  */
 static inline struct slab *
 object_slab(const void *ptr) {
     return (struct slab *)((uintptr_t)ptr & -ulib_pgsize());
 }
 
-/* Return the index of the object PTR, which belongs to SLAB.  */
+/* Return the index of the object PTR, which belongs to SLAB.  The
+   offset of the object is always an exact multiple of the buffer
+   size, less than a page, thus the multiplication by the rounded up
+   reciprocal yields the exact quotient.  */
 static inline unsigned short
 object_index(const struct slab *slab, const void *ptr) {
-    return ((char *)ptr - (char *)slab->objects) / slab->cache->size;
+    return ((uint64_t)((char *)ptr - (char *)slab->objects) * slab->recip) >> 32;
+}
+
+/* Return the address of the object with INDEX in SLAB.  */
+static inline void *
+object_at(const struct slab *slab, unsigned int index) {
+    return (char *)slab->objects + index * slab->cache->size;
+}
+
+/* Return the index of the least significant bit set in the non-zero
+   bitmap word W.  */
+static inline unsigned int
+map_first(uintptr_t w) {
+#ifdef __GNUC__
+    return __builtin_ctzll(w);
+#else
+    unsigned int n = 0;
+
+    while ((w & 1) == 0) {
+        w >>= 1;
+        n++;
+    }
+    return n;
+#endif
 }
 
+static int gc_collect(ulib_gcheap *heap, int merge, int mark);
+
+/* Allocation profiler sampling rate, zero when disabled.  */
+static atomic_size_t prof_rate;
+
+/* Bytes left to allocate in the current thread until the next
+   sample.  */
+static ULIB_THREAD long long prof_left;
+
+static void prof_sample(ulib_cache *cache, struct slab *slab, void *ptr);
+static int prof_free(void *ptr);
+static int prof_move(void *from, void *to);
+
 /* Allocate an object from a slab cache.  */
 void *
 ulib_cache_alloc(ulib_cache *cache) {
     char *ptr;
     struct slab *slab;
     unsigned short index;
+    ulib_gcheap *heap;
 
-    /* Get a non-empty slab.  Allocate one, if needed.  */
+    /* Get a non-empty slab.  Allocate one, if needed.  A garbage
+     collected cache may first try to reclaim some objects.  */
     slab = cache->free;
     if (slab == (struct slab *)&cache->slabs) {
-        if ((ptr = (char *)ulib_pgalloc()) == 0)
-            return 0;
-        slab = slab_init(cache, ptr);
+        heap = cache->heap;
+        if (!ulib_list_empty_p(&cache->gclist) && gc_trigger_p(heap)) {
+            gc_collect(heap, 0, 1);
+            slab = cache->free;
+        }
+
+        if (slab == (struct slab *)&cache->slabs) {
+            if ((ptr = (char *)ulib_pgalloc()) == 0)
+                return 0;
+            slab = slab_init(cache, ptr);
+            if (!ulib_list_empty_p(&cache->gclist)) {
+                heap->alloc_slabs++;
+                heap->alloc_bytes += ulib_pgsize();
+            }
+        }
     }
 
     /* Allocate an object - either from the slab's free list or from the
@@ -396,9 +830,10 @@ ulib_cache_alloc(ulib_cache *cache) {
         slab->offset = ptr + cache->size;
     }
 
-    /* Mark the object as allocated, unreachable and record allocation
-     frame number.  */
-    slab->ctl[index] = G.gcframe | G.gcflag | ALLOCATED;
+    /* Mark the object as allocated and record allocation frame
+     number.  */
+    ALLOC_WORD(slab, index) |= MAP_BIT(index);
+    slab->ctl[index] = cache->heap->gcframe;
 
     /* Decrement the available objects count.  If the slab became empty,
      advance the cache free list pointer to the next slab.  */
@@ -406,6 +841,11 @@ ulib_cache_alloc(ulib_cache *cache) {
     if (SLAB_COUNT(slab) == 0)
         cache->free = (struct slab *)slab->list.next;
 
+    /* Sample the allocation once in a while.  */
+    if (atomic_load_explicit(&prof_rate, memory_order_relaxed)
+        && (prof_left -= cache->size) < 0)
+        prof_sample(cache, slab, ptr);
+
     return ptr;
 }
 
@@ -421,9 +861,15 @@ ulib_cache_free(ulib_cache *cache, void *ptr) {
     if (cache->clear)
         cache->clear(ptr, cache->usize);
 
-    /* Put the object in front of the slab free list.  This clears the
-     ALLOCATED flag, too.  Increment the slab objects count.  */
+    /* Stop tracking a sampled object.  */
+    if ((slab->info & SAMPLED) && prof_free(ptr) && --slab->samples == 0)
+        slab->info &= ~SAMPLED;
+
+    /* Put the object in front of the slab free list and clear its
+     allocation bit.  */
     index = object_index(slab, ptr);
+    assert(ALLOC_WORD(slab, index) & MAP_BIT(index));
+    ALLOC_WORD(slab, index) &= ~MAP_BIT(index);
     slab->ctl[index] = slab->free;
     slab->free = index;
 
@@ -436,8 +882,11 @@ ulib_cache_free(ulib_cache *cache, void *ptr) {
     }
 
     /* If the slab becomes full, move it at the end of both the cache's
-     free list and the all slabs list.  */
+     free list and the all slabs list.  It holds no samples anymore,
+     even those the profiler failed to record.  */
     else if (SLAB_COUNT(slab) == cache->object_count) {
+        slab->info &= ~SAMPLED;
+        slab->samples = 0;
         if (cache->free == slab)
             cache->free = (struct slab *)slab->list.next;
         ulib_list_remove(&slab->list);
@@ -452,10 +901,11 @@ ulib_cache_free(ulib_cache *cache, void *ptr) {
    destructors of objects, cached there and release the slab's page.
    Full slabs are positioned at the end of the cache's slab list and
    are not intermixed with (partially) empty slabs.  */
-void
-ulib_cache_flush(ulib_cache *cache) {
+static unsigned int
+cache_flush(ulib_cache *cache) {
     struct slab *slab, *prev;
     unsigned short index;
+    unsigned int cnt = 0;
     void *obj;
 
     slab = (struct slab *)cache->slabs.prev;
@@ -474,76 +924,404 @@ ulib_cache_flush(ulib_cache *cache) {
         }
 
         ulib_list_remove(&slab->list);
+        ULIB_TRACE2(slab_release, (uintptr_t)cache, (uintptr_t)slab);
         ulib_pgfree(slab);
+        cnt++;
 
         slab = prev;
     }
+
+    return cnt;
+}
+
+/* Release cached objects in CACHE.  */
+void
+ulib_cache_flush(ulib_cache *cache) {
+    cache_flush(cache);
+    if (cache->handles)
+        cache_flush(cache->handles);
+}
+
+/* Allocate an object and a handle to it.  */
+void **
+ulib_cache_halloc(ulib_cache *cache) {
+    void **hnd, *obj;
+
+    assert(cache->handles != 0);
+    if ((hnd = ulib_cache_alloc(cache->handles)) == 0)
+        return 0;
+
+    /* The handle must survive a collection, triggered by the object
+     allocation.  */
+    *hnd = 0;
+    ULIB_GC_ROOT_SCOPE_BEGIN
+    ULIB_GC_ROOT(hnd);
+    obj = ulib_cache_alloc(cache);
+    ULIB_GC_ROOT_SCOPE_END
+
+    if (obj == 0) {
+        ulib_cache_free(cache->handles, hnd);
+        return 0;
+    }
+
+    *hnd = obj;
+    return hnd;
+}
+
+/* Release an object and its handle.  */
+void
+ulib_cache_hfree(ulib_cache *cache, void **hnd) {
+    ulib_cache_free(cache, *hnd);
+    ulib_cache_free(cache->handles, hnd);
+}
+
+/* Move the object OBJ to a free place in the slab DST.  Return the new
+   address of the object.  No constructors are involved, so the object
+   is just copied, keeping its allocation frame, and its old place is
+   put on the free list of its slab, without clearing it.  The slab
+   lists are not maintained - ``ulib_cache_compact'' reorders them
+   afterwards.  */
+static void *
+compact_move(ulib_cache *cache, struct slab *dst, void *obj) {
+    struct slab *src;
+    unsigned short index, from;
+    char *ptr;
+
+    src = object_slab(obj);
+    from = object_index(src, obj);
+
+    if ((index = dst->free) != SLAB_EOL) {
+        ptr = (char *)dst->objects + index * cache->size;
+        dst->free = dst->ctl[index];
+    } else {
+        index = cache->object_count - SLAB_COUNT(dst);
+        ptr = dst->offset;
+        dst->offset = ptr + cache->size;
+    }
+
+    memcpy(ptr, obj, cache->usize);
+    ALLOC_WORD(dst, index) |= MAP_BIT(index);
+    dst->ctl[index] = src->ctl[from];
+    dst->info--;
+
+    /* The object stays live, so its sample follows it.  */
+    if ((src->info & SAMPLED) && prof_move(obj, ptr)) {
+        if (--src->samples == 0)
+            src->info &= ~SAMPLED;
+        dst->samples++;
+        dst->info |= SAMPLED;
+    }
+
+    ALLOC_WORD(src, from) &= ~MAP_BIT(from);
+    src->ctl[from] = src->free;
+    src->free = from;
+    src->info++;
+
+    return ptr;
+}
+
+/* Defragment the slabs of a cache with handles.  */
+int
+ulib_cache_compact(ulib_cache *cache) {
+    struct slab *slab, *dst;
+    ulib_cache *handles = cache->handles;
+    ulib_list tmp;
+    unsigned int *hist, live, total = 0, keep, thresh, w, index, pass;
+    uintptr_t alloc;
+    void **hnd;
+
+    assert(handles != 0);
+    if ((hist = calloc(cache->object_count + 1, sizeof(unsigned int))) == 0)
+        return -1;
+
+    /* Count the slabs by the number of allocated objects.  */
+    for (slab = (struct slab *)cache->slabs.next; slab != (struct slab *)&cache->slabs;
+         slab = (struct slab *)slab->list.next) {
+        live = cache->object_count - SLAB_COUNT(slab);
+        hist[live]++;
+        total += live;
+    }
+
+    /* All the allocated objects fit in KEEP slabs.  Keep the densest
+     ones - those with more than THRESH allocated objects and enough of
+     those with exactly THRESH - and evacuate the rest.  */
+    keep = (total + cache->object_count - 1) / cache->object_count;
+    for (thresh = cache->object_count; thresh > 0 && keep > hist[thresh]; thresh--)
+        keep -= hist[thresh];
+    free(hist);
+
+    for (slab = (struct slab *)cache->slabs.next; slab != (struct slab *)&cache->slabs;
+         slab = (struct slab *)slab->list.next) {
+        live = cache->object_count - SLAB_COUNT(slab);
+        if (live == 0 || live > thresh)
+            continue;
+        if (live == thresh && keep > 0)
+            keep--;
+        else
+            slab->info |= MOVING;
+    }
+
+    /* Find the handles of the objects in the evacuated slabs and move
+     the objects to the free places in the kept slabs.  Objects without
+     a handle, e.g. ones, pending finalization, stay in place.  */
+    dst = (struct slab *)cache->slabs.next;
+    for (slab = (struct slab *)handles->slabs.next; slab != (struct slab *)&handles->slabs;
+         slab = (struct slab *)slab->list.next) {
+        for (w = 0; w < handles->map_words; w++) {
+            for (alloc = ALLOC_WORD(slab, w * MAP_BITS); alloc; alloc &= alloc - 1) {
+                index = w * MAP_BITS + map_first(alloc);
+                hnd = (void **)object_at(slab, index);
+                if (*hnd == 0 || (object_slab(*hnd)->info & MOVING) == 0)
+                    continue;
+
+                while ((dst->info & MOVING) || SLAB_COUNT(dst) == 0
+                       || SLAB_COUNT(dst) == cache->object_count)
+                    dst = (struct slab *)dst->list.next;
+                assert(dst != (struct slab *)&cache->slabs);
+
+                *hnd = compact_move(cache, dst, *hnd);
+            }
+        }
+    }
+
+    /* Restore the order of the slab lists - the slabs without free
+     objects first, then the partially free ones, then the free ones.  */
+    ulib_list_init(&tmp);
+    while (!ulib_list_empty_p(&cache->slabs)) {
+        slab = (struct slab *)cache->slabs.next;
+        slab->info &= ~MOVING;
+        ulib_list_remove(&slab->list);
+        ulib_list_insert(&tmp, &slab->list);
+    }
+
+    cache->free = (struct slab *)&cache->slabs;
+    for (pass = 0; pass < 3; pass++) {
+        slab = (struct slab *)tmp.next;
+        while (slab != (struct slab *)&tmp) {
+            dst = (struct slab *)slab->list.next;
+            if (pass == 2 || (pass == 0 && SLAB_COUNT(slab) == 0)
+                || (pass == 1 && SLAB_COUNT(slab) < cache->object_count)) {
+                ulib_list_remove(&slab->list);
+                ulib_list_insert(&cache->slabs, &slab->list);
+                if (pass > 0 && cache->free == (struct slab *)&cache->slabs)
+                    cache->free = slab;
+            }
+            slab = dst;
+        }
+    }
+
+    return cache_flush(cache);
+}
+
+/* Return the allocation frame of the cached object OBJ.  */
+static inline unsigned short
+object_frame(const void *obj) {
+    const struct slab *slab = object_slab(obj);
+
+    return slab->ctl[object_index(slab, obj)];
+}
+
+/* Record, that objects of FRAME of HEAP may have escaped it.  Called
+   with the heap lock held.  */
+static inline void
+gc_escape(ulib_gcheap *heap, unsigned short frame) {
+    if (frame > heap->dirty)
+        heap->dirty = frame;
+}
+
+/* Record the escape of a cached object.  */
+void
+ulib_gcescape(void *obj) {
+    ulib_gcheap *heap = object_slab(obj)->cache->heap;
+
+    ulib_spin_lock(&heap->lock);
+    gc_escape(heap, object_frame(obj));
+    ulib_spin_unlock(&heap->lock);
+}
+
+/* Store a pointer to a cached object, recording its escape.  The frame
+   of OBJ is checked first, as once a frame has escapes, further stores
+   of its objects need no recording.  */
+void
+ulib_gcstore(void *holder, void **field, void *obj) {
+    ulib_gcheap *heap;
+    unsigned short frame;
+
+    *field = obj;
+    if (obj == 0)
+        return;
+
+    heap = object_slab(obj)->cache->heap;
+    frame = object_frame(obj);
+    if (frame > heap->dirty
+        && (holder == 0 || object_slab(holder)->cache->heap != heap
+            || object_frame(holder) < frame)) {
+        ulib_spin_lock(&heap->lock);
+        gc_escape(heap, frame);
+        ulib_spin_unlock(&heap->lock);
+    }
 }
 
-/* Helper function to allocate and register a root object.  */
+/* Helper function to allocate and register a root object, a weak
+   reference or a shared object in the TREE of HEAP.  Called with the
+   heap lock held.  */
 static root_tree *
-gcroot(void *obj) {
+gcroot(ulib_gcheap *heap, root_tree **tree, void *obj) {
     int root_already_registered;
     root_tree *root;
 
-    if (!cache_initialized)
-        init_cache();
-
-    if ((root = ulib_cache_alloc(&G.root_cache)) == 0)
+    if ((root = ulib_cache_alloc(&heap->root_cache)) == 0)
         return 0;
     root->key = obj;
 
-    if (G.roots)
-        ulib_list_insert(&G.roots->data.list, &root->data.list);
+    if (*tree)
+        ulib_list_insert(&(*tree)->data.list, &root->data.list);
 
-    root_already_registered = root_tree_insert(&G.roots, root);
+    root_already_registered = root_tree_insert(tree, root);
     assert(root_already_registered == 0);
 
     return root;
 }
 
+/* Helper function to unregister and release the registration of OBJ
+   in the TREE of HEAP.  Called with the heap lock held.  */
+static void
+gcunroot(ulib_gcheap *heap, root_tree **tree, void *obj) {
+    root_tree *root;
+
+    root = root_tree_delete(tree, obj);
+    assert(root != 0);
+
+    ulib_list_remove(&root->data);
+    ulib_cache_free(&heap->root_cache, root);
+}
+
 /* Register a non-cached root object.  */
 int
 ulib_gcroot(void *obj, ulib_gcscan_func scan) {
+    ulib_gcheap *heap;
     root_tree *root;
 
-    if ((root = gcroot(obj)) == 0)
-        return -1;
+    heap = gc_heap();
+    ulib_spin_lock(&heap->lock);
+    if ((root = gcroot(heap, &heap->roots, obj)) != 0) {
+        root->data.scan = scan;
+        root->data.cached = 0;
+    }
+    ulib_spin_unlock(&heap->lock);
 
-    root->data.scan = scan;
-    root->data.cached = 0;
-    return 0;
+    return root ? 0 : -1;
 }
 
 /* Register a cached root object.  */
 int
 ulib_gcroot_cached(void *obj) {
+    ulib_gcheap *heap;
     root_tree *root;
 
-    if ((root = gcroot(obj)) == 0)
-        return -1;
-    root->data.scan = object_slab(obj)->cache->scan;
-    root->data.cached = 1;
-    return 0;
+    heap = gc_heap();
+    ulib_spin_lock(&heap->lock);
+    if ((root = gcroot(heap, &heap->roots, obj)) != 0) {
+        root->data.scan = 0;
+        root->data.cached = 1;
+        gc_escape(heap, object_frame(obj));
+    }
+    ulib_spin_unlock(&heap->lock);
+
+    return root ? 0 : -1;
 }
 
 /* Unregister a root object.  */
 void
 ulib_gcunroot(void *ptr) {
+    ulib_gcheap *heap;
+
+    heap = gc_heap();
+    ulib_spin_lock(&heap->lock);
+    gcunroot(heap, &heap->roots, ptr);
+    ulib_spin_unlock(&heap->lock);
+}
+
+/* Register a weak reference.  */
+int
+ulib_gcweak(void **slot, ulib_gcweak_func notify) {
+    ulib_gcheap *heap;
     root_tree *root;
 
-    root = root_tree_delete(&G.roots, ptr);
-    assert(root != 0);
+    heap = gc_heap();
+    ulib_spin_lock(&heap->lock);
+    if ((root = gcroot(heap, &heap->weaks, slot)) != 0)
+        root->data.notify = notify;
+    ulib_spin_unlock(&heap->lock);
 
-    ulib_list_remove(&root->data);
-    ulib_cache_free(&G.root_cache, root);
+    return root ? 0 : -1;
+}
+
+/* Unregister a weak reference.  */
+void
+ulib_gcunweak(void **slot) {
+    ulib_gcheap *heap;
+
+    heap = gc_heap();
+    ulib_spin_lock(&heap->lock);
+    gcunroot(heap, &heap->weaks, slot);
+    ulib_spin_unlock(&heap->lock);
+}
+
+/* Share a cached object with other threads.  */
+int
+ulib_gcshare(void *obj) {
+    ulib_gcheap *heap;
+    root_tree *root;
+    int ret = 0;
+
+    heap = object_slab(obj)->cache->heap;
+    ulib_spin_lock(&heap->lock);
+    gc_escape(heap, object_frame(obj));
+    root = heap->shared = root_tree_splay(heap->shared, obj);
+    if (root && root->key == obj)
+        root->data.shares++;
+    else if ((root = gcroot(heap, &heap->shared, obj)) != 0) {
+        root->data.cached = 1;
+        root->data.shares = 1;
+    } else
+        ret = -1;
+    ulib_spin_unlock(&heap->lock);
+
+    return ret;
+}
+
+/* Stop sharing a cached object.  */
+void
+ulib_gcunshare(void *obj) {
+    ulib_gcheap *heap;
+    root_tree *root;
+
+    heap = object_slab(obj)->cache->heap;
+    ulib_spin_lock(&heap->lock);
+    root = heap->shared = root_tree_splay(heap->shared, obj);
+    assert(root != 0 && root->key == obj && root->data.shares > 0);
+    if (--root->data.shares == 0)
+        gcunroot(heap, &heap->shared, obj);
+    ulib_spin_unlock(&heap->lock);
 }
 
+/* Number of objects in flight in the mark prefetch queue.  Must be a
+   power of two.  */
+#define GC_PREFETCH_DEPTH 8
+
 /* Can't portably use nested functions ... *sigh* ... */
 struct gc_mark_frame {
+    ulib_gcheap *heap;
     void **objs;
     unsigned int n;
     unsigned int sz;
+
+    /* Prefetch queue - objects, popped off the pending stack, for
+     which a prefetch was issued, but which are not marked yet.  */
+    void *fifo[GC_PREFETCH_DEPTH];
+    unsigned int head;
+    unsigned int count;
 };
 
 /* Scan OBJ (by invoking the SCAN function) for references to garbage
@@ -569,160 +1347,1624 @@ gc_scan_obj(ulib_gcscan_func scan, void *obj, struct gc_mark_frame *frm) {
         assert(cnt > 0);
     }
     frm->n += cnt;
+    if (frm->n > frm->heap->cycle.mark_stack_max)
+        frm->heap->cycle.mark_stack_max = frm->n;
     return 0;
 }
 
-/* Perform the mark phase of the collector.  The mark process starts
-   at each registered root and proceeds in depth first search order
-   over the objects interreference graph.  An object is scanned iff it
-   is allocated and not visited yet, i.e. its reachability status
-   differs from the current reachability flag.  The array OBJS is used
-   in a stack-like fashion to keep track of the objects pending
-   scanning.  */
+/* Scan OBJ according to the layout descriptor of its CACHE.  Make
+   room for all the pointer fields upfront, then copy each non-null
+   one to the pending objects array.  */
 static int
-gc_mark() {
-    void *obj;
-    struct slab *slab;
-    unsigned short index;
-    struct gc_mark_frame frm;
-    root_tree *head, *root;
+gc_scan_layout(const ulib_cache *cache, void *obj, struct gc_mark_frame *frm) {
+    unsigned int w, i, sz;
+    uintptr_t ptrs;
+    void **objs, **fld, *ptr;
 
-    if ((head = G.roots) == 0)
-        return 0;
+    if (frm->sz - frm->n < cache->nptrs) {
+        sz = 2 * frm->sz;
+        if (sz < frm->n + cache->nptrs)
+            sz = frm->n + cache->nptrs;
 
-    frm.objs = 0;
-    frm.sz = 0;
-    root = head;
-    do {
-        frm.n = 0;
-        /* Scan the root object.  */
-        if (root->data.cached == 0) {
-            if (gc_scan_obj(root->data.scan, root->key, &frm) < 0)
-                goto error;
-        } else {
-            slab = object_slab(root->key);
-            index = object_index(slab, root->key);
-            assert(slab->ctl[index] & ALLOCATED);
+        if ((objs = realloc(frm->objs, sz * sizeof(void *))) == 0)
+            return -1;
 
-            if ((slab->ctl[index] & GCFLAG) != G.gcflag) {
-                slab->ctl[index] ^= GCFLAG;
-                if (gc_scan_obj(root->data.scan, root->key, &frm) < 0)
-                    goto error;
-            }
-        }
+        frm->sz = sz;
+        frm->objs = objs;
+    }
 
-        /* Scan pending objects.  */
-        while (frm.n--) {
-            obj = frm.objs[frm.n];
-            slab = object_slab(obj);
-            index = object_index(slab, obj);
-
-            if ((slab->ctl[index] & ALLOCATED)
-                && (slab->ctl[index] & GCFLAG) != G.gcflag) {
-                slab->ctl[index] ^= GCFLAG;
-                if (slab->cache->scan && gc_scan_obj(slab->cache->scan, obj, &frm) < 0)
-                    goto error;
-            }
+    fld = (void **)obj;
+    objs = frm->objs + frm->n;
+    for (w = 0; w < PTRMAP_WORDS; w++) {
+        for (ptrs = cache->ptrmap[w]; ptrs; ptrs &= ptrs - 1) {
+            i = w * MAP_BITS + map_first(ptrs);
+            if ((ptr = fld[i]) != 0)
+                *objs++ = ptr;
         }
+    }
 
-        root = (root_tree *)((char *)root->data.list.next - offsetof(root_tree, data));
-    } while (root != head);
-
-    free(frm.objs);
+    frm->n = objs - frm->objs;
+    if (frm->n > frm->heap->cycle.mark_stack_max)
+        frm->heap->cycle.mark_stack_max = frm->n;
     return 0;
+}
 
-error:
-    free(frm.objs);
-    return -1;
+/* Scan the cached object OBJ, which belongs to CACHE, either by its
+   layout descriptor or by its scan function.  */
+static inline int
+gc_scan_cached(const ulib_cache *cache, void *obj, struct gc_mark_frame *frm) {
+    if (cache->nptrs)
+        return gc_scan_layout(cache, obj, frm);
+    else if (cache->scan)
+        return gc_scan_obj(cache->scan, obj, frm);
+    else
+        return 0;
 }
 
-/* Perform the sweep phase of the collector.  Traverse the allocated
-   objects in each slab of each garbage collected cache.  Free each
-   object with clear reachability flag and frame number equal to the
-   current one.  Toggle the reachability flag of the rest of the
-   objects, so it remains consistent for the next mark phase.  If the
-   MERGE parameter is true, decrement the frame number of each
-   reachable object, which belongs to the current frame, effectively
-   merging the current allocation frame into the previous one.  */
-static void
-gc_sweep(int merge) {
-    void *obj;
-    struct slab *slab, *next;
-    ulib_cache *cache;
-    unsigned int n;
-    unsigned short ctl;
+/* Mark the pending object OBJ as reachable and scan it, unless it was
+   already visited.  Objects of other heaps are neither marked, nor
+   scanned.  */
+static inline int
+gc_mark_obj(void *obj, struct gc_mark_frame *frm) {
+    struct slab *slab;
+    unsigned short index;
+    uintptr_t bit;
 
-    for (cache = (ulib_cache *)G.gchead.next; cache != (ulib_cache *)&G.gchead;
-         cache = (ulib_cache *)cache->gclist.next) {
-        slab = (struct slab *)cache->slabs.next;
-        while (slab != (struct slab *)&cache->slabs) {
-            next = (struct slab *)slab->list.next;
+    slab = object_slab(obj);
+    if (slab->cache->heap != frm->heap)
+        return 0;
 
-            n = cache->object_count;
-            if (SLAB_COUNT(slab) < n && (slab->info & GCFLAG) != G.gcflag) {
-                slab->info ^= GCFLAG;
+    index = object_index(slab, obj);
+    bit = MAP_BIT(index);
+
+    if ((ALLOC_WORD(slab, index) & ~MARK_WORD(slab, index)) & bit) {
+        MARK_WORD(slab, index) |= bit;
+        frm->heap->cycle.objects_scanned++;
+        if (gc_scan_cached(slab->cache, obj, frm) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Mark all the objects, reachable from the pending objects stack.
+   Objects are popped off the stack and a prefetch is issued for the
+   slab control data and for the object itself.  The object is then
+   placed in a small FIFO queue and it is actually marked and scanned
+   only after GC_PREFETCH_DEPTH more objects have entered the queue,
+   so the memory latency of several objects is overlapped.  */
+static int
+gc_mark_pending(struct gc_mark_frame *frm) {
+    void *obj;
+
+    while (frm->n || frm->count) {
+        if (frm->n && frm->count < GC_PREFETCH_DEPTH) {
+            obj = frm->objs[--frm->n];
+            ulib_prefetch(object_slab(obj), 1);
+            ulib_prefetch(obj, 0);
+
+            frm->fifo[(frm->head + frm->count++) & (GC_PREFETCH_DEPTH - 1)] = obj;
+            continue;
+        }
+
+        obj = frm->fifo[frm->head];
+        frm->head = (frm->head + 1) & (GC_PREFETCH_DEPTH - 1);
+        frm->count--;
+
+        if (gc_mark_obj(obj, frm) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Mark the objects, reachable from the registered roots in the
+   circular list, starting at HEAD.  */
+static int
+gc_mark_roots(root_tree *head, struct gc_mark_frame *frm) {
+    struct slab *slab;
+    unsigned short index;
+    root_tree *root;
+
+    if ((root = head) == 0)
+        return 0;
+
+    do {
+        /* Scan the root object.  */
+        if (root->data.cached == 0) {
+            if (gc_scan_obj(root->data.scan, root->key, frm) < 0)
+                return -1;
+        } else {
+            slab = object_slab(root->key);
+            index = object_index(slab, root->key);
+            assert(slab->cache->heap == frm->heap);
+            assert(ALLOC_WORD(slab, index) & MAP_BIT(index));
+
+            if ((MARK_WORD(slab, index) & MAP_BIT(index)) == 0) {
+                MARK_WORD(slab, index) |= MAP_BIT(index);
+                frm->heap->cycle.objects_scanned++;
+                if (gc_scan_cached(slab->cache, root->key, frm) < 0)
+                    return -1;
+            }
+        }
+
+        /* Scan pending objects.  */
+        if (gc_mark_pending(frm) < 0)
+            return -1;
+
+        root = (root_tree *)((char *)root->data.list.next - offsetof(root_tree, data));
+    } while (root != head);
+
+    return 0;
+}
+
+/* Perform the mark phase of the collector for HEAP.  The mark process
+   starts at each registered root and proceeds in (approximately) depth
+   first search order over the objects interreference graph.  The roots
+   are the registered root objects, the shared objects and the objects,
+   referred to by the shadow stack of the current thread.  An object is
+   scanned iff it belongs to the heap, is allocated and not visited
+   yet, i.e. its reachability bit is clear.  The array OBJS is used in
+   a stack-like fashion to keep track of the objects pending
+   scanning.  */
+static int
+gc_mark(ulib_gcheap *heap) {
+    void *obj;
+    unsigned int i;
+    struct gc_mark_frame frm;
+    int ret = 0;
+
+    frm.heap = heap;
+    frm.objs = 0;
+    frm.n = 0;
+    frm.sz = 0;
+    frm.head = frm.count = 0;
+
+    /* Scan the shadow stack roots.  */
+    for (i = 0; i < ulib_gcshadow.top; i++) {
+        if ((obj = *ulib_gcshadow.slot[i]) == 0)
+            continue;
+
+        if (gc_mark_obj(obj, &frm) < 0 || gc_mark_pending(&frm) < 0) {
+            free(frm.objs);
+            return -1;
+        }
+    }
+
+    /* Scan the registered and the shared roots.  */
+    ulib_spin_lock(&heap->lock);
+    if (gc_mark_roots(heap->roots, &frm) < 0 || gc_mark_roots(heap->shared, &frm) < 0)
+        ret = -1;
+    ulib_spin_unlock(&heap->lock);
+
+    ULIB_TRACE2(gc_mark, (uintptr_t)heap, heap->cycle.objects_scanned);
+    free(frm.objs);
+    return ret;
+}
+
+/* Return whether the weak reference WEAK of HEAP points to an object,
+   which is about to be freed by the sweep phase, i.e. an unreachable
+   object of the current frame, and store the object at *OBJ.  */
+static int
+gc_weak_dead(ulib_gcheap *heap, root_tree *weak, void **obj) {
+    struct slab *slab;
+    unsigned short index;
+
+    if ((*obj = *(void **)weak->key) == 0
+        || (slab = object_slab(*obj))->cache->heap != heap)
+        return 0;
+
+    index = object_index(slab, *obj);
+    assert(ALLOC_WORD(slab, index) & MAP_BIT(index));
+    return (MARK_WORD(slab, index) & MAP_BIT(index)) == 0
+           && slab->ctl[index] == heap->gcframe;
+}
+
+/* Step to the next weak reference in the list.  */
+static inline root_tree *
+gc_weak_next(root_tree *weak) {
+    return (root_tree *)((char *)weak->data.list.next - offsetof(root_tree, data));
+}
+
+/* Clear the weak references to the objects, which are about to be
+   freed by the sweep phase, and invoke their notification functions.
+   The slots are cleared under the heap lock, and the notifications
+   run after it is released, so they may register or unregister weak
+   references and roots.  Return negative if out of memory, in which
+   case no reference is cleared.  */
+static int
+gc_clear_weak(ulib_gcheap *heap) {
+    struct weak_note *notes;
+    unsigned int i, n = 0;
+    root_tree *head, *weak;
+    void *obj;
+
+    ulib_spin_lock(&heap->lock);
+    if ((head = heap->weaks) == 0) {
+        ulib_spin_unlock(&heap->lock);
+        return 0;
+    }
+
+    /* Make room for the notifications first, so that running out of
+       memory leaves the references alone.  */
+    weak = head;
+    do {
+        n += weak->data.notify && gc_weak_dead(heap, weak, &obj);
+        weak = gc_weak_next(weak);
+    } while (weak != head);
+
+    if (n > heap->notes_sz) {
+        if ((notes = realloc(heap->notes, n * sizeof(struct weak_note))) == 0) {
+            ulib_spin_unlock(&heap->lock);
+            return -1;
+        }
+        heap->notes = notes;
+        heap->notes_sz = n;
+    }
+
+    n = 0;
+    weak = head;
+    do {
+        if (gc_weak_dead(heap, weak, &obj)) {
+            *(void **)weak->key = 0;
+            heap->cycle.weak_cleared++;
+            if (weak->data.notify) {
+                heap->notes[n].slot = (void **)weak->key;
+                heap->notes[n].obj = obj;
+                heap->notes[n++].notify = weak->data.notify;
+            }
+        }
+        weak = gc_weak_next(weak);
+    } while (weak != head);
+    ulib_spin_unlock(&heap->lock);
+
+    for (i = 0; i < n; i++)
+        heap->notes[i].notify(heap->notes[i].slot, heap->notes[i].obj);
+    return 0;
+}
+
+/* Clear the reachability bits of all the objects.  Used to restore
+   the invariant, that the mark bitmaps are clear between collections,
+   after an unsuccessful mark phase.  */
+static void
+gc_clear_marks(ulib_gcheap *heap) {
+    struct slab *slab;
+    ulib_cache *cache;
+    unsigned int w;
+
+    for (cache = (ulib_cache *)heap->gchead.next; cache != (ulib_cache *)&heap->gchead;
+         cache = (ulib_cache *)cache->gclist.next) {
+        for (slab = (struct slab *)cache->slabs.next;
+             slab != (struct slab *)&cache->slabs;
+             slab = (struct slab *)slab->list.next)
+            for (w = 0; w < cache->map_words; w++)
+                slab->map[2 * w + 1] = 0;
+    }
+}
+
+/* Queue the object with INDEX in SLAB for finalization in HEAP.
+   Return negative if the queue cannot grow, in which case the
+   finalizer is run immediately.  */
+static int
+gc_final_enqueue(ulib_gcheap *heap, struct slab *slab, unsigned int index) {
+    void *obj, **final;
+    unsigned int sz;
 
-                obj = (char *)slab->objects + n * cache->size;
-                while (n--) {
-                    ctl = slab->ctl[n];
-                    obj = (char *)obj - cache->size;
+    obj = object_at(slab, index);
+    if (heap->final_n == heap->final_sz) {
+        if (heap->final_head > 0) {
+            memmove(heap->final,
+                    heap->final + heap->final_head,
+                    (heap->final_n - heap->final_head) * sizeof(void *));
+            heap->final_n -= heap->final_head;
+            heap->final_head = 0;
+        } else {
+            sz = heap->final_sz ? 2 * heap->final_sz : 64;
+            if ((final = realloc(heap->final, sz * sizeof(void *))) == 0) {
+                slab->cache->final(obj, slab->cache->usize);
+                return -1;
+            }
+            heap->final = final;
+            heap->final_sz = sz;
+        }
+    }
+
+    slab->ctl[index] = FINAL_FRAME;
+    heap->final[heap->final_n++] = obj;
+    return 0;
+}
 
-                    if ((ctl & ALLOCATED) == 0)
-                        continue;
+/* Sweep a single SLAB.  Compute the unreachable objects a bitmap word
+   at a time and free those, allocated in the current frame.  Clear
+   the reachability bits.  */
+static void
+gc_sweep_slab(ulib_cache *cache, struct slab *slab, int merge) {
+    ulib_gcheap *heap = cache->heap;
+    unsigned int w, index;
+    uintptr_t *map, dead, live;
+
+    for (w = 0; w < cache->map_words; w++) {
+        map = slab->map + 2 * w;
+        dead = map[0] & ~map[1];
+        live = map[0] & map[1];
+        map[1] = 0;
+
+        while (dead) {
+            index = w * MAP_BITS + map_first(dead);
+            dead &= dead - 1;
+            if (slab->ctl[index] == heap->gcframe) {
+                if (cache->final == 0 || gc_final_enqueue(heap, slab, index) < 0)
+                    ulib_cache_free(cache, object_at(slab, index));
+                heap->cycle.objects_freed++;
+                heap->cycle.bytes_freed += cache->size;
+            }
+        }
+
+        while (merge && live) {
+            index = w * MAP_BITS + map_first(live);
+            live &= live - 1;
+            if (slab->ctl[index] == heap->gcframe)
+                slab->ctl[index] = heap->gcframe - 1;
+        }
+    }
+}
 
-                    if ((ctl & GCFLAG) != G.gcflag)
-                        slab->ctl[n] ^= GCFLAG;
+/* Perform the sweep phase of the collector.  Traverse the allocated
+   objects in each slab of each garbage collected cache of HEAP.  Free each
+   unreachable object with frame number equal to the current one.
+   Clear the reachability bits of the rest of the objects, so they are
+   ready for the next mark phase.  If the MERGE parameter is true,
+   decrement the frame number of each reachable object, which belongs
+   to the current frame, effectively merging the current allocation
+   frame into the previous one.  */
+static void
+gc_sweep(ulib_gcheap *heap, int merge) {
+    struct slab *slab, *next;
+    ulib_cache *cache;
 
-                    if ((ctl & FRAME_MASK) != G.gcframe)
-                        continue;
+    for (cache = (ulib_cache *)heap->gchead.next; cache != (ulib_cache *)&heap->gchead;
+         cache = (ulib_cache *)cache->gclist.next) {
+        slab = (struct slab *)cache->slabs.next;
+        while (slab != (struct slab *)&cache->slabs) {
+            next = (struct slab *)slab->list.next;
 
-                    if ((ctl & GCFLAG) != G.gcflag)
-                        ulib_cache_free(cache, obj);
-                    else if (merge)
-                        slab->ctl[n] = (G.gcframe - 1) | G.gcflag | ALLOCATED;
+            /* Freeing objects may move the slab towards the end of the
+             list, so skip slabs, which were already visited.  */
+            if ((slab->info & GCFLAG) != heap->gcflag) {
+                slab->info ^= GCFLAG;
+                if (SLAB_COUNT(slab) < cache->object_count) {
+                    gc_sweep_slab(cache, slab, merge);
+                    heap->heap_live +=
+                        (cache->object_count - SLAB_COUNT(slab)) * cache->size;
                 }
             }
 
             slab = next;
         }
-        ulib_cache_flush(cache);
+        heap->cycle.slabs_released += cache_flush(cache);
     }
+
+    ULIB_TRACE4(gc_sweep,
+                (uintptr_t)heap,
+                heap->cycle.objects_freed,
+                heap->cycle.bytes_freed,
+                heap->cycle.slabs_released);
+}
+
+/* Return the pause time histogram bucket for a pause of NS
+   nanoseconds.  */
+static unsigned int
+gc_pause_bucket(unsigned long long ns) {
+    unsigned int n = 0;
+
+    for (ns /= 1000; ns > 1 && n < ULIB_GCSTATS_BUCKETS - 1; ns >>= 1)
+        n++;
+    return n;
+}
+
+/* Add the counters of the just completed collection to the
+   statistics.  Concurrent readers retry their copy if they observe an
+   odd or a changed sequence counter.  */
+static void
+gc_stats_update(ulib_gcheap *heap) {
+    ulib_gcstats *st = &heap->stats;
+    const ulib_gccycle *c = &heap->cycle;
+    unsigned long long pause;
+    unsigned int seq;
+
+    pause = c->mark_time + c->sweep_time;
+
+    seq = atomic_load_explicit(&heap->stats_seq, memory_order_relaxed);
+    atomic_store_explicit(&heap->stats_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    st->last = *c;
+    st->heap_live = heap->heap_live;
+    st->total.mark_time += c->mark_time;
+    st->total.sweep_time += c->sweep_time;
+    st->total.objects_scanned += c->objects_scanned;
+    st->total.objects_freed += c->objects_freed;
+    st->total.bytes_freed += c->bytes_freed;
+    st->total.slabs_released += c->slabs_released;
+    st->total.weak_cleared += c->weak_cleared;
+    if (c->mark_stack_max > st->total.mark_stack_max)
+        st->total.mark_stack_max = c->mark_stack_max;
+    if (pause > st->pause_max)
+        st->pause_max = pause;
+    st->pause_hist[gc_pause_bucket(pause)]++;
+    st->pause_recent[st->collections % ULIB_GCSTATS_RECENT] = pause;
+    st->collections++;
+
+    atomic_store_explicit(&heap->stats_seq, seq + 2, memory_order_release);
+}
+
+/* Get a consistent snapshot of the garbage collector statistics of
+   HEAP.  */
+void
+ulib_gcheap_stats_get(ulib_gcheap *heap, ulib_gcstats *st) {
+    unsigned int seq;
+
+    do {
+        seq = atomic_load_explicit(&heap->stats_seq, memory_order_acquire);
+        memcpy(st, &heap->stats, sizeof(ulib_gcstats));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1)
+             || seq != atomic_load_explicit(&heap->stats_seq, memory_order_relaxed));
+}
+
+/* Get a consistent snapshot of the garbage collector statistics.  */
+void
+ulib_gcstats_get(ulib_gcstats *st) {
+    ulib_gcheap_stats_get(gc_heap(), st);
+}
+
+/* Reset the garbage collector statistics.  */
+void
+ulib_gcstats_reset() {
+    ulib_gcheap *heap = gc_heap();
+    unsigned int seq;
+
+    seq = atomic_load_explicit(&heap->stats_seq, memory_order_relaxed);
+    atomic_store_explicit(&heap->stats_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memset(&heap->stats, 0, sizeof(ulib_gcstats));
+
+    atomic_store_explicit(&heap->stats_seq, seq + 2, memory_order_release);
+}
+
+/* Compute the byte limit for the next automatic collection.  */
+static void
+gc_trigger_update(ulib_gcheap *heap) {
+    size_t grown;
+
+    heap->threshold = heap->trigger_bytes;
+    grown = heap->heap_live / 100 * heap->growth
+            + heap->heap_live % 100 * heap->growth / 100;
+    if (heap->threshold && grown > heap->threshold)
+        heap->threshold = grown;
+}
+
+/* Set garbage collector parameters.  */
+int
+ulib_gcconfig(int attr, ...) {
+    va_list ap;
+    ulib_gcheap *heap;
+    int escapes;
+
+    heap = gc_heap();
+
+    va_start(ap, attr);
+    do {
+        switch (attr) {
+        case ULIB_GC_TRIGGER_BYTES:
+            heap->trigger_bytes = va_arg(ap, size_t);
+            break;
+
+        case ULIB_GC_TRIGGER_SLABS:
+            heap->trigger_slabs = va_arg(ap, unsigned int);
+            break;
+
+        case ULIB_GC_GROWTH:
+            heap->growth = va_arg(ap, unsigned int);
+            break;
+
+        case ULIB_GC_ESCAPES:
+            /* Escapes, which weren't recorded, may exist in all the
+             current frames.  */
+            escapes = va_arg(ap, unsigned int) != 0;
+            ulib_spin_lock(&heap->lock);
+            if (escapes && !heap->escapes)
+                heap->dirty = heap->gcframe;
+            heap->escapes = escapes;
+            ulib_spin_unlock(&heap->lock);
+            break;
+
+        case 0:
+            break;
+
+        default:
+            va_end(ap);
+            errno = EINVAL;
+            return -1;
+        }
+        attr = va_arg(ap, unsigned int);
+    } while (attr);
+    va_end(ap);
+
+    gc_trigger_update(heap);
+    return 0;
+}
+
+/* Perform a collection of HEAP.  If the MERGE parameter is true, merge the
+   live objects of the current allocation frame into the previous
+   one.  If the MARK parameter is false, skip the mark phase, freeing
+   all the objects of the current frame.  Return negative if the mark
+   phase or the clearing of the weak references ran out of memory, in
+   which case no objects are freed.  */
+static int
+gc_collect(ulib_gcheap *heap, int merge, int mark) {
+    unsigned long long t0, t1;
+
+    ULIB_TRACE3(gc_start, (uintptr_t)heap, heap->gcframe, merge);
+    memset(&heap->cycle, 0, sizeof(ulib_gccycle));
+    t0 = ulib_nanotime();
+
+    heap->gcflag ^= GCFLAG;
+    if (mark && gc_mark(heap) < 0) {
+        gc_clear_marks(heap);
+        heap->gcflag ^= GCFLAG;
+        ULIB_TRACE2(gc_end, (uintptr_t)heap, -1);
+        return -1;
+    }
+
+    t1 = ulib_nanotime();
+    heap->heap_live = 0;
+    if (gc_clear_weak(heap) < 0) {
+        gc_clear_marks(heap);
+        heap->gcflag ^= GCFLAG;
+        ULIB_TRACE2(gc_end, (uintptr_t)heap, -1);
+        return -1;
+    }
+    gc_sweep(heap, merge);
+
+    heap->cycle.mark_time = t1 - t0;
+    heap->cycle.sweep_time = ulib_nanotime() - t1;
+    gc_stats_update(heap);
+
+    heap->alloc_bytes = 0;
+    heap->alloc_slabs = 0;
+    gc_trigger_update(heap);
+    ULIB_TRACE2(gc_end, (uintptr_t)heap, 0);
+    return 0;
+}
+
+/* Run the finalizers of up to MAX queued objects.  */
+unsigned int
+ulib_gcfinalize(unsigned int max) {
+    ulib_gcheap *heap = gc_heap();
+    unsigned int cnt;
+    ulib_cache *cache;
+    void *obj;
+
+    for (cnt = 0; cnt < max && heap->final_head < heap->final_n; cnt++) {
+        obj = heap->final[heap->final_head++];
+        cache = object_slab(obj)->cache;
+        cache->final(obj, cache->usize);
+        ulib_cache_free(cache, obj);
+    }
+
+    if (heap->final_head == heap->final_n)
+        heap->final_head = heap->final_n = 0;
+
+    return cnt;
+}
+
+/* Return the number of objects, queued for finalization.  */
+unsigned int
+ulib_gcfinalize_pending() {
+    ulib_gcheap *heap = gc_heap();
+
+    return heap->final_n - heap->final_head;
 }
 
 /* Push an allocation frame.  Objects, allocated in previous frames,
    won't be collected during the lifetime of this frame.  */
 void
 ulib_gcpush() {
-    G.gcframe++;
+    ulib_gcheap *heap = gc_heap();
+
+    assert(heap->gcframe < FINAL_FRAME - 1);
+    heap->gcframe++;
+}
+
+/* Check whether the shadow stack of the current thread refers to an
+   object of the current frame of HEAP.  */
+static int
+gc_shadow_frame_p(const ulib_gcheap *heap) {
+    struct slab *slab;
+    unsigned int i;
+    void *obj;
+
+    for (i = 0; i < ulib_gcshadow.top; i++) {
+        if ((obj = *ulib_gcshadow.slot[i]) == 0)
+            continue;
+
+        slab = object_slab(obj);
+        if (slab->cache->heap == heap && object_frame(obj) == heap->gcframe)
+            return 1;
+    }
+    return 0;
 }
 
 /* Pop an allocation frame.  Live objects of the popped frame will be
-   merged into the old frame.  */
+   merged into the old frame.  With escape tracking, a frame without
+   escapes is released without marking.  Otherwise, the survivors may
+   be referred to from outside of the older frame too.  */
 void
 ulib_gcpop() {
-    if (!cache_initialized)
-        --G.gcframe;
-    else {
-        G.gcflag ^= GCFLAG;
-        if (gc_mark() < 0)
-            G.gcflag ^= GCFLAG;
-        else {
-            gc_sweep(1);
-            G.gcframe--;
-        }
+    ulib_gcheap *heap = gc_heap();
+    int mark;
+
+    ulib_spin_lock(&heap->lock);
+    mark = !heap->escapes || heap->dirty >= heap->gcframe;
+    ulib_spin_unlock(&heap->lock);
+
+    if (!mark && gc_shadow_frame_p(heap))
+        mark = 1;
+
+    if (gc_collect(heap, 1, mark) == 0) {
+        heap->gcframe--;
+        ulib_spin_lock(&heap->lock);
+        if (heap->dirty > heap->gcframe)
+            heap->dirty = heap->gcframe;
+        ulib_spin_unlock(&heap->lock);
     }
 }
 
 /* Perform garbage collection.  */
 void
 ulib_gcrun() {
-    if (cache_initialized) {
-        G.gcflag ^= GCFLAG;
-        if (gc_mark() < 0)
-            G.gcflag ^= GCFLAG;
-        else
-            gc_sweep(0);
+    gc_collect(gc_heap(), 0, 1);
+}
+
+/* Heap image format.  The header is followed by the cache records,
+   the slab records, sorted by address, the root pointers, padding up
+   to a page boundary and the slab pages themselves.  */
+#define IMAGE_MAGIC 0x70616568622d7520ULL
+#define IMAGE_VERSION 1
+
+struct image_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pgsize;
+    uint32_t ptrsize;
+    uint32_t ncaches;
+    uint32_t nslabs;
+    uint32_t nroots;
+};
+
+/* Cache record.  Identifies the cache and its layout.  */
+struct image_cache {
+    uint32_t image;
+    uint32_t nptrs;
+    uint16_t size;
+    uint16_t usize;
+    uint16_t align;
+    uint16_t object_count;
+    uintptr_t ptrmap[PTRMAP_WORDS];
+};
+
+/* Slab record.  The original address of the slab and the index of its
+   cache record.  */
+struct image_slab {
+    uint64_t addr;
+    uint32_t cache;
+    uint32_t pad;
+};
+
+/* Write N bytes at BUF to FD.  */
+static int
+image_write(int fd, const void *buf, size_t n) {
+    ssize_t cnt;
+
+    while (n) {
+        if ((cnt = write(fd, buf, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + cnt;
+        n -= cnt;
+    }
+    return 0;
+}
+
+/* Read N bytes from FD to BUF.  A premature end of file is an invalid
+   image.  */
+static int
+image_read(int fd, void *buf, size_t n) {
+    ssize_t cnt;
+
+    while (n) {
+        if ((cnt = read(fd, buf, n)) <= 0) {
+            if (cnt < 0 && errno == EINTR)
+                continue;
+            if (cnt == 0)
+                errno = EINVAL;
+            return -1;
+        }
+        buf = (char *)buf + cnt;
+        n -= cnt;
+    }
+    return 0;
+}
+
+/* Return the size of the image metadata for NCACHES caches, NSLABS
+   slabs and NROOTS roots, padded up to a page boundary.  */
+static size_t
+image_meta_size(unsigned int ncaches, unsigned int nslabs, unsigned int nroots) {
+    size_t n;
+
+    n = sizeof(struct image_header) + ncaches * sizeof(struct image_cache)
+        + nslabs * sizeof(struct image_slab) + nroots * sizeof(uint64_t);
+    return (n + ulib_pgsize() - 1) & -ulib_pgsize();
+}
+
+/* Compare slab records by address.  */
+static int
+image_slab_cmp(const void *a, const void *b) {
+    uint64_t x = ((const struct image_slab *)a)->addr;
+    uint64_t y = ((const struct image_slab *)b)->addr;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Check whether OBJ is null or a saveable object of HEAP.  */
+static inline int
+image_obj_p(const ulib_gcheap *heap, const void *obj) {
+    const ulib_cache *cache;
+
+    if (obj == 0)
+        return 1;
+    cache = object_slab(obj)->cache;
+    return cache->heap == heap && cache->image != 0;
+}
+
+/* Save the objects of the current heap, reachable from the N ROOTS,
+   into a heap image, written to FD.  */
+int
+ulib_heap_save(int fd, unsigned int n, void *const *roots) {
+    ulib_gcheap *heap = gc_heap();
+    struct gc_mark_frame frm;
+    struct image_header hdr;
+    struct image_cache *caches = 0;
+    struct image_slab *slabs = 0, *ps;
+    ulib_cache *cache;
+    struct slab *slab;
+    unsigned int i, w, index, ncaches, nslabs, sz;
+    uintptr_t live, ptrs;
+    uint64_t *addrs = 0;
+    void **fld;
+    char *buf = 0;
+    size_t pad;
+    int ret = -1;
+
+    /* Objects, queued for finalization, may share slabs with the saved
+     ones.  Finalize them first, rather than save them and have the
+     load release them without running their finalizers.  */
+    ulib_gcfinalize(ulib_gcfinalize_pending());
+
+    /* Mark the objects, reachable from the roots.  */
+    frm.heap = heap;
+    frm.objs = 0;
+    frm.n = frm.sz = 0;
+    frm.head = frm.count = 0;
+    for (i = 0; i < n; i++) {
+        if (!image_obj_p(heap, roots[i])) {
+            errno = EINVAL;
+            goto out;
+        }
+        if (roots[i] && (gc_mark_obj(roots[i], &frm) < 0 || gc_mark_pending(&frm) < 0))
+            goto out;
+    }
+
+    /* Collect the cache records and the slabs with reachable objects.
+     Check that the reachable objects refer only to objects, which
+     are saved too.  */
+    ncaches = nslabs = sz = 0;
+    for (cache = (ulib_cache *)heap->gchead.next; cache != (ulib_cache *)&heap->gchead;
+         cache = (ulib_cache *)cache->gclist.next) {
+        if (cache->image == 0)
+            continue;
+
+        if ((ncaches & (ncaches - 1)) == 0) {
+            struct image_cache *c;
+
+            c = realloc(caches, (ncaches ? 2 * ncaches : 1) * sizeof(struct image_cache));
+            if (c == 0)
+                goto out;
+            caches = c;
+        }
+        memset(&caches[ncaches], 0, sizeof(struct image_cache));
+        caches[ncaches].image = cache->image;
+        caches[ncaches].nptrs = cache->nptrs;
+        caches[ncaches].size = cache->size;
+        caches[ncaches].usize = cache->usize;
+        caches[ncaches].align = cache->align;
+        caches[ncaches].object_count = cache->object_count;
+        memcpy(caches[ncaches].ptrmap, cache->ptrmap, sizeof(cache->ptrmap));
+
+        for (slab = (struct slab *)cache->slabs.next;
+             slab != (struct slab *)&cache->slabs;
+             slab = (struct slab *)slab->list.next) {
+            for (live = 0, w = 0; w < cache->map_words; w++)
+                live |= slab->map[2 * w] & slab->map[2 * w + 1];
+            if (live == 0)
+                continue;
+
+            for (w = 0; w < cache->map_words; w++) {
+                for (live = slab->map[2 * w] & slab->map[2 * w + 1]; live;
+                     live &= live - 1) {
+                    index = w * MAP_BITS + map_first(live);
+                    fld = (void **)object_at(slab, index);
+                    for (i = 0; i < PTRMAP_WORDS; i++) {
+                        for (ptrs = cache->ptrmap[i]; ptrs; ptrs &= ptrs - 1) {
+                            if (!image_obj_p(heap, fld[i * MAP_BITS + map_first(ptrs)])) {
+                                errno = EINVAL;
+                                goto out;
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (nslabs == sz) {
+                sz = sz ? 2 * sz : 64;
+                if ((ps = realloc(slabs, sz * sizeof(struct image_slab))) == 0)
+                    goto out;
+                slabs = ps;
+            }
+            slabs[nslabs].addr = (uintptr_t)slab;
+            slabs[nslabs].cache = ncaches;
+            slabs[nslabs].pad = 0;
+            nslabs++;
+        }
+        ncaches++;
+    }
+    qsort(slabs, nslabs, sizeof(struct image_slab), image_slab_cmp);
+
+    if (n && (addrs = malloc(n * sizeof(uint64_t))) == 0)
+        goto out;
+    for (i = 0; i < n; i++)
+        addrs[i] = (uintptr_t)roots[i];
+
+    pad = image_meta_size(ncaches, nslabs, n) - sizeof(hdr)
+          - ncaches * sizeof(struct image_cache) - nslabs * sizeof(struct image_slab)
+          - n * sizeof(uint64_t);
+    if ((buf = calloc(1, pad + 1)) == 0)
+        goto out;
+
+    hdr.magic = IMAGE_MAGIC;
+    hdr.version = IMAGE_VERSION;
+    hdr.pgsize = ulib_pgsize();
+    hdr.ptrsize = sizeof(void *);
+    hdr.ncaches = ncaches;
+    hdr.nslabs = nslabs;
+    hdr.nroots = n;
+
+    if (image_write(fd, &hdr, sizeof(hdr)) < 0
+        || image_write(fd, caches, ncaches * sizeof(struct image_cache)) < 0
+        || image_write(fd, slabs, nslabs * sizeof(struct image_slab)) < 0
+        || image_write(fd, addrs, n * sizeof(uint64_t)) < 0
+        || image_write(fd, buf, pad) < 0)
+        goto out;
+
+    for (i = 0; i < nslabs; i++)
+        if (image_write(fd, (void *)(uintptr_t)slabs[i].addr, ulib_pgsize()) < 0)
+            goto out;
+
+    ret = 0;
+
+out:
+    gc_clear_marks(heap);
+    free(frm.objs);
+    free(caches);
+    free(slabs);
+    free(addrs);
+    free(buf);
+    return ret;
+}
+
+/* Find the new address of the object at the original address ADDR in
+   the sorted slab records SLABS of the image, whose slabs were loaded
+   at PAGES.  Return negative if the address isn't in any of the
+   slabs.  */
+static int
+image_relocate(uint64_t addr,
+               const struct image_slab *slabs,
+               unsigned int nslabs,
+               char *const *pages,
+               void **obj) {
+    uint64_t page = addr & -(uint64_t)ulib_pgsize();
+    unsigned int lo = 0, hi = nslabs, mid;
+
+    if (addr == 0) {
+        *obj = 0;
+        return 0;
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (slabs[mid].addr < page)
+            lo = mid + 1;
+        else if (slabs[mid].addr > page)
+            hi = mid;
+        else {
+            *obj = pages[mid] + (addr - page);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Load a heap image from FD into the current heap.  */
+int
+ulib_heap_load(int fd, unsigned int n, void **roots) {
+    ulib_gcheap *heap = gc_heap();
+    struct image_header hdr;
+    struct image_cache *caches = 0;
+    struct image_slab *slabs = 0;
+    ulib_cache **map = 0, *cache;
+    struct slab *slab;
+    char **pages = 0, *buf = 0;
+    uint64_t *addrs = 0;
+    unsigned int i, j, w, index, nloaded = 0;
+    uintptr_t alloc, live, ptrs, delta;
+    void **fld, **slot;
+    size_t pad;
+    int ret = -1;
+
+    if (image_read(fd, &hdr, sizeof(hdr)) < 0)
+        return -1;
+
+    if (hdr.magic != IMAGE_MAGIC || hdr.version != IMAGE_VERSION
+        || hdr.pgsize != ulib_pgsize() || hdr.ptrsize != sizeof(void *)
+        || hdr.nroots != n) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Read the metadata and match the cache records to the caches of
+     the heap.  */
+    caches = malloc(hdr.ncaches * sizeof(struct image_cache) + 1);
+    map = malloc(hdr.ncaches * sizeof(ulib_cache *) + 1);
+    slabs = malloc(hdr.nslabs * sizeof(struct image_slab) + 1);
+    pages = calloc(hdr.nslabs + 1, sizeof(char *));
+    addrs = malloc(n * sizeof(uint64_t) + 1);
+    pad = image_meta_size(hdr.ncaches, hdr.nslabs, n) - sizeof(hdr)
+          - hdr.ncaches * sizeof(struct image_cache)
+          - hdr.nslabs * sizeof(struct image_slab) - n * sizeof(uint64_t);
+    buf = malloc(pad + 1);
+    if (caches == 0 || map == 0 || slabs == 0 || pages == 0 || addrs == 0 || buf == 0)
+        goto out;
+
+    if (image_read(fd, caches, hdr.ncaches * sizeof(struct image_cache)) < 0
+        || image_read(fd, slabs, hdr.nslabs * sizeof(struct image_slab)) < 0
+        || image_read(fd, addrs, n * sizeof(uint64_t)) < 0
+        || image_read(fd, buf, pad) < 0)
+        goto out;
+
+    for (i = 0; i < hdr.ncaches; i++) {
+        for (cache = (ulib_cache *)heap->gchead.next;
+             cache != (ulib_cache *)&heap->gchead;
+             cache = (ulib_cache *)cache->gclist.next)
+            if (cache->image == caches[i].image)
+                break;
+
+        if (cache == (ulib_cache *)&heap->gchead || cache->nptrs != caches[i].nptrs
+            || cache->size != caches[i].size || cache->usize != caches[i].usize
+            || cache->align != caches[i].align
+            || cache->object_count != caches[i].object_count
+            || memcmp(cache->ptrmap, caches[i].ptrmap, sizeof(cache->ptrmap)) != 0) {
+            errno = EINVAL;
+            goto out;
+        }
+        map[i] = cache;
+    }
+
+    /* Read the slabs.  */
+    for (i = 0; i < hdr.nslabs; i++) {
+        if (slabs[i].cache >= hdr.ncaches
+            || (i > 0 && slabs[i].addr <= slabs[i - 1].addr)) {
+            errno = EINVAL;
+            goto out;
+        }
+        if ((pages[i] = ulib_pgalloc()) == 0) {
+            errno = ENOMEM;
+            goto out;
+        }
+        if (image_read(fd, pages[i], ulib_pgsize()) < 0)
+            goto out;
+    }
+
+    /* Relocate the slab control data and the pointer fields of the
+     reachable objects.  */
+    for (i = 0; i < hdr.nslabs; i++) {
+        slab = (struct slab *)pages[i];
+        cache = map[slabs[i].cache];
+        delta = (uintptr_t)pages[i] - (uintptr_t)slabs[i].addr;
+
+        slab->cache = cache;
+        slab->objects = (char *)slab->objects + delta;
+        slab->offset = (char *)slab->offset + delta;
+        slab->ctl = (unsigned short *)((char *)slab->ctl + delta);
+        if ((char *)slab->objects < pages[i]
+            || (char *)slab->objects >= pages[i] + ulib_pgsize()
+            || (char *)slab->ctl < pages[i]
+            || (char *)slab->ctl >= pages[i] + ulib_pgsize()) {
+            errno = EINVAL;
+            goto out;
+        }
+
+        for (w = 0; w < cache->map_words; w++) {
+            alloc = slab->map[2 * w];
+            for (live = alloc & slab->map[2 * w + 1]; live; live &= live - 1) {
+                fld = (void **)object_at(slab, w * MAP_BITS + map_first(live));
+                for (j = 0; j < PTRMAP_WORDS; j++) {
+                    for (ptrs = cache->ptrmap[j]; ptrs; ptrs &= ptrs - 1) {
+                        slot = fld + j * MAP_BITS + map_first(ptrs);
+                        if (image_relocate(
+                                (uintptr_t)*slot, slabs, hdr.nslabs, pages, slot)
+                            < 0) {
+                            errno = EINVAL;
+                            goto out;
+                        }
+                    }
+                }
+            }
+
+            for (; alloc; alloc &= alloc - 1)
+                slab->ctl[w * MAP_BITS + map_first(alloc)] = heap->gcframe;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (image_relocate(addrs[i], slabs, hdr.nslabs, pages, &roots[i]) < 0) {
+            errno = EINVAL;
+            goto out;
+        }
+    }
+
+    /* Put the slabs on their cache lists.  The saved slabs contain at
+     least one reachable object.  */
+    for (i = 0; i < hdr.nslabs; i++) {
+        slab = (struct slab *)pages[i];
+        cache = slab->cache;
+
+        ulib_list_init(&slab->list);
+        slab->info = heap->gcflag | SLAB_COUNT(slab);
+        slab->samples = 0;
+        ulib_list_insert(cache->free, &slab->list);
+        if (SLAB_COUNT(slab) > 0)
+            cache->free = slab;
     }
+    nloaded = hdr.nslabs;
+
+    /* Release the unreachable objects, which were saved with their
+     slabs, and clear the reachability bits.  */
+    for (i = 0; i < hdr.nslabs; i++) {
+        slab = (struct slab *)pages[i];
+        cache = slab->cache;
+        for (w = 0; w < cache->map_words; w++) {
+            alloc = slab->map[2 * w] & ~slab->map[2 * w + 1];
+            slab->map[2 * w + 1] = 0;
+            for (; alloc; alloc &= alloc - 1) {
+                index = w * MAP_BITS + map_first(alloc);
+                ulib_cache_free(cache, object_at(slab, index));
+            }
+        }
+    }
+
+    heap->alloc_slabs += hdr.nslabs;
+    heap->alloc_bytes += hdr.nslabs * ulib_pgsize();
+    ulib_spin_lock(&heap->lock);
+    gc_escape(heap, heap->gcframe);
+    ulib_spin_unlock(&heap->lock);
+    ret = 0;
+
+out:
+    for (i = nloaded; pages && i < hdr.nslabs && pages[i]; i++)
+        ulib_pgfree(pages[i]);
+    free(caches);
+    free(map);
+    free(slabs);
+    free(pages);
+    free(addrs);
+    free(buf);
+    return ret;
+}
+
+/* Allocation profiler.  Sampled allocations are recorded in a bounded
+   lock-free ring by the allocating threads.  The ring is drained into
+   the profile tables, protected by a lock, before a sampled object is
+   freed, before the profile is written and by an allocating thread,
+   which finds it full.  */
+
+/* Number of ring slots.  Must be a power of two.  */
+#define PROF_RING 1024
+
+/* Number of leading stack frames, which belong to the allocator.  */
+#define PROF_SKIP 2
+
+/* Sampled allocation.  */
+struct prof_sample {
+    void *obj;
+    const ulib_cache *cache;
+    unsigned int size;
+    unsigned int depth;
+    void *pc[ULIB_CACHE_PROFILE_DEPTH];
+};
+
+/* Ring slot.  The sequence number tells whether the slot is free for
+   the producer with the same ticket, or full for the consumer with the
+   preceding one.  */
+struct prof_slot {
+    atomic_size_t seq;
+    struct prof_sample sample;
+};
+
+/* Profile bucket - allocation counters for a cache and a stack.  */
+struct prof_bucket {
+    const ulib_cache *cache;
+    unsigned int depth;
+    void *pc[ULIB_CACHE_PROFILE_DEPTH];
+    unsigned long long alloc_count;
+    unsigned long long alloc_bytes;
+    unsigned long long live_count;
+    unsigned long long live_bytes;
+};
+
+/* Sampled object, not freed yet.  */
+struct prof_live {
+    void *obj;
+    unsigned int bucket;
+    unsigned int size;
+};
+
+static struct {
+    /* Lock, which protects the consumer side of the ring and the
+     tables.  */
+    ulib_spinlock lock;
+
+    /* Initialized flag.  */
+    int initialized;
+
+    /* The last non-zero sampling rate.  */
+    size_t rate;
+
+    /* Sample ring and its producer and consumer tickets.  */
+    struct prof_slot ring[PROF_RING];
+    atomic_size_t head;
+    size_t tail;
+
+    /* Number of samples, dropped because the ring was full and could
+     not be drained.  */
+    atomic_ulong dropped;
+
+    /* Buckets and an open addressing index of them, with bucket number
+     plus one in each used entry.  */
+    struct prof_bucket *buckets;
+    unsigned int nbuckets;
+    unsigned int szbuckets;
+    unsigned int *index;
+    unsigned int szindex;
+
+    /* Open addressing table of the live samples.  */
+    struct prof_live *live;
+    unsigned int nlive;
+    unsigned int szlive;
+} P;
+
+/* Per thread state of the sampling interval random number
+   generator.  */
+static ULIB_THREAD uint64_t prof_seed;
+
+/* Return the natural logarithm of X, a positive normal number.  The
+   mantissa is reduced to [1, 2) and its logarithm is computed with a
+   few terms of the area hyperbolic tangent series, precise enough to
+   pick sampling intervals.  */
+static double
+prof_log(double x) {
+    union {
+        double d;
+        uint64_t u;
+    } v;
+    int e;
+    double t, t2;
+
+    v.d = x;
+    e = (int)((v.u >> 52) & 0x7ff) - 1023;
+    v.u = (v.u & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1023 << 52);
+
+    t = (v.d - 1) / (v.d + 1);
+    t2 = t * t;
+    return e * 0.6931471805599453
+           + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7))));
+}
+
+/* Pick the number of bytes until the next sample.  The intervals are
+   exponentially distributed with mean RATE, as expected by pprof.  */
+static long long
+prof_interval(size_t rate) {
+    double u;
+
+    if (prof_seed == 0)
+        prof_seed = (uintptr_t)&prof_seed ^ ulib_nanotime();
+    prof_seed ^= prof_seed >> 12;
+    prof_seed ^= prof_seed << 25;
+    prof_seed ^= prof_seed >> 27;
+
+    u = ((prof_seed * 0x2545f4914f6cdd1dULL >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (long long)(-prof_log(u) * rate) + 1;
+}
+
+/* Hash a pointer.  */
+static inline unsigned int
+prof_hash_ptr(const void *ptr) {
+    return (unsigned int)(((uintptr_t)ptr >> 3) * 0x9e3779b1U);
+}
+
+/* Hash a CACHE and a stack of DEPTH frames at PC.  */
+static unsigned int
+prof_hash_stack(const ulib_cache *cache, unsigned int depth, void *const *pc) {
+    unsigned int i, h;
+
+    h = prof_hash_ptr(cache);
+    for (i = 0; i < depth; i++)
+        h = (h ^ prof_hash_ptr(pc[i])) * 0x01000193U;
+    return h;
+}
+
+/* Find or add the bucket for the sample S.  Return its number or
+   negative if out of memory.  Called with the lock held.  */
+static int
+prof_bucket(const struct prof_sample *s) {
+    unsigned int i, j, h, sz, *index;
+    struct prof_bucket *b;
+
+    h = prof_hash_stack(s->cache, s->depth, s->pc);
+    for (i = h & (P.szindex - 1); P.szindex && P.index[i]; i = (i + 1) & (P.szindex - 1)) {
+        b = &P.buckets[P.index[i] - 1];
+        if (b->cache == s->cache && b->depth == s->depth
+            && memcmp(b->pc, s->pc, s->depth * sizeof(void *)) == 0)
+            return P.index[i] - 1;
+    }
+
+    if (P.nbuckets == P.szbuckets) {
+        sz = P.szbuckets ? 2 * P.szbuckets : 64;
+        if ((b = realloc(P.buckets, sz * sizeof(struct prof_bucket))) == 0)
+            return -1;
+        P.buckets = b;
+        P.szbuckets = sz;
+    }
+
+    /* Keep the index at most half full.  */
+    if (2 * (P.nbuckets + 1) > P.szindex) {
+        sz = P.szindex ? 2 * P.szindex : 128;
+        if ((index = calloc(sz, sizeof(unsigned int))) == 0)
+            return -1;
+        for (j = 0; j < P.nbuckets; j++) {
+            b = &P.buckets[j];
+            i = prof_hash_stack(b->cache, b->depth, b->pc) & (sz - 1);
+            while (index[i])
+                i = (i + 1) & (sz - 1);
+            index[i] = j + 1;
+        }
+        free(P.index);
+        P.index = index;
+        P.szindex = sz;
+    }
+
+    for (i = h & (P.szindex - 1); P.index[i]; i = (i + 1) & (P.szindex - 1))
+        ;
+    P.index[i] = P.nbuckets + 1;
+
+    b = &P.buckets[P.nbuckets];
+    memset(b, 0, sizeof(struct prof_bucket));
+    b->cache = s->cache;
+    b->depth = s->depth;
+    memcpy(b->pc, s->pc, s->depth * sizeof(void *));
+    return P.nbuckets++;
+}
+
+/* Insert an entry in the live samples table, which has room for it.  */
+static void
+prof_live_insert(struct prof_live *live, unsigned int sz, const struct prof_live *e) {
+    unsigned int i;
+
+    for (i = prof_hash_ptr(e->obj) & (sz - 1); live[i].obj; i = (i + 1) & (sz - 1))
+        ;
+    live[i] = *e;
+}
+
+/* Account for the sample S.  Called with the lock held.  */
+static void
+prof_account(const struct prof_sample *s) {
+    struct prof_live e, *live;
+    unsigned int i, sz;
+    int b;
+
+    if ((b = prof_bucket(s)) < 0)
+        return;
+    P.buckets[b].alloc_count++;
+    P.buckets[b].alloc_bytes += s->size;
+
+    /* Keep the live samples table at most half full.  */
+    if (2 * (P.nlive + 1) > P.szlive) {
+        sz = P.szlive ? 2 * P.szlive : 256;
+        if ((live = calloc(sz, sizeof(struct prof_live))) == 0)
+            return;
+        for (i = 0; i < P.szlive; i++)
+            if (P.live[i].obj)
+                prof_live_insert(live, sz, &P.live[i]);
+        free(P.live);
+        P.live = live;
+        P.szlive = sz;
+    }
+
+    e.obj = s->obj;
+    e.bucket = b;
+    e.size = s->size;
+    prof_live_insert(P.live, P.szlive, &e);
+    P.nlive++;
+    P.buckets[b].live_count++;
+    P.buckets[b].live_bytes += s->size;
+}
+
+/* Move the samples from the ring to the tables.  Called with the lock
+   held.  */
+static void
+prof_drain() {
+    struct prof_slot *slot;
+
+    for (;;) {
+        slot = &P.ring[P.tail & (PROF_RING - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != P.tail + 1)
+            break;
+
+        prof_account(&slot->sample);
+        atomic_store_explicit(&slot->seq, P.tail + PROF_RING, memory_order_release);
+        P.tail++;
+    }
+}
+
+/* Record a sample of the allocation of PTR from SLAB of CACHE.  */
+static void
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+prof_sample(ulib_cache *cache, struct slab *slab, void *ptr) {
+    size_t rate, pos, seq;
+    struct prof_slot *slot;
+    int drained = 0;
+#ifdef ULIB_HAVE_BACKTRACE
+    void *pc[ULIB_CACHE_PROFILE_DEPTH + PROF_SKIP];
+    int depth;
+#endif
+
+    if ((rate = atomic_load_explicit(&prof_rate, memory_order_acquire)) == 0)
+        return;
+
+    /* Pick the first interval of a thread, rather than sampling its
+       first allocation.  */
+    if (prof_seed == 0) {
+        prof_left = prof_interval(rate) - cache->size;
+        if (prof_left >= 0)
+            return;
+    }
+    prof_left = prof_interval(rate);
+
+    /* Claim a ring slot.  */
+    pos = atomic_load_explicit(&P.head, memory_order_relaxed);
+    for (;;) {
+        slot = &P.ring[pos & (PROF_RING - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &P.head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+            /* The ring is full.  Drain it once, unless another thread
+               holds the lock.  The slot stays full after draining, if
+               its producer has not published it yet.  */
+            if (drained || !ulib_spin_trylock(&P.lock)) {
+                atomic_fetch_add_explicit(&P.dropped, 1, memory_order_relaxed);
+                return;
+            }
+            prof_drain();
+            ulib_spin_unlock(&P.lock);
+            drained = 1;
+            pos = atomic_load_explicit(&P.head, memory_order_relaxed);
+        } else
+            pos = atomic_load_explicit(&P.head, memory_order_relaxed);
+    }
+
+    slab->samples++;
+    slab->info |= SAMPLED;
+    slot->sample.obj = ptr;
+    slot->sample.cache = cache;
+    slot->sample.size = cache->size;
+#ifdef ULIB_HAVE_BACKTRACE
+    depth = backtrace(pc, ULIB_CACHE_PROFILE_DEPTH + PROF_SKIP) - PROF_SKIP;
+    if (depth < 0)
+        depth = 0;
+    slot->sample.depth = depth;
+    memcpy(slot->sample.pc, pc + PROF_SKIP, depth * sizeof(void *));
+#elif defined(__GNUC__)
+    slot->sample.depth = 1;
+    slot->sample.pc[0] = __builtin_return_address(0);
+#else
+    slot->sample.depth = 0;
+#endif
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/* Return the position of the live sample of the object PTR in the
+   table, or negative if it is not there.  Called with the lock
+   held.  */
+static int
+prof_live_find(const void *ptr) {
+    unsigned int i, sz = P.szlive;
+
+    for (i = prof_hash_ptr(ptr) & (sz - 1); sz && P.live[i].obj; i = (i + 1) & (sz - 1))
+        if (P.live[i].obj == ptr)
+            return i;
+    return -1;
+}
+
+/* Delete the entry at position I of the live samples table, shifting
+   back the following entries of the cluster, which would become
+   unreachable.  Called with the lock held.  */
+static void
+prof_live_delete(unsigned int i) {
+    unsigned int j, k, sz = P.szlive;
+
+    for (j = (i + 1) & (sz - 1); P.live[j].obj; j = (j + 1) & (sz - 1)) {
+        k = prof_hash_ptr(P.live[j].obj) & (sz - 1);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        P.live[i] = P.live[j];
+        i = j;
+    }
+    P.live[i].obj = 0;
+}
+
+/* Stop tracking the sampled object PTR, which is being freed.  Return
+   whether the object is sampled.  */
+static int
+prof_free(void *ptr) {
+    struct prof_bucket *b;
+    int i;
+
+    ulib_spin_lock(&P.lock);
+    prof_drain();
+
+    if ((i = prof_live_find(ptr)) >= 0) {
+        b = &P.buckets[P.live[i].bucket];
+        b->live_count--;
+        b->live_bytes -= P.live[i].size;
+        P.nlive--;
+        prof_live_delete(i);
+    }
+
+    ulib_spin_unlock(&P.lock);
+    return i >= 0;
+}
+
+/* Track the sampled object FROM at its new address TO, where it was
+   moved by the compaction.  Return whether the object is sampled.  */
+static int
+prof_move(void *from, void *to) {
+    struct prof_live e;
+    int i;
+
+    ulib_spin_lock(&P.lock);
+    prof_drain();
+
+    if ((i = prof_live_find(from)) >= 0) {
+        e = P.live[i];
+        prof_live_delete(i);
+        e.obj = to;
+        prof_live_insert(P.live, P.szlive, &e);
+    }
+
+    ulib_spin_unlock(&P.lock);
+    return i >= 0;
+}
+
+/* Start or stop sampling allocations.  */
+void
+ulib_cache_profile(size_t rate) {
+    size_t i;
+
+    ulib_spin_lock(&P.lock);
+    if (!P.initialized) {
+        for (i = 0; i < PROF_RING; i++)
+            atomic_init(&P.ring[i].seq, i);
+        P.initialized = 1;
+    }
+    if (rate)
+        P.rate = rate;
+    ulib_spin_unlock(&P.lock);
+
+    atomic_store_explicit(&prof_rate, rate, memory_order_release);
+}
+
+/* Return the number of dropped samples.  */
+unsigned long
+ulib_cache_profile_dropped() {
+    return atomic_load_explicit(&P.dropped, memory_order_relaxed);
+}
+
+/* Write the allocation profile to F.  */
+int
+ulib_cache_profile_dump(FILE *f) {
+    unsigned long long live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    const struct prof_bucket *b;
+    unsigned int i, j;
+    FILE *maps;
+    char buf[4096];
+    size_t n;
+    int ret = 0;
+
+    ulib_spin_lock(&P.lock);
+    if (P.initialized)
+        prof_drain();
+
+    for (i = 0; i < P.nbuckets; i++) {
+        live_count += P.buckets[i].live_count;
+        live_bytes += P.buckets[i].live_bytes;
+        alloc_count += P.buckets[i].alloc_count;
+        alloc_bytes += P.buckets[i].alloc_bytes;
+    }
+
+    if (fprintf(f,
+                "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+                live_count,
+                live_bytes,
+                alloc_count,
+                alloc_bytes,
+                P.rate)
+        < 0)
+        ret = -1;
+
+    for (i = 0; ret == 0 && i < P.nbuckets; i++) {
+        b = &P.buckets[i];
+        fprintf(f,
+                "%llu: %llu [%llu: %llu] @",
+                b->live_count,
+                b->live_bytes,
+                b->alloc_count,
+                b->alloc_bytes);
+        for (j = 0; j < b->depth; j++)
+            fprintf(f, " 0x%" PRIxPTR, (uintptr_t)b->pc[j]);
+        if (fprintf(f, "\n") < 0)
+            ret = -1;
+    }
+    ulib_spin_unlock(&P.lock);
+
+    /* The mappings let pprof symbolize the addresses.  */
+    if (ret == 0 && fprintf(f, "\nMAPPED_LIBRARIES:\n") < 0)
+        ret = -1;
+    if (ret == 0 && (maps = fopen("/proc/self/maps", "r")) != 0) {
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+            if (fwrite(buf, 1, n, f) != n)
+                ret = -1;
+        fclose(maps);
+    }
+
+    if (fflush(f) != 0)
+        ret = -1;
+    return ret;
 }
 
 /*
@@ -4,6 +4,9 @@
 #include "defs.h"
 #include "list.h"
 #include "ulib-if.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
 
 BEGIN_DECLS
 
@@ -27,10 +30,17 @@ typedef int (*ulib_ctor_func)(void *obj, unsigned int size);
 typedef void (*ulib_clear_func)(void *obj, unsigned int size);
 typedef void (*ulib_dtor_func)(void *obj, unsigned int size);
 
+/* Finalizer function type.  */
+typedef void (*ulib_final_func)(void *obj, unsigned int size);
+
+/* Weak reference notification function type.  */
+typedef void (*ulib_gcweak_func)(void **slot, void *obj);
+
 /* Garbage collection mark function type.  */
 typedef int (*ulib_gcscan_func)(void *obj, void **ptr, unsigned int sz);
 
 typedef struct ulib_cache ulib_cache;
+typedef struct ulib_gcheap ulib_gcheap;
 
 /* Cache creation attributes.  */
 #define ULIB_CACHE_SIZE 1
@@ -40,6 +50,42 @@ typedef struct ulib_cache ulib_cache;
 #define ULIB_CACHE_DTOR 5
 #define ULIB_CACHE_GC 6
 #define ULIB_CACHE_GCSCAN 7
+#define ULIB_CACHE_GCLAYOUT 8
+#define ULIB_CACHE_FINALIZE 9
+#define ULIB_CACHE_IMAGE 10
+#define ULIB_CACHE_HANDLES 11
+
+/* The ULIB_CACHE_GCLAYOUT attribute is followed by an unsigned int
+   count and an array of unsigned int offsets of the pointer fields of
+   the objects.  The pointer fields must be aligned, each one must be
+   either null or point to a cached object.  The objects are aligned at
+   least to the size of a pointer.  Such a cache is garbage collected
+   and its objects are scanned without invoking a scan function, so
+   ULIB_CACHE_GCSCAN must not be given too.  */
+
+/* Unreachable objects of a cache with a finalizer (given with
+   ULIB_CACHE_FINALIZE) are not freed by the collector, but queued for
+   finalization by ``ulib_gcfinalize''.  A finalizer must not access
+   other garbage collected objects, nor make its object reachable
+   again.  */
+
+/* The ULIB_CACHE_IMAGE attribute is followed by a non-zero unsigned
+   int identifier, unique within the heap.  Such a cache is garbage
+   collected and its objects are saved in heap images.  It must not
+   have a constructor, a destructor, nor a scan function - its pointer
+   fields, if any, are given with a layout descriptor.  */
+
+/* Objects of a cache, created with the ULIB_CACHE_HANDLES attribute,
+   are reached through handles.  A handle is a pointer to a pointer
+   sized slot, which holds the address of the object, and it stays
+   valid for the lifetime of the object, while the object itself may be
+   moved by ``ulib_cache_compact''.  Thus only handles may be kept
+   across calls to it - in variables, roots, weak references or fields
+   of other objects.  The objects of such a cache are allocated and
+   released with ``ulib_cache_halloc'' and ``ulib_cache_hfree''.  If
+   the cache is garbage collected, so are the handles and an object is
+   reachable iff its handle is.  The cache must not have a constructor,
+   a destructor, nor an image identifier.  */
 
 /* Create an object cache.  Throws NO_MEMORY, INVALID_PARAMETER.  */
 ULIB_IF ulib_cache *ulib_cache_create(int, ...);
@@ -53,26 +99,296 @@ ULIB_IF void ulib_cache_free(ulib_cache *, void *);
 /* Release cached objects.  */
 ULIB_IF void ulib_cache_flush(ulib_cache *);
 
+/* Allocate an object from a cache with handles and return a handle
+   to it.  Throws NO_MEMORY.  */
+ULIB_IF void **ulib_cache_halloc(ulib_cache *);
+
+/* Release an object and its handle to the cache.  */
+ULIB_IF void ulib_cache_hfree(ulib_cache *, void **);
+
+/* Defragment a cache with handles.  Move the objects out of the
+   sparsest slabs into the free places of the densest ones, updating
+   their handles, until the objects occupy as few slabs as possible,
+   and release the emptied slabs.  Return the number of released slabs.
+   Throws NO_MEMORY.  */
+ULIB_IF int ulib_cache_compact(ulib_cache *);
+
+/* Maximum number of stack frames recorded for a sampled allocation.  */
+#define ULIB_CACHE_PROFILE_DEPTH 32
+
+/* Start sampling the allocations from all the caches, on average once
+   every RATE allocated bytes, or stop sampling if RATE is zero.  Each
+   sample records the stack of the allocating thread and the cache and
+   is tracked until the object is freed.  The samples, taken so far,
+   are kept, when sampling is stopped.  */
+ULIB_IF void ulib_cache_profile(size_t rate);
+
+/* Write the allocation profile to F in the pprof legacy heap profile
+   text format.  Each line gives the number and bytes of the sampled
+   objects, which are still allocated, and, in brackets, of all the
+   sampled objects, allocated from a cache with a stack, followed by
+   the stack.  The counts are not scaled up, the header line records
+   the sampling rate, so pprof can do that.  Throws the errors of the
+   stdio functions.  */
+ULIB_IF int ulib_cache_profile_dump(FILE *f);
+
+/* Return the number of samples, dropped because threads took them
+   faster than they could be recorded.  The dropped samples are missing
+   from the profile.  */
+ULIB_IF unsigned long ulib_cache_profile_dropped(void);
+
+/* Garbage collected heaps.  Each thread has a current heap, initially
+   the default one, shared by all the threads, which haven't set their
+   own.  A garbage collected cache belongs to the heap, which was
+   current when it was created, and so do its objects.  The roots,
+   weak references, allocation frames, automatic collection parameters,
+   finalization queue and statistics are per heap and the functions
+   below, which operate on them, refer to the current heap.  A
+   collection marks and sweeps only the objects of the current heap, so
+   threads with heaps of their own collect independently of each
+   other.  A heap, its caches and its objects must be used by a single
+   thread at a time.
+
+   Pointers to objects of other heaps are not followed by the
+   collector and don't keep their targets alive.  An object, which
+   escapes to other threads, must be shared with ``ulib_gcshare'',
+   after which it and the objects of its heap, reachable from it,
+   survive the collections of its heap until it is unshared.  */
+
+/* Create a garbage collected heap.  Throws NO_MEMORY.  */
+ULIB_IF ulib_gcheap *ulib_gcheap_create(void);
+
+/* Set the current heap of the calling thread, the default one if
+   HEAP is null.  Return the previous current heap.  */
+ULIB_IF ulib_gcheap *ulib_gcheap_set(ulib_gcheap *heap);
+
+/* Return the current heap of the calling thread.  */
+ULIB_IF ulib_gcheap *ulib_gcheap_get(void);
+
+/* Share the cached object OBJ with other threads.  Can be called from
+   any thread, shares are counted.  Throws NO_MEMORY.  */
+ULIB_IF int ulib_gcshare(void *obj);
+
+/* Release a share of the cached object OBJ.  Can be called from any
+   thread.  */
+ULIB_IF void ulib_gcunshare(void *obj);
+
 /* Register a non-cached root object.  */
 ULIB_IF int ulib_gcroot(void *, ulib_gcscan_func);
 
-/* Register a cached root object.  */
+/* Register a cached root object, which belongs to the current heap.  */
 ULIB_IF int ulib_gcroot_cached(void *);
 
 /* Unregister a root object.  */
 ULIB_IF void ulib_gcunroot(void *);
 
+/* Register a weak reference.  The pointer at SLOT is not traced by the
+   collector.  When the cached object it points to is found
+   unreachable, the pointer is cleared and, unless it is null, the
+   function NOTIFY is invoked with the slot and the object, before the
+   object is freed.  NOTIFY may register and unregister weak references
+   and roots, including its own weak reference, but must not allocate
+   from garbage collected caches.  The weak reference must be
+   unregistered before the memory of SLOT is released.  Weak
+   references to objects of other heaps are never cleared.  */
+ULIB_IF int ulib_gcweak(void **slot, ulib_gcweak_func notify);
+
+/* Unregister a weak reference.  */
+ULIB_IF void ulib_gcunweak(void **slot);
+
+/* Maximum number of scoped roots per thread.  */
+#define ULIB_GC_SHADOW_MAX 512
+
+/* Shadow stack of scoped roots.  Each element is the address of a
+   variable, which points to a cached object or is null.  */
+struct ulib_gcshadow {
+    /* Number of elements.  */
+    unsigned int top;
+
+    /* Root variable addresses.  */
+    void **slot[ULIB_GC_SHADOW_MAX];
+};
+
+/* The shadow stack of the current thread.  */
+extern ULIB_IF ULIB_THREAD struct ulib_gcshadow ulib_gcshadow;
+
+/* Open a scope for roots, registered with ULIB_GC_ROOT.  The scope
+   must be left only via ULIB_GC_ROOT_SCOPE_END or after invoking
+   ULIB_GC_ROOT_SCOPE_EXIT.  */
+#define ULIB_GC_ROOT_SCOPE_BEGIN                                                \
+    {                                                                          \
+        unsigned int ulib__gc_scope = ulib_gcshadow.top;
+
+/* Register the pointer variable P as a root until the end of the
+   scope.  The variable may be changed freely during the scope.  */
+#define ULIB_GC_ROOT(p)                                                        \
+    (assert(ulib_gcshadow.top < ULIB_GC_SHADOW_MAX),                           \
+     ulib_gcshadow.slot[ulib_gcshadow.top++] = (void **)&(p))
+
+/* Unregister the roots of the scope before an early exit from it.  */
+#define ULIB_GC_ROOT_SCOPE_EXIT() (ulib_gcshadow.top = ulib__gc_scope)
+
+/* Close a scope for roots.  */
+#define ULIB_GC_ROOT_SCOPE_END                                                  \
+    ULIB_GC_ROOT_SCOPE_EXIT();                                                 \
+    }
+
 /* Push an allocation frame.  Objects, allocated in previous frames,
    won't be collected during the lifetime of this frame.  */
 ULIB_IF void ulib_gcpush(void);
 
 /* Pop an allocation frame.  Live objects of the popped frame will be
-   merged into the old frame.  */
+   merged into the old frame.  With escape tracking enabled (see
+   ``ulib_gcconfig''), if no object of the popped frame has escaped it,
+   all of them are freed without marking, so a frame can be used as a
+   cheap region.  */
 ULIB_IF void ulib_gcpop(void);
 
+/* An object escapes its allocation frame, when it becomes reachable
+   from outside of it - from an object of an older frame or of another
+   heap, from a non-cached root or any other location, which outlives
+   the frame.  Registering an object as a cached root or sharing it
+   records its escape, the shadow stack of the current thread is
+   checked when popping a frame, any other escape must be recorded with
+   one of the functions below.  */
+
+/* Record the escape of the cached object OBJ from its frame.  */
+ULIB_IF void ulib_gcescape(void *obj);
+
+/* Store OBJ, a cached object or null, at FIELD of the cached object
+   HOLDER, or at FIELD outside of the heap, if HOLDER is null, and
+   record the escape of OBJ, if HOLDER belongs to an older frame or to
+   another heap.  */
+ULIB_IF void ulib_gcstore(void *holder, void **field, void *obj);
+
 /* Perform garbage collection.  */
 ULIB_IF void ulib_gcrun(void);
 
+/* Run the finalizers of up to MAX objects, queued for finalization,
+   in the order they were found unreachable, and release them to their
+   caches.  Return the number of finalized objects.  This may be done
+   outside of the collection pause, in any thread, which has the heap
+   as its current one, provided it is serialized with the other uses
+   of the heap.  */
+ULIB_IF unsigned int ulib_gcfinalize(unsigned int max);
+
+/* Return the number of objects, queued for finalization.  */
+ULIB_IF unsigned int ulib_gcfinalize_pending(void);
+
+/* Garbage collector parameters.  */
+#define ULIB_GC_TRIGGER_BYTES 1
+#define ULIB_GC_TRIGGER_SLABS 2
+#define ULIB_GC_GROWTH 3
+#define ULIB_GC_ESCAPES 4
+
+/* Set garbage collector parameters.  The collector is triggered
+   automatically, before a garbage collected cache allocates a new
+   slab, when either the number of bytes (a size_t, given with
+   ULIB_GC_TRIGGER_BYTES) or the number of slabs (an unsigned int,
+   given with ULIB_GC_TRIGGER_SLABS), allocated since the last
+   collection, reaches its limit.  After each collection, the byte
+   limit is raised to the given percentage (an unsigned int, given
+   with ULIB_GC_GROWTH, 100 by default) of the surviving heap, if it
+   is larger.  Zero limits disable automatic collection, which is the
+   default.  With automatic collection enabled, any object, allocated
+   in the current frame, must be reachable from a root across calls to
+   ``ulib_cache_alloc''.  A non-zero unsigned int, given with
+   ULIB_GC_ESCAPES, enables escape tracking - the application promises
+   to record every escape of an object from its frame, see
+   ``ulib_gcescape''.  Throws INVALID_PARAMETER.  */
+ULIB_IF int ulib_gcconfig(int, ...);
+
+/* Number of pause time histogram buckets.  Bucket N counts pauses in
+   the range [2^N, 2^(N+1)) microseconds, the first bucket counts
+   shorter pauses too, the last one counts longer pauses too.  */
+#define ULIB_GCSTATS_BUCKETS 24
+
+/* Number of most recent pause times kept.  */
+#define ULIB_GCSTATS_RECENT 32
+
+/* Counters for a single collection or for all the collections.  */
+struct ulib_gccycle {
+    /* Mark phase duration in nanoseconds.  */
+    unsigned long long mark_time;
+
+    /* Sweep phase duration in nanoseconds.  */
+    unsigned long long sweep_time;
+
+    /* Number of objects marked and scanned.  */
+    unsigned long long objects_scanned;
+
+    /* Number of objects freed.  */
+    unsigned long long objects_freed;
+
+    /* Number of bytes freed.  */
+    unsigned long long bytes_freed;
+
+    /* Number of slabs released to the page allocator.  */
+    unsigned long long slabs_released;
+
+    /* Maximum depth of the mark stack, in entries.  */
+    unsigned long long mark_stack_max;
+
+    /* Number of weak references cleared.  */
+    unsigned long long weak_cleared;
+};
+typedef struct ulib_gccycle ulib_gccycle;
+
+/* Garbage collector statistics.  */
+struct ulib_gcstats {
+    /* Number of completed collections.  */
+    unsigned long long collections;
+
+    /* Counters of the last collection.  */
+    ulib_gccycle last;
+
+    /* Counters accumulated over all the collections.  The mark stack
+     high water is the maximum over all the collections.  */
+    ulib_gccycle total;
+
+    /* Number of bytes in live objects after the last collection.  */
+    unsigned long long heap_live;
+
+    /* Longest pause time in nanoseconds.  */
+    unsigned long long pause_max;
+
+    /* Pause time histogram.  */
+    unsigned long long pause_hist[ULIB_GCSTATS_BUCKETS];
+
+    /* Pause times in nanoseconds of the most recent collections, the
+     one of the N-th collection is at index N % ULIB_GCSTATS_RECENT.  */
+    unsigned long long pause_recent[ULIB_GCSTATS_RECENT];
+};
+typedef struct ulib_gcstats ulib_gcstats;
+
+/* Save the objects of the current heap, reachable from the N ROOTS,
+   to a heap image, written to FD.  The roots and the reachable objects
+   must belong to caches with an image identifier.  Whole slabs are
+   saved, so the image is a sequence of page sized slabs, following the
+   metadata.  The objects, queued for finalization, are finalized
+   first.  Throws NO_MEMORY, INVALID_PARAMETER and the errors of
+   ``write''.  */
+ULIB_IF int ulib_heap_save(int fd, unsigned int n, void *const *roots);
+
+/* Load a heap image, saved with ``ulib_heap_save'', from FD into the
+   current heap and store the relocated N roots at ROOTS.  The current
+   heap must have caches with the same identifiers, sizes and layouts
+   as the saved ones.  The loaded objects become allocated in the
+   current frame.  Throws NO_MEMORY, INVALID_PARAMETER and the errors
+   of ``read''.  */
+ULIB_IF int ulib_heap_load(int fd, unsigned int n, void **roots);
+
+/* Get a consistent snapshot of the garbage collector statistics.  */
+ULIB_IF void ulib_gcstats_get(ulib_gcstats *);
+
+/* Get a consistent snapshot of the garbage collector statistics of
+   HEAP.  Can be called from any thread, without blocking the
+   collector.  */
+ULIB_IF void ulib_gcheap_stats_get(ulib_gcheap *heap, ulib_gcstats *);
+
+/* Reset the garbage collector statistics.  */
+ULIB_IF void ulib_gcstats_reset(void);
+
 END_DECLS
 
 #endif /* ulib__cache_h */
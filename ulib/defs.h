@@ -42,6 +42,23 @@
 #endif
 #endif
 
+/* Thread local storage class.  */
+#if defined(__GNUC__)
+#define ULIB_THREAD __thread
+#elif defined(_MSC_VER)
+#define ULIB_THREAD __declspec(thread)
+#else
+#define ULIB_THREAD _Thread_local
+#endif
+
+/* Prefetch the memory at ADDR.  The RW argument is zero for a read
+   and one for a write access.  */
+#ifdef __GNUC__
+#define ulib_prefetch(addr, rw) __builtin_prefetch((addr), (rw))
+#else
+#define ulib_prefetch(addr, rw) ((void)(addr))
+#endif
+
 typedef void (*ulib_func)();
 
 #include <stddef.h>
@@ -0,0 +1,197 @@
+#include "epoch.h"
+#include "spinlock.h"
+#include <stdatomic.h>
+#include <sched.h>
+
+/* Number of objects, retired into a domain, after which a retirement
+   tries to advance the global epoch.  */
+#define EPOCH_BATCH 64
+
+/* Per thread record.  STATE is zero outside critical sections,
+   otherwise it is the global epoch, observed when entering, shifted
+   left by one, with the lowest bit set.  Each record occupies its own
+   cache line, so readers do not contend.  */
+struct epoch_thread {
+    atomic_ulong state;
+    unsigned int nest;
+    struct epoch_thread *next;
+} __attribute__((aligned(64)));
+
+static struct {
+    /* Lock, which protects the thread records and their cache, and
+     serializes the advances of the global epoch.  */
+    ulib_spinlock lock;
+
+    /* Global epoch.  Modified with the lock held.  */
+    atomic_ulong epoch;
+
+    /* Thread records.  */
+    struct epoch_thread *threads;
+
+    /* Allocator for thread records.  */
+    ulib_cache *thread_cache;
+} E;
+
+/* Record of the current thread.  */
+static ULIB_THREAD struct epoch_thread *epoch_self;
+
+/* Allocate and register the record of the current thread.  */
+static struct epoch_thread *
+epoch_register(void) {
+    struct epoch_thread *t = 0;
+
+    ulib_spin_lock(&E.lock);
+    if (E.thread_cache == 0)
+        E.thread_cache = ulib_cache_create(ULIB_CACHE_SIZE,
+                                           sizeof(struct epoch_thread),
+                                           ULIB_CACHE_ALIGN,
+                                           __alignof__(struct epoch_thread),
+                                           0);
+    if (E.thread_cache && (t = ulib_cache_alloc(E.thread_cache)) != 0) {
+        atomic_init(&t->state, 0);
+        t->nest = 0;
+        t->next = E.threads;
+        E.threads = t;
+    }
+    ulib_spin_unlock(&E.lock);
+    return epoch_self = t;
+}
+
+/* Enter a read-side critical section.  */
+int
+ulib_epoch_enter(void) {
+    struct epoch_thread *t = epoch_self;
+
+    if (t == 0 && (t = epoch_register()) == 0)
+        return -1;
+
+    /* The sequentially consistent store orders the announcement before
+     the loads of the shared pointers in the critical section.  */
+    if (t->nest++ == 0)
+        atomic_store(&t->state,
+                     atomic_load_explicit(&E.epoch, memory_order_relaxed) << 1 | 1);
+    return 0;
+}
+
+/* Leave a read-side critical section.  */
+void
+ulib_epoch_exit(void) {
+    struct epoch_thread *t = epoch_self;
+
+    if (--t->nest == 0)
+        atomic_store_explicit(&t->state, 0, memory_order_release);
+}
+
+/* Advance the global epoch, unless a thread inside a critical section
+   has not observed it yet.  Return zero if the epoch stays the same.
+   Called with the lock held.  */
+static int
+epoch_advance(void) {
+    unsigned long e, s;
+    struct epoch_thread *t;
+
+    e = atomic_load_explicit(&E.epoch, memory_order_relaxed);
+    for (t = E.threads; t; t = t->next) {
+        s = atomic_load(&t->state);
+        if ((s & 1) && (s >> 1) != (e & (~0UL >> 1)))
+            return 0;
+    }
+    atomic_store(&E.epoch, e + 1);
+    return 1;
+}
+
+/* Advance the global epoch N times, waiting for the readers, which
+   lag behind.  */
+static void
+epoch_sync(int n) {
+    while (n > 0) {
+        ulib_spin_lock(&E.lock);
+        n -= epoch_advance();
+        ulib_spin_unlock(&E.lock);
+        if (n > 0)
+            sched_yield();
+    }
+}
+
+/* Release the objects of the domain D, retired two epochs before the
+   global epoch E or earlier: a reader, which could access them,
+   entered its critical section before they were retired and must have
+   left it for the epoch to advance twice.  */
+static void
+epoch_reclaim(ulib_epoch_domain *d, unsigned long e) {
+    unsigned int i, j;
+
+    for (i = 0; i < 3; i++) {
+        if (d->stamp[i] + 2 > e)
+            continue;
+        for (j = 0; j < ulib_vector_length(&d->limbo[i]); j++)
+            ulib_cache_free(d->cache, ulib_vector_ptr_elt(&d->limbo[i], j));
+        ulib_vector_clear(&d->limbo[i], 0);
+    }
+}
+
+/* Initialize an epoch domain.  */
+void
+ulib_epoch_domain_init(ulib_epoch_domain *d, ulib_cache *cache) {
+    unsigned int i;
+
+    d->cache = cache;
+    for (i = 0; i < 3; i++) {
+        ulib_vector_init(&d->limbo[i], ULIB_DATA_PTR_VECTOR, 0);
+        d->stamp[i] = 0;
+    }
+    d->count = 0;
+}
+
+/* Destroy an epoch domain.  */
+void
+ulib_epoch_domain_destroy(ulib_epoch_domain *d) {
+    unsigned int i;
+
+    ulib_epoch_barrier(d);
+    for (i = 0; i < 3; i++)
+        ulib_vector_destroy(&d->limbo[i]);
+}
+
+/* Retire an object.  */
+void
+ulib_epoch_retire(ulib_epoch_domain *d, void *obj) {
+    unsigned long e;
+
+    if (++d->count >= EPOCH_BATCH) {
+        d->count = 0;
+        ulib_spin_lock(&E.lock);
+        epoch_advance();
+        ulib_spin_unlock(&E.lock);
+    }
+
+    /* The fence orders the unlinking of the object before the load of
+       the epoch, it is retired in.  */
+    atomic_thread_fence(memory_order_seq_cst);
+    e = atomic_load(&E.epoch);
+    epoch_reclaim(d, e);
+
+    /* The bucket of the epoch is empty, unless it is already used for
+       it, since older epochs have been reclaimed.  */
+    d->stamp[e % 3] = e;
+    if (ulib_vector_append_ptr(&d->limbo[e % 3], obj) == 0)
+        return;
+
+    /* Out of memory - wait for the readers to leave, instead.  */
+    epoch_sync(2);
+    ulib_cache_free(d->cache, obj);
+}
+
+/* Wait until all the objects, retired into a domain, are released.  */
+void
+ulib_epoch_barrier(ulib_epoch_domain *d) {
+    epoch_sync(2);
+    epoch_reclaim(d, atomic_load(&E.epoch));
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
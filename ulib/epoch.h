@@ -0,0 +1,82 @@
+#ifndef ulib__epoch_h
+#define ulib__epoch_h 1
+
+#include "defs.h"
+#include "ulib-if.h"
+#include "cache.h"
+#include "vector.h"
+
+BEGIN_DECLS
+
+/* Epoch based reclamation.  Readers access shared objects without
+   locks inside read-side critical sections, delimited by
+   ``ulib_epoch_enter'' and ``ulib_epoch_exit''.  A writer, which has
+   unlinked an object from a shared structure, retires it instead of
+   releasing it.  The object is released to its cache only after all
+   the readers, which were inside a critical section when it was
+   retired, have left it.  Entering and leaving a critical section
+   touch only a per thread record, so readers scale with the number of
+   cores.
+
+   Objects are retired into an epoch domain, which belongs to one
+   shared structure and releases them to the cache of its objects.  The
+   retired objects are released by the thread calling
+   ``ulib_epoch_retire'' or ``ulib_epoch_barrier'' on the domain, so
+   the calls must be serialized with the other uses of the cache -
+   typically they are made by writers, holding the lock which protects
+   the shared structure, its cache and its domain.  A thread never
+   releases objects of other domains.  Each thread, which ever entered
+   a critical section, keeps a small record for the lifetime of the
+   process.  */
+
+struct ulib_epoch_domain {
+    /* Cache of the retired objects.  */
+    ulib_cache *cache;
+
+    /* Objects, retired in the last three epochs.  The objects in
+     LIMBO[I] were retired in the epoch STAMP[I], equal to I modulo
+     three.  */
+    ulib_vector limbo[3];
+    unsigned long stamp[3];
+
+    /* Objects retired since the last attempt to advance the global
+     epoch.  */
+    unsigned int count;
+};
+typedef struct ulib_epoch_domain ulib_epoch_domain;
+
+/* Initialize the epoch domain D for objects of CACHE.  */
+ULIB_IF void ulib_epoch_domain_init(ulib_epoch_domain *d, ulib_cache *cache);
+
+/* Destroy the epoch domain D, waiting until all the objects, retired
+   into it, are released.  Must not be called inside a critical
+   section.  */
+ULIB_IF void ulib_epoch_domain_destroy(ulib_epoch_domain *d);
+
+/* Enter a read-side critical section.  Critical sections may nest.
+   Throws NO_MEMORY, only when a thread enters its first critical
+   section.  */
+ULIB_IF int ulib_epoch_enter(void);
+
+/* Leave a read-side critical section.  */
+ULIB_IF void ulib_epoch_exit(void);
+
+/* Release the object OBJ to the cache of the domain D, once no reader
+   can access it anymore.  Must not be called inside a critical
+   section.  */
+ULIB_IF void ulib_epoch_retire(ulib_epoch_domain *d, void *obj);
+
+/* Wait until all the objects, retired into the domain D so far, are
+   released.  Must not be called inside a critical section.  */
+ULIB_IF void ulib_epoch_barrier(ulib_epoch_domain *d);
+
+END_DECLS
+
+#endif /* ulib__epoch_h */
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,5 +1,7 @@
 #include "pgalloc.h"
 #include "list.h"
+#include "spinlock.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <inttypes.h>
@@ -44,7 +46,13 @@ static struct {
 
     /* Allocator page size. */
     uintptr_t pgsize;
-} G = {{0, 0}, 0, 0, 4096};
+
+    /* Lock, which serializes the allocations and the releases.  */
+    ulib_spinlock lock;
+
+    /* Initialized flag.  */
+    int initialized;
+} G = {{0, 0}, 0, 0, 4096, 0, 0};
 
 /* Initialize the page allocator.  */
 static void
@@ -107,18 +115,18 @@ pgalloc(struct pgroup *grp) {
     return (char *)grp->page + i * G.pgsize;
 }
 
-/* Allocate a page, aligned on a page size boundary.  */
-void *
-ulib_pgalloc() {
+/* Allocate a page, aligned on a page size boundary.  Called with the
+   allocator lock held.  */
+static void *
+pgalloc_locked() {
     void *ptr;
     struct pgroup *grp;
     struct pgroup_tree *node;
 
-    /* Ensure allocator is initialized.  FIXME: thread safety.  */
-    static int initialized = 0;
-    if (!initialized) {
+    /* Ensure allocator is initialized.  */
+    if (!G.initialized) {
         pgalloc_init();
-        initialized = 1;
+        G.initialized = 1;
     }
 
     /* Check if there's a non-empty group.  */
@@ -156,6 +164,7 @@ ulib_pgalloc() {
 
             ulib_list_insert(&G.groups, &node->data.list);
             pgroup_tree_insert(&G.root, node);
+            ULIB_TRACE2(pgroup_alloc, (uintptr_t)node->data.page, node->data.map);
 
             return pgalloc(&node->data);
         }
@@ -164,6 +173,17 @@ ulib_pgalloc() {
     return 0;
 }
 
+/* Allocate a page, aligned on a page size boundary.  */
+void *
+ulib_pgalloc() {
+    void *ptr;
+
+    ulib_spin_lock(&G.lock);
+    ptr = pgalloc_locked();
+    ulib_spin_unlock(&G.lock);
+    return ptr;
+}
+
 /* Mark as available from GRP the page at PTR.  */
 static inline void
 pgfree(struct pgroup *grp, void *ptr) {
@@ -177,6 +197,8 @@ ulib_pgfree(void *ptr) {
     struct pgroup_tree *grp;
     unsigned int omap;
 
+    ulib_spin_lock(&G.lock);
+
     /* Find the group, which contains the block. */
     grp = G.root = pgroup_tree_splay(G.root, ptr);
     while (1) {
@@ -200,6 +222,7 @@ ulib_pgfree(void *ptr) {
         if (G.free == &grp->data)
             G.free = (struct pgroup *)grp->data.list.next;
         ulib_list_remove(&grp->data.list);
+        ULIB_TRACE1(pgroup_release, (uintptr_t)grp->data.page);
         free(grp->key);
         free(grp);
     }
@@ -210,6 +233,7 @@ ulib_pgfree(void *ptr) {
         ulib_list_insert(G.free, &grp->data.list);
         G.free = (struct pgroup *)&grp->data;
     }
+    ulib_spin_unlock(&G.lock);
 }
 
 /*
@@ -0,0 +1,261 @@
+#include "shcache.h"
+#include "pgalloc.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+
+/* Free list heads and links combine an offset in the low bits with a
+   modification tag in the high bits, which protects the lock-free
+   list against the ABA problem.  */
+#define OFF_BITS 40
+#define OFF_MASK (((uint64_t)1 << OFF_BITS) - 1)
+#define TAG_ONE ((uint64_t)1 << OFF_BITS)
+
+#define SHCACHE_MAGIC 0x65686361636873ULL
+#define SHCACHE_VERSION 1
+
+/* Shared cache region header.  Located at the beginning of the region,
+   so no object has a zero offset, which is used as a null link.  */
+struct region {
+    uint64_t magic;
+    uint32_t version;
+
+    /* Buffer size and alignment of objects.  */
+    uint32_t size;
+    uint32_t align;
+
+    /* Slab size.  */
+    uint32_t slab_size;
+
+    /* Region length.  */
+    uint64_t len;
+
+    /* Offset of the next slab, not carved into objects yet.  */
+    _Atomic uint64_t next;
+
+    /* Free objects list head.  */
+    _Atomic uint64_t free;
+};
+
+/* Process private shared cache handle.  */
+struct ulib_shcache {
+    /* Beginning of the region in this process.  */
+    char *base;
+
+    /* The region header.  */
+    struct region *region;
+};
+
+/* Align N to A boundary.  */
+static inline uint64_t
+align_u64(uint64_t n, uint64_t a) {
+    return (n + a - 1) & -a;
+}
+
+/* Return the free list link of the object at offset OFF.  */
+static inline _Atomic uint64_t *
+link_at(const ulib_shcache *sc, uint64_t off) {
+    return (_Atomic uint64_t *)(sc->base + off);
+}
+
+/* Create a shared cache.  */
+ulib_shcache *
+ulib_shcache_create(void *mem, size_t len, int attr, ...) {
+    va_list ap;
+    ulib_shcache *sc;
+    struct region *r = (struct region *)mem;
+    unsigned int size = 0, align = 0;
+
+    va_start(ap, attr);
+    do {
+        switch (attr) {
+        case ULIB_CACHE_SIZE:
+            size = va_arg(ap, unsigned int);
+            if (size > ULIB_CACHE_OBJECT_SIZE_MAX)
+                goto einval;
+            break;
+
+        case ULIB_CACHE_ALIGN:
+            align = va_arg(ap, unsigned int);
+            if (align > ULIB_CACHE_OBJECT_ALIGN_MAX || (align & (align - 1)) != 0)
+                goto einval;
+            break;
+
+        case 0:
+            break;
+
+        default:
+            goto einval;
+        }
+        attr = va_arg(ap, unsigned int);
+    } while (attr);
+    va_end(ap);
+
+    /* The free list must work across processes, i.e. without a
+     lock.  */
+    if (!atomic_is_lock_free(&r->free)) {
+        errno = ENOTSUP;
+        return 0;
+    }
+
+    if (size < sizeof(uint64_t))
+        size = sizeof(uint64_t);
+    if (align < sizeof(uint64_t))
+        align = sizeof(uint64_t);
+    size = align_u64(size, align);
+
+    if (((uintptr_t)mem & (align - 1)) != 0 || len > OFF_MASK
+        || align_u64(sizeof(struct region), align) + size > len) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if ((sc = malloc(sizeof(ulib_shcache))) == 0)
+        return 0;
+    sc->base = (char *)mem;
+    sc->region = r;
+
+    r->magic = SHCACHE_MAGIC;
+    r->version = SHCACHE_VERSION;
+    r->size = size;
+    r->align = align;
+    r->slab_size = ulib_pgsize() < size ? size : ulib_pgsize();
+    r->len = len;
+    atomic_init(&r->next, align_u64(sizeof(struct region), align));
+    atomic_init(&r->free, 0);
+    return sc;
+
+einval:
+    va_end(ap);
+    errno = EINVAL;
+    return 0;
+}
+
+/* Attach to a shared cache.  */
+ulib_shcache *
+ulib_shcache_attach(void *mem, size_t len) {
+    ulib_shcache *sc;
+    struct region *r = (struct region *)mem;
+
+    /* The header may have been written by anyone, who can map the
+     region, so check it, before using its fields.  */
+    if (len < sizeof(struct region) || r->magic != SHCACHE_MAGIC
+        || r->version != SHCACHE_VERSION || r->len != len
+        || r->align < sizeof(uint64_t) || r->align > ULIB_CACHE_OBJECT_ALIGN_MAX
+        || (r->align & (r->align - 1)) != 0 || ((uintptr_t)mem & (r->align - 1)) != 0
+        || r->size < r->align || (r->size & (r->align - 1)) != 0
+        || r->slab_size < r->size) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if ((sc = malloc(sizeof(ulib_shcache))) == 0)
+        return 0;
+    sc->base = (char *)mem;
+    sc->region = r;
+    return sc;
+}
+
+/* Detach from a shared cache.  */
+void
+ulib_shcache_detach(ulib_shcache *sc) {
+    free(sc);
+}
+
+/* Push the chain of objects from offset FIRST to offset LAST, linked
+   through their first words, on the free list of SC.  */
+static void
+shcache_push(ulib_shcache *sc, uint64_t first, uint64_t last) {
+    struct region *r = sc->region;
+    uint64_t head, next;
+
+    head = atomic_load_explicit(&r->free, memory_order_relaxed);
+    do {
+        atomic_store_explicit(link_at(sc, last), head & OFF_MASK, memory_order_relaxed);
+        next = ((head & ~OFF_MASK) + TAG_ONE) | first;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &r->free, &head, next, memory_order_release, memory_order_relaxed));
+}
+
+/* Carve a new slab into objects.  Return the offset of one of them and
+   put the rest on the free list.  Return zero if the region is
+   exhausted.  */
+static uint64_t
+shcache_grow(ulib_shcache *sc) {
+    struct region *r = sc->region;
+    uint64_t off, end, obj;
+
+    off = atomic_load_explicit(&r->next, memory_order_relaxed);
+    do {
+        if (off + r->size > r->len)
+            return 0;
+        end = off + r->slab_size;
+        if (end > r->len)
+            end = r->len;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &r->next, &off, end, memory_order_relaxed, memory_order_relaxed));
+
+    /* Link the objects after the first one.  */
+    end = off + (end - off) / r->size * r->size;
+    if (off + r->size < end) {
+        for (obj = off + r->size; obj + r->size < end; obj += r->size)
+            atomic_store_explicit(link_at(sc, obj), obj + r->size, memory_order_relaxed);
+        shcache_push(sc, off + r->size, obj);
+    }
+    return off;
+}
+
+/* Allocate an object from a shared cache.  */
+void *
+ulib_shcache_alloc(ulib_shcache *sc) {
+    struct region *r = sc->region;
+    uint64_t head, next;
+
+    /* Pop an object off the free list.  The link of the head object may
+     be changed concurrently, after it was popped by another process,
+     in which case the tag of the head has changed as well and the
+     exchange fails.  */
+    head = atomic_load_explicit(&r->free, memory_order_acquire);
+    while (head & OFF_MASK) {
+        next = atomic_load_explicit(link_at(sc, head & OFF_MASK), memory_order_relaxed);
+        next |= (head & ~OFF_MASK) + TAG_ONE;
+        if (atomic_compare_exchange_weak_explicit(
+                &r->free, &head, next, memory_order_acquire, memory_order_acquire))
+            return sc->base + (head & OFF_MASK);
+    }
+
+    if ((next = shcache_grow(sc)) == 0) {
+        errno = ENOMEM;
+        return 0;
+    }
+    return sc->base + next;
+}
+
+/* Release an object to a shared cache.  */
+void
+ulib_shcache_free(ulib_shcache *sc, void *ptr) {
+    uint64_t off = (char *)ptr - sc->base;
+
+    shcache_push(sc, off, off);
+}
+
+/* Return the offset of an object.  */
+size_t
+ulib_shcache_offset(const ulib_shcache *sc, const void *ptr) {
+    return (const char *)ptr - sc->base;
+}
+
+/* Return the address of an object.  */
+void *
+ulib_shcache_ptr(const ulib_shcache *sc, size_t off) {
+    return sc->base + off;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
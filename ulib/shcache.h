@@ -0,0 +1,62 @@
+#ifndef ulib__shcache_h
+#define ulib__shcache_h 1
+
+#include "defs.h"
+#include "ulib-if.h"
+#include "cache.h"
+#include <stddef.h>
+
+BEGIN_DECLS
+
+/* Process-shared object caches.  A shared cache lives entirely in a
+   memory region, supplied by the caller, e.g. a file or a shared
+   memory object, mapped by several processes, possibly at different
+   addresses.  The region is divided into page sized slabs, which are
+   carved into objects on demand.  All the links in the region are
+   offsets from its beginning and the free objects are kept in a
+   lock-free list, so a process, which dies in the middle of an
+   operation, never leaves the cache locked.  Objects can be exchanged
+   between processes as offsets.  */
+
+typedef struct ulib_shcache ulib_shcache;
+
+/* Create a shared cache in the region of LEN bytes at MEM.  The
+   attributes are ULIB_CACHE_SIZE and ULIB_CACHE_ALIGN.  Free objects
+   hold a 64-bit link, so the object size and alignment are at least
+   eight bytes.  MEM must be aligned at least as the objects.  The
+   returned handle is private to the calling process.  Throws
+   NO_MEMORY, INVALID_PARAMETER, NOT_SUPPORTED.  */
+ULIB_IF ulib_shcache *ulib_shcache_create(void *mem, size_t len, int, ...);
+
+/* Attach to the shared cache in the region of LEN bytes at MEM,
+   created by ``ulib_shcache_create'', possibly in another process and
+   at a different address.  Throws NO_MEMORY, INVALID_PARAMETER.  */
+ULIB_IF ulib_shcache *ulib_shcache_attach(void *mem, size_t len);
+
+/* Detach from a shared cache.  The region itself is left intact, the
+   objects, allocated by the process, remain allocated.  */
+ULIB_IF void ulib_shcache_detach(ulib_shcache *);
+
+/* Allocate an object from a shared cache.  Throws NO_MEMORY.  */
+ULIB_IF void *ulib_shcache_alloc(ulib_shcache *);
+
+/* Release an object to a shared cache.  */
+ULIB_IF void ulib_shcache_free(ulib_shcache *, void *);
+
+/* Return the offset of the object PTR in the region of the cache.  */
+ULIB_IF size_t ulib_shcache_offset(const ulib_shcache *, const void *ptr);
+
+/* Return the address of the object at offset OFF in the region of the
+   cache.  */
+ULIB_IF void *ulib_shcache_ptr(const ulib_shcache *, size_t off);
+
+END_DECLS
+
+#endif /* ulib__shcache_h */
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
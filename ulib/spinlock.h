@@ -0,0 +1,44 @@
+#ifndef ulib__spinlock_h
+#define ulib__spinlock_h 1
+
+#include "defs.h"
+#include <stdatomic.h>
+
+BEGIN_DECLS
+
+/* Spin lock.  A zero initialized lock is unlocked.  Intended for
+   short critical sections only.  */
+typedef atomic_int ulib_spinlock;
+
+/* Acquire the spin lock LOCK.  */
+static inline void
+ulib_spin_lock(ulib_spinlock *lock) {
+    while (atomic_exchange_explicit(lock, 1, memory_order_acquire))
+        while (atomic_load_explicit(lock, memory_order_relaxed))
+            ;
+}
+
+/* Try to acquire the spin lock LOCK without waiting.  Return non-zero
+   if acquired.  */
+static inline int
+ulib_spin_trylock(ulib_spinlock *lock) {
+    return !atomic_load_explicit(lock, memory_order_relaxed)
+           && !atomic_exchange_explicit(lock, 1, memory_order_acquire);
+}
+
+/* Release the spin lock LOCK.  */
+static inline void
+ulib_spin_unlock(ulib_spinlock *lock) {
+    atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+END_DECLS
+
+#endif /* ulib__spinlock_h */
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */
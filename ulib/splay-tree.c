@@ -112,6 +112,47 @@ ULIB_SPLAY_TREE(delete)(ULIB_SPLAY_TREE_TYPE **r, ULIB_SPLAY_TREE_KEY_TYPE k) {
     }
 }
 
+#ifdef ULIB_SPLAY_TREE_READ_MOSTLY
+
+#ifdef ULIB_SPLAY_TREE_DATA_TYPE
+ULIB_STATIC ULIB_SPLAY_TREE_DATA_TYPE *
+#else
+ULIB_STATIC int
+#endif
+ULIB_SPLAY_TREE(access)(ULIB_SPLAY_TREE_TYPE **r,
+                        unsigned int *count,
+                        ULIB_SPLAY_TREE_KEY_TYPE k) {
+    ULIB_SPLAY_TREE_TYPE *t;
+    unsigned int depth = 0;
+
+    for (t = *r; t; depth++) {
+        if (ULIB_SPLAY_TREE_COMPARE(k, t->key) < 0)
+            t = t->left;
+        else if (ULIB_SPLAY_TREE_COMPARE(k, t->key) > 0)
+            t = t->right;
+        else
+            break;
+    }
+
+    if (depth > ULIB_SPLAY_TREE_SPLAY_DEPTH
+        || (ULIB_SPLAY_TREE_SPLAY_PERIOD && count
+            && ++*count % ULIB_SPLAY_TREE_SPLAY_PERIOD == 0)) {
+        t = *r = ULIB_SPLAY_TREE(splay)(*r, k);
+        if (t && ULIB_SPLAY_TREE_COMPARE(t->key, k) != 0)
+            t = 0;
+    }
+
+    if (t == 0)
+        return 0;
+#ifdef ULIB_SPLAY_TREE_DATA_TYPE
+    return &t->data;
+#else
+    return 1;
+#endif
+}
+
+#endif /* ULIB_SPLAY_TREE_READ_MOSTLY */
+
 /*
  * Local variables:
  * mode: C
@@ -18,6 +18,23 @@ BEGIN_DECLS
 #define ULIB_STATIC extern
 #endif
 
+/* Read-mostly mode.  If ULIB_SPLAY_TREE_READ_MOSTLY is defined,
+   ``lookup'' does a plain binary search and never modifies the tree,
+   so concurrent lookups can share the tree under a reader lock.  The
+   tree is restructured by insertions and deletions and by ``access'',
+   a lookup, which splays the tree only if the key is deeper than
+   ULIB_SPLAY_TREE_SPLAY_DEPTH or on every ULIB_SPLAY_TREE_SPLAY_PERIOD-th
+   call for the tree, if that is non-zero.  */
+#ifdef ULIB_SPLAY_TREE_READ_MOSTLY
+#ifndef ULIB_SPLAY_TREE_SPLAY_DEPTH
+#define ULIB_SPLAY_TREE_SPLAY_DEPTH 32
+#endif
+
+#ifndef ULIB_SPLAY_TREE_SPLAY_PERIOD
+#define ULIB_SPLAY_TREE_SPLAY_PERIOD 0
+#endif
+#endif
+
 #define ULIB___SPLAY_TREE(a, b) a##_##b
 #define ULIB__SPLAY_TREE(a, b) ULIB___SPLAY_TREE(a, b)
 #define ULIB_SPLAY_TREE(x) ULIB__SPLAY_TREE(ULIB_SPLAY_TREE_TYPE, x)
@@ -43,6 +60,48 @@ ULIB_STATIC int ULIB_SPLAY_TREE(insert)(ULIB_SPLAY_TREE_TYPE **, ULIB_SPLAY_TREE
 ULIB_STATIC ULIB_SPLAY_TREE_TYPE *ULIB_SPLAY_TREE(delete)(ULIB_SPLAY_TREE_TYPE **,
                                                           ULIB_SPLAY_TREE_KEY_TYPE);
 
+#ifdef ULIB_SPLAY_TREE_READ_MOSTLY
+
+/* Lookup a key in the tree, splaying it, if the key is too deep or
+   periodically.  The calls for the tree are counted in *COUNT, which
+   the caller keeps with the root, initially zero.  Without a COUNT,
+   the tree is splayed only for deep keys.  Requires exclusive access
+   to the tree.  */
+#ifdef ULIB_SPLAY_TREE_DATA_TYPE
+ULIB_STATIC ULIB_SPLAY_TREE_DATA_TYPE *
+#else
+ULIB_STATIC int
+#endif
+    ULIB_SPLAY_TREE(access)(ULIB_SPLAY_TREE_TYPE **r,
+                            unsigned int *count,
+                            ULIB_SPLAY_TREE_KEY_TYPE k);
+
+/* Lookup a key in the tree without modifying it.  */
+#ifdef ULIB_SPLAY_TREE_DATA_TYPE
+static inline ULIB_SPLAY_TREE_DATA_TYPE *
+#else
+static inline int
+#endif
+ULIB_SPLAY_TREE(lookup)(ULIB_SPLAY_TREE_TYPE **r, ULIB_SPLAY_TREE_KEY_TYPE k) {
+    ULIB_SPLAY_TREE_TYPE *t = *r;
+
+    while (t) {
+        if (ULIB_SPLAY_TREE_COMPARE(k, t->key) < 0)
+            t = t->left;
+        else if (ULIB_SPLAY_TREE_COMPARE(k, t->key) > 0)
+            t = t->right;
+        else
+#ifdef ULIB_SPLAY_TREE_DATA_TYPE
+            return &t->data;
+#else
+            return 1;
+#endif
+    }
+    return 0;
+}
+
+#else
+
 /* Lookup a key in the tree.  */
 #ifdef ULIB_SPLAY_TREE_DATA_TYPE
 static inline ULIB_SPLAY_TREE_DATA_TYPE *
@@ -61,6 +120,282 @@ ULIB_SPLAY_TREE(lookup)(ULIB_SPLAY_TREE_TYPE **r, ULIB_SPLAY_TREE_KEY_TYPE k) {
         return 0;
 }
 
+#endif /* ULIB_SPLAY_TREE_READ_MOSTLY */
+
+/* Build a tree of the N nodes at NODES, which must be sorted by key
+   in ascending order, without duplicates, in linear time.  The tree is
+   perfectly balanced.  Return the root of the tree.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(build_sorted)(ULIB_SPLAY_TREE_TYPE **nodes, unsigned int n) {
+    ULIB_SPLAY_TREE_TYPE *r;
+
+    if (n == 0)
+        return 0;
+
+    r = nodes[n / 2];
+    r->left = ULIB_SPLAY_TREE(build_sorted)(nodes, n / 2);
+    r->right = ULIB_SPLAY_TREE(build_sorted)(nodes + n / 2 + 1, n - n / 2 - 1);
+    return r;
+}
+
+/* Return the node with the smallest key or null if the tree is
+   empty.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(first)(ULIB_SPLAY_TREE_TYPE *r) {
+    if (r)
+        while (r->left)
+            r = r->left;
+    return r;
+}
+
+/* Return the node with the largest key or null if the tree is
+   empty.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(last)(ULIB_SPLAY_TREE_TYPE *r) {
+    if (r)
+        while (r->right)
+            r = r->right;
+    return r;
+}
+
+/* Return the node with the smallest key, not less than K, or null if
+   there is no such node.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(lower_bound)(ULIB_SPLAY_TREE_TYPE *r, ULIB_SPLAY_TREE_KEY_TYPE k) {
+    ULIB_SPLAY_TREE_TYPE *n = 0;
+
+    while (r) {
+        if (ULIB_SPLAY_TREE_COMPARE(r->key, k) < 0)
+            r = r->right;
+        else {
+            n = r;
+            r = r->left;
+        }
+    }
+    return n;
+}
+
+/* Return the node with the smallest key, greater than K, or null if
+   there is no such node.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(upper_bound)(ULIB_SPLAY_TREE_TYPE *r, ULIB_SPLAY_TREE_KEY_TYPE k) {
+    ULIB_SPLAY_TREE_TYPE *n = 0;
+
+    while (r) {
+        if (ULIB_SPLAY_TREE_COMPARE(r->key, k) <= 0)
+            r = r->right;
+        else {
+            n = r;
+            r = r->left;
+        }
+    }
+    return n;
+}
+
+#ifdef ULIB_SPLAY_TREE_READ_MOSTLY
+
+/* Return the node, following the node N in the tree at R, or null if N
+   is the last one.  Searches from the root, without modifying the
+   tree, so each call takes time proportional to the depth of N, which
+   is linear in a degenerate tree.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(next)(ULIB_SPLAY_TREE_TYPE **r, const ULIB_SPLAY_TREE_TYPE *n) {
+    return ULIB_SPLAY_TREE(upper_bound)(*r, n->key);
+}
+
+/* Return the node, preceding the node N in the tree at R, or null if N
+   is the first one.  Takes time proportional to the depth of N, like
+   ``next''.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(prev)(ULIB_SPLAY_TREE_TYPE **r, const ULIB_SPLAY_TREE_TYPE *n) {
+    ULIB_SPLAY_TREE_TYPE *t = *r, *p = 0;
+
+    while (t) {
+        if (ULIB_SPLAY_TREE_COMPARE(t->key, n->key) < 0) {
+            p = t;
+            t = t->right;
+        } else
+            t = t->left;
+    }
+    return p;
+}
+
+/* Size of the node stack of ``range''.  A deeper tree is still walked
+   correctly, only slower.  */
+#ifndef ULIB_SPLAY_TREE_STACK_SIZE
+#define ULIB_SPLAY_TREE_STACK_SIZE 64
+#endif
+
+/* Push the node N on the stack of ``range''.  When the stack is full,
+   drop its bottom half, i.e. the nodes with the largest keys, and
+   return non-zero, so they are found again later.  */
+static inline int
+ULIB_SPLAY_TREE(range_push)(ULIB_SPLAY_TREE_TYPE **stk,
+                            unsigned int *n,
+                            ULIB_SPLAY_TREE_TYPE *t) {
+    unsigned int i;
+    int overflow = 0;
+
+    if (*n == ULIB_SPLAY_TREE_STACK_SIZE) {
+        for (i = 0; i < ULIB_SPLAY_TREE_STACK_SIZE / 2; i++)
+            stk[i] = stk[i + ULIB_SPLAY_TREE_STACK_SIZE / 2];
+        *n -= ULIB_SPLAY_TREE_STACK_SIZE / 2;
+        overflow = 1;
+    }
+    stk[(*n)++] = t;
+    return overflow;
+}
+
+/* Invoke FN with each node with a key in the range [LO, HI] in
+   ascending key order and ARG.  Stop if FN returns non-zero and return
+   that value, return zero after the last node in the range.  FN must
+   not modify the tree.  The tree is not modified either, so the walk
+   may share it with the lookups.  In a tree deeper than
+   ULIB_SPLAY_TREE_STACK_SIZE, the walk restarts from the root after
+   every half a stack of nodes, which makes it quadratic in a
+   degenerate tree.  */
+static inline int
+ULIB_SPLAY_TREE(range)(ULIB_SPLAY_TREE_TYPE *r,
+                       ULIB_SPLAY_TREE_KEY_TYPE lo,
+                       ULIB_SPLAY_TREE_KEY_TYPE hi,
+                       int (*fn)(ULIB_SPLAY_TREE_TYPE *, void *),
+                       void *arg) {
+    ULIB_SPLAY_TREE_TYPE *stk[ULIB_SPLAY_TREE_STACK_SIZE], *t;
+    unsigned int n;
+    int ret, strict = 0, overflow;
+
+    do {
+        /* Find the path to the first node in the range - with a key,
+         not less than LO, or, when resuming after dropping nodes from
+         the stack, greater than the key of the last visited node.  */
+        n = 0;
+        overflow = 0;
+        for (t = r; t;) {
+            if (ULIB_SPLAY_TREE_COMPARE(t->key, lo) < 0
+                || (strict && ULIB_SPLAY_TREE_COMPARE(t->key, lo) == 0))
+                t = t->right;
+            else {
+                overflow |= ULIB_SPLAY_TREE(range_push)(stk, &n, t);
+                t = t->left;
+            }
+        }
+
+        while (n > 0) {
+            t = stk[--n];
+            if (ULIB_SPLAY_TREE_COMPARE(t->key, hi) > 0)
+                return 0;
+
+            if ((ret = fn(t, arg)) != 0)
+                return ret;
+
+            lo = t->key;
+            strict = 1;
+            for (t = t->right; t; t = t->left)
+                overflow |= ULIB_SPLAY_TREE(range_push)(stk, &n, t);
+        }
+    } while (overflow);
+
+    return 0;
+}
+
+#else
+
+/* Return the node, following the node N in the tree at R, or null if N
+   is the last one.  Splays N to the root, so walking the whole tree
+   with ``first'' and ``next'' takes linear time, whatever the shape of
+   the tree.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(next)(ULIB_SPLAY_TREE_TYPE **r, const ULIB_SPLAY_TREE_TYPE *n) {
+    ULIB_SPLAY_TREE_TYPE *t;
+
+    *r = ULIB_SPLAY_TREE(splay)(*r, n->key);
+    if ((t = (*r)->right) != 0)
+        while (t->left)
+            t = t->left;
+    return t;
+}
+
+/* Return the node, preceding the node N in the tree at R, or null if N
+   is the first one.  Splays N to the root, like ``next''.  */
+static inline ULIB_SPLAY_TREE_TYPE *
+ULIB_SPLAY_TREE(prev)(ULIB_SPLAY_TREE_TYPE **r, const ULIB_SPLAY_TREE_TYPE *n) {
+    ULIB_SPLAY_TREE_TYPE *t;
+
+    *r = ULIB_SPLAY_TREE(splay)(*r, n->key);
+    if ((t = (*r)->left) != 0)
+        while (t->right)
+            t = t->right;
+    return t;
+}
+
+/* Remove the threads, which an interrupted ``range'' walk of the tree
+   R left behind, leading to the ancestors of the node N.  */
+static inline void
+ULIB_SPLAY_TREE(range_unthread)(ULIB_SPLAY_TREE_TYPE *r, const ULIB_SPLAY_TREE_TYPE *n) {
+    ULIB_SPLAY_TREE_TYPE *p;
+
+    while (r != n) {
+        if (ULIB_SPLAY_TREE_COMPARE(n->key, r->key) < 0) {
+            for (p = r->left; p->right && p->right != r; p = p->right)
+                ;
+            if (p->right == r)
+                p->right = 0;
+            r = r->left;
+        } else
+            r = r->right;
+    }
+}
+
+/* Invoke FN with each node with a key in the range [LO, HI] in
+   ascending key order and ARG.  Stop if FN returns non-zero and return
+   that value, return zero after the last node in the range.  The walk
+   needs no stack and takes at most linear time, whatever the shape of
+   the tree: instead of returning to a node from its left subtree
+   through a stack, it temporarily links the right pointer of the
+   predecessor of the node back to it.  The tree is restored before
+   returning, meanwhile FN must not access the tree, nor follow the
+   links of the node.  */
+static inline int
+ULIB_SPLAY_TREE(range)(ULIB_SPLAY_TREE_TYPE *r,
+                       ULIB_SPLAY_TREE_KEY_TYPE lo,
+                       ULIB_SPLAY_TREE_KEY_TYPE hi,
+                       int (*fn)(ULIB_SPLAY_TREE_TYPE *, void *),
+                       void *arg) {
+    ULIB_SPLAY_TREE_TYPE *t = r, *p;
+    int ret = 0;
+
+    while (t) {
+        /* The node and its left subtree are before the range.  */
+        if (ULIB_SPLAY_TREE_COMPARE(t->key, lo) < 0) {
+            t = t->right;
+            continue;
+        }
+
+        /* Link the predecessor to the node and walk the left subtree,
+         or remove the link, when back from there.  */
+        if ((p = t->left) != 0) {
+            while (p->right && p->right != t)
+                p = p->right;
+            if (p->right == 0) {
+                p->right = t;
+                t = t->left;
+                continue;
+            }
+            p->right = 0;
+        }
+
+        if (ULIB_SPLAY_TREE_COMPARE(t->key, hi) > 0 || (ret = fn(t, arg)) != 0)
+            break;
+        t = t->right;
+    }
+
+    if (t)
+        ULIB_SPLAY_TREE(range_unthread)(r, t);
+    return ret;
+}
+
+#endif /* ULIB_SPLAY_TREE_READ_MOSTLY */
+
 END_DECLS
 
 /*
@@ -1,9 +1,12 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "time.h"
 
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <sys/time.h>
+#include <time.h>
 #endif
 
 /* Get current time.  */
@@ -32,6 +35,26 @@ ulib_gettime(ulib_time *timep) {
 #endif /* _WIN32 */
 }
 
+/* Get a monotonic timestamp in nanoseconds.  */
+unsigned long long
+ulib_nanotime() {
+#ifdef _WIN32
+    LARGE_INTEGER cnt, freq;
+
+    QueryPerformanceCounter(&cnt);
+    QueryPerformanceFrequency(&freq);
+
+    return (unsigned long long)(cnt.QuadPart / freq.QuadPart) * 1000000000ULL
+           + (unsigned long long)(cnt.QuadPart % freq.QuadPart) * 1000000000ULL
+                 / freq.QuadPart;
+#else  /* ! _WIN32 */
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif /* _WIN32 */
+}
+
 /*
  * Local variables:
  * mode: C
@@ -19,6 +19,10 @@ typedef struct ulib_time ulib_time;
 /* Get current time.  */
 ULIB_IF void ulib_gettime(ulib_time *);
 
+/* Get a monotonic timestamp in nanoseconds, suitable for measuring
+   time intervals.  */
+ULIB_IF unsigned long long ulib_nanotime(void);
+
 END_DECLS
 #endif /* ulib__time_h */
 
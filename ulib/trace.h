@@ -0,0 +1,114 @@
+#ifndef ulib__trace_h
+#define ulib__trace_h 1
+
+#include "defs.h"
+
+/* Static tracepoints.  With ULIB_USDT defined, each ULIB_TRACE<N>
+   (NAME, ...) expands to a USDT probe ulib:NAME with N arguments,
+   which tools like perf, bpftrace or SystemTap can attach to.  A probe
+   is a single nop instruction and an ELF note, describing where the
+   arguments are, so it costs nothing beyond computing the arguments,
+   when not attached.  The arguments are integers, pointers must be
+   cast to uintptr_t.  The probes of <sys/sdt.h> are used if available,
+   otherwise equivalent notes are emitted directly on x86-64 and
+   AArch64 ELF targets.  Without ULIB_USDT the probes expand to
+   nothing.  */
+
+#if defined(ULIB_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define ULIB_TRACE_SDT 1
+#endif
+#endif
+
+#if defined(ULIB_USDT) && defined(ULIB_TRACE_SDT)
+
+#include <sys/sdt.h>
+
+#define ULIB_TRACE0(name) DTRACE_PROBE(ulib, name)
+#define ULIB_TRACE1(name, a1) DTRACE_PROBE1(ulib, name, a1)
+#define ULIB_TRACE2(name, a1, a2) DTRACE_PROBE2(ulib, name, a1, a2)
+#define ULIB_TRACE3(name, a1, a2, a3) DTRACE_PROBE3(ulib, name, a1, a2, a3)
+#define ULIB_TRACE4(name, a1, a2, a3, a4) DTRACE_PROBE4(ulib, name, a1, a2, a3, a4)
+
+#elif defined(ULIB_USDT) && defined(__GNUC__) && defined(__ELF__)                   \
+    && (defined(__x86_64__) || defined(__aarch64__))
+
+/* Size of an argument, negative if it is signed.  Shifting all ones
+   down to the sign bit gives -1 for signed and 1 for unsigned types.  */
+#define ULIB__TRACE_SIZE(x)                                                     \
+    ((int)sizeof((x) + 0)                                                       \
+     * (int)((__typeof__((x) + 0))-1 >> (8 * sizeof((x) + 0) - 1)))
+
+#define ULIB__TRACE_ARG(n, x) [ulib__s##n] "n"(ULIB__TRACE_SIZE(x)), [ulib__a##n] "nor"(x)
+
+#define ULIB__TRACE_FMT(n) "%c[ulib__s" #n "]@%[ulib__a" #n "]"
+
+/* Emit the probe site NAME, the note, describing it, and the probe
+   base section, which tools use to compute the load bias.  */
+#define ULIB__TRACE(name, args, ...)                                            \
+    __asm__ __volatile__("990: nop\n"                                           \
+                         ".pushsection .note.stapsdt,\"?\",\"note\"\n"          \
+                         ".balign 4\n"                                          \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                     \
+                         "991: .asciz \"stapsdt\"\n"                            \
+                         "992: .balign 4\n"                                     \
+                         "993: .8byte 990b\n"                                   \
+                         ".8byte _.stapsdt.base\n"                              \
+                         ".8byte 0\n"                                           \
+                         ".asciz \"ulib\"\n"                                    \
+                         ".asciz \"" #name "\"\n"                               \
+                         ".asciz \"" args "\"\n"                                \
+                         "994: .balign 4\n"                                     \
+                         ".popsection\n"                                        \
+                         ".ifndef _.stapsdt.base\n"                             \
+                         ".pushsection .stapsdt.base,\"aG\",\"progbits\","      \
+                         ".stapsdt.base,comdat\n"                               \
+                         ".weak _.stapsdt.base\n"                               \
+                         ".hidden _.stapsdt.base\n"                             \
+                         "_.stapsdt.base: .space 1\n"                           \
+                         ".size _.stapsdt.base, 1\n"                            \
+                         ".popsection\n"                                        \
+                         ".endif\n"                                             \
+                         :                                                      \
+                         : __VA_ARGS__)
+
+#define ULIB_TRACE0(name) ULIB__TRACE(name, "", "i"(0))
+#define ULIB_TRACE1(name, a1) ULIB__TRACE(name, ULIB__TRACE_FMT(1), ULIB__TRACE_ARG(1, a1))
+#define ULIB_TRACE2(name, a1, a2)                                               \
+    ULIB__TRACE(name,                                                           \
+                ULIB__TRACE_FMT(1) " " ULIB__TRACE_FMT(2),                      \
+                ULIB__TRACE_ARG(1, a1),                                         \
+                ULIB__TRACE_ARG(2, a2))
+#define ULIB_TRACE3(name, a1, a2, a3)                                           \
+    ULIB__TRACE(name,                                                           \
+                ULIB__TRACE_FMT(1) " " ULIB__TRACE_FMT(2) " " ULIB__TRACE_FMT(3), \
+                ULIB__TRACE_ARG(1, a1),                                         \
+                ULIB__TRACE_ARG(2, a2),                                         \
+                ULIB__TRACE_ARG(3, a3))
+#define ULIB_TRACE4(name, a1, a2, a3, a4)                                       \
+    ULIB__TRACE(name,                                                           \
+                ULIB__TRACE_FMT(1) " " ULIB__TRACE_FMT(2) " " ULIB__TRACE_FMT(3) \
+                                   " " ULIB__TRACE_FMT(4),                      \
+                ULIB__TRACE_ARG(1, a1),                                         \
+                ULIB__TRACE_ARG(2, a2),                                         \
+                ULIB__TRACE_ARG(3, a3),                                         \
+                ULIB__TRACE_ARG(4, a4))
+
+#else
+
+#define ULIB_TRACE0(name) ((void)0)
+#define ULIB_TRACE1(name, a1) ((void)0)
+#define ULIB_TRACE2(name, a1, a2) ((void)0)
+#define ULIB_TRACE3(name, a1, a2, a3) ((void)0)
+#define ULIB_TRACE4(name, a1, a2, a3, a4) ((void)0)
+
+#endif
+
+#endif /* ulib__trace_h */
+
+/*
+ * Local variables:
+ * mode: C
+ * indent-tabs-mode: nil
+ * End:
+ */